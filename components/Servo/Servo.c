@@ -5,14 +5,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_err.h"
+#include "esp_timer.h"
 
 #include "esp8266/gpio_register.h"
 #include "esp8266/pin_mux_register.h"
@@ -23,56 +26,48 @@
 #include "math.h"
 
 #include "Servo.h"
+#include "servo_core.h"
+#include "boot.h"
+#include "sysmon.h"
+#include "recorder.h"
 
-#define PWM_PIN_BLDC_DOWN				12
-#define PWM_PIN_BLDC_LEFT				13
-#define PWM_PIN_BLDC_RIGHT				14
-#define PWM_PIN_SERVO_X					4
-#define PWM_PIN_SERVO_Y					5
-#define PWM_PIN_SERVO_FEEDER			2
-
-#define REVERSE_PIN_BLDC_DOWN			0
-#define REVERSE_PIN_BLDC_LEFT			15
-#define REVERSE_PIN_BLDC_RIGHT			16
-#define GPIO_OUTPUT_PIN_SEL				((1ULL<<REVERSE_PIN_BLDC_DOWN) | (1ULL<<REVERSE_PIN_BLDC_LEFT) | (1ULL<<REVERSE_PIN_BLDC_RIGHT))
 //#define BALL_PROXIMITY_SENSOR_PIN		ADC0
 //#define GPIO_INPUT_PIN_SEL  (1ULL<<BALL_PROXIMITY_SENSOR_PIN)
 
-#define PWM_BLDC_DOWN_CHANNEL			0
-#define PWM_BLDC_LEFT_CHANNEL			1
-#define PWM_BLDC_RIGHT_CHANNEL			2
-#define PWM_BLDC_SERVO_X_CHANNEL		3
-#define PWM_BLDC_SERVO_Y_CHANNEL		4
-#define PWM_BLDC_SERVO_FEEDER_CHANNEL	5
-
-#define PWM_CHANNEL_NUM					6
-
-#define MIN_ANGLE_DUTY					1000
-#define MAX_ANGLE_DUTY					19000
 #define MIN_ANGLE_DEGREE			   -30
 #define MAX_ANGLE_DEGREE				30
-#define MIN_BPM							0
-#define MAX_BPM							100
 
 #define PWM_PERIOD						20000		// PWM period 20ms - 50hz (20000 uS)
 
-QueueHandle_t servoPositionQueue;
-QueueHandle_t servoBLDCQueue;
-QueueHandle_t servoFeederQueue;
+#define SERVO_SPIN_WINDOW_US			2000		// busy-wait margin before a scheduled event
+
+/* Sleeping towards a deadline is only as fine as the tick, the busy-wait covers
+   the margin plus up to one tick. With a longer tick that spin, above lwIP and
+   the WiFi tasks, would grow with it. */
+#if (CONFIG_FREERTOS_HZ < 1000)
+#error "Servo timing needs CONFIG_FREERTOS_HZ=1000, a longer tick lengthens the busy-wait before every scheduled event"
+#endif
+
+/* Channel numbers, duties and the control decisions are in servo_core.c, this
+   file runs them in the control task and drives the outputs */
+#define SERVO_PIN(name, pin, ...)		pin,
+#define REVERSE_PIN_BIT(name, pin, reversePin, ...)	\
+	| (((reversePin) == SERVO_NO_PIN) ? 0ULL : (1ULL << (((reversePin) == SERVO_NO_PIN) ? 0 : (reversePin))))
+
+#define GPIO_OUTPUT_PIN_SEL				(0ULL SERVO_WHEELS(REVERSE_PIN_BIT))
+
 QueueHandle_t servoControlQueue;
+EventGroupHandle_t servoEventGroup;
+static SemaphoreHandle_t scheduleMutex;
 
 static const char *TAG = "servo_control";
 // pwm pin number
 const uint32_t pin_num[PWM_CHANNEL_NUM] = {
-	PWM_PIN_BLDC_DOWN,
-	PWM_PIN_BLDC_LEFT,
-	PWM_PIN_BLDC_RIGHT,
-	PWM_PIN_SERVO_X,
-	PWM_PIN_SERVO_Y,
-	PWM_PIN_SERVO_FEEDER	
+	SERVO_WHEELS(SERVO_PIN)
+	SERVO_POSITIONS(SERVO_PIN)
+	SERVO_FEEDERS(SERVO_PIN)
 };
 
-uint32_t duty[PWM_CHANNEL_NUM] = { 0 };
 float phase[PWM_CHANNEL_NUM] = { 0 };
 enum trainingProgram
 {
@@ -90,160 +85,355 @@ struct speed
 	uint16_t right;
 };
 
-static void ramp_speed(uint32_t speed_sp, uint32_t *ramped_speed, float rampKi)
+/* Schedule, output state and duties, stepped by the control task. Other tasks
+   only touch latest and the calibration table, both under scheduleMutex, which
+   the control task holds for a step. */
+static servoCore core;
+
+/* Dead-man watchdog: last sign of life from a client, guarded by a critical
+   section as 64 bit accesses are not atomic here. A trip request from another
+   task is picked up by the control task on its next pass. */
+static int64_t aliveTime;
+static volatile servoTrip tripRequest = SERVO_TRIP_NONE;
+
+/* Idle power state, requested from other tasks and carried out by the control task */
+static volatile bool suspendRequest;
+static volatile bool resumeRequest;
+
+static TaskHandle_t controlTask;
+
+/* Published copy of the output state, read from other tasks in a critical section */
+static servoStatus status;
+
+void servo_spin_mix(const joystick *spin, int16_t speed[SERVO_WHEEL_NUM])
 {
-	int32_t err, err_abs;
-	int8_t sign;
+	servo_core_mix(spin, speed);
+}
 
-	err = (int32_t)speed_sp - (int32_t)*ramped_speed;
-	err_abs = abs(err);
-	if (err_abs > rampKi)
-	{
-		sign = err / err_abs;
-		*ramped_speed += (rampKi * sign);
-	}
-	else
-	{
-		*ramped_speed = speed_sp;
+#define REVERSE_WRITE(name, pin, reversePin, ...) \
+	if ((reversePin) != SERVO_NO_PIN) \
+	{ \
+		gpio_set_level((reversePin), (core.reverse >> WHEEL_##name) & 1); \
 	}
+
+static int64_t servo_alive_time()
+{
+	int64_t time;
+	
+	taskENTER_CRITICAL();
+	time = aliveTime;
+	taskEXIT_CRITICAL();
+	return time;
+}
+
+static const char *const tripName[] = { "none", "timeout", "disconnect" };
+
+/* Publish the output state and flag what changed, called by the control task */
+static void servo_publish(EventBits_t events)
+{
+	servoStatus now = {
+		.BPM = core.ballFrequency,
+		.rampedBPM = core.rampedFrequency,
+		.pending = core.scheduleCount,
+		.armed = core.escArmed,
+		.suspended = core.suspended,
+		.tripped = core.tripped,
+		.lastTrip = core.stats.lastTrip
+	};
+	
+	taskENTER_CRITICAL();
+	status = now;
+	taskEXIT_CRITICAL();
+	xEventGroupSetBits(servoEventGroup, events);
 }
 
-static void servo_BLDC(void *argument)
+/* Log and record the safe stop the core just started */
+static void servo_tripped()
 {
-	int16_t speed[3] = { };
+	uint8_t payload = core.stats.lastTrip;
+	
+	ESP_LOGW(TAG, "Safe stop, reason %d (%s), feeder at %u BPM", payload, tripName[payload], core.rampedFrequency);
+	recorder_write(RECORD_TRIP, &payload, sizeof(payload));
+}
 
-	servoBLDCQueue = xQueueCreate(10, sizeof(speed));
-	if (servoBLDCQueue == NULL)
+/* Detach the outputs, only from rest. Without pulses the ESCs disarm and the
+   servos stop holding, the duties stay set for when the PWM starts again. */
+static bool servo_detach()
+{
+	if (!servo_core_at_rest(&core))
 	{
-		ESP_LOGE(TAG, "Create servoBLDCQueue fail");
+		return false;
 	}
 	
-	while (1) 
+	ESP_ERROR_CHECK(pwm_stop(0));
+	core.escArmed = false;
+	core.suspended = true;
+	ESP_LOGI(TAG, "Outputs detached");
+	servo_publish(SERVO_EVENT_IDLE);
+	return true;
+}
+
+/* Same duties back on the outputs, the ESCs take the arming time again */
+static void servo_attach()
+{
+	ESP_ERROR_CHECK(pwm_start());
+	core.armTime = esp_timer_get_time() + (int64_t)ESC_ARM_TIME_MS * 1000;
+	core.suspended = false;
+	ESP_LOGI(TAG, "Outputs attached");
+	servo_publish(SERVO_EVENT_IDLE);
+}
+
+/* Start the PWM period with the core's duties and record what went out */
+static void servo_commit()
+{
+	uint8_t payload[PWM_CHANNEL_NUM * 2];
+	
+	for (int channel = 0; channel < PWM_CHANNEL_NUM; channel++)
 	{
-		BaseType_t r = xQueueReceive(servoBLDCQueue, &speed, portMAX_DELAY);
-		
-		if (r == pdTRUE)
-		{
-			pwm_set_duty(PWM_BLDC_DOWN_CHANNEL, abs(speed[0]));
-			pwm_set_duty(PWM_BLDC_LEFT_CHANNEL, abs(speed[1]));
-			pwm_set_duty(PWM_BLDC_RIGHT_CHANNEL, abs(speed[2]));
-			pwm_start();
-		}
+		pwm_set_duty(channel, core.duty[channel]);
+		payload[channel * 2] = core.duty[channel] >> 8;
+		payload[channel * 2 + 1] = core.duty[channel];
 	}
+	SERVO_WHEELS(REVERSE_WRITE)
+	ESP_ERROR_CHECK(pwm_start());
+	recorder_write(RECORD_PWM_COMMIT, payload, sizeof(payload));
 }
 
-static void servo_position(void *argument)
+/* Block for new setpoints until the deadline. Periodic steps (ramp, coalescing,
+   spin-down, watchdog) only need the tick, their output changes with the next
+   PWM period anyway. A scheduled event is timed to the microsecond: the tick
+   only gets us close, the last stretch is busy-waited at the highest
+   application priority so other tasks cannot shift it. */
+static bool servo_wait(int64_t deadline, bool precise)
 {
-	uint8_t position[2] = { };
-	uint16_t duty[2] = { };
-
-	servoPositionQueue = xQueueCreate(10, sizeof(position));
-	if (servoPositionQueue == NULL) 
+	TickType_t wait = portMAX_DELAY;
+	int64_t tick = portTICK_PERIOD_MS * 1000;
+	
+	if (deadline != INT64_MAX)
 	{
-		ESP_LOGE(TAG, "Create servoPositionQueue fail");
+		int64_t sleep = deadline - esp_timer_get_time();
+		
+		sleep = precise ? (sleep - SERVO_SPIN_WINDOW_US) / tick : (sleep + tick - 1) / tick;
+		wait = (sleep > 0) ? (TickType_t)sleep : 0;
 	}
 	
-	while (1) 
+	if (ulTaskNotifyTake(pdTRUE, wait) > 0)
+	{
+		return true;
+	}
+	
+	while (precise && (esp_timer_get_time() < deadline))
 	{
-		BaseType_t r = xQueueReceive(servoPositionQueue, &position, portMAX_DELAY);
-		if (r == pdTRUE)
-		{
-			duty[0] = ((float)position[0] / 100.0) * (MAX_ANGLE_DUTY - MIN_ANGLE_DUTY) + MIN_ANGLE_DUTY;
-			duty[1] = ((float)position[1] / 100.0) * (MAX_ANGLE_DUTY - MIN_ANGLE_DUTY) + MIN_ANGLE_DUTY;
-			pwm_set_duty(PWM_BLDC_SERVO_X_CHANNEL, duty[0]);
-			pwm_set_duty(PWM_BLDC_SERVO_Y_CHANNEL, duty[1]);
-			pwm_start();
-		}
 	}
+	return false;
 }
 
-static void servo_feeder(void *argument)
+static void servo_control(void *argument)
 {
-	uint32_t ballFrequency = MIN_BPM;
-	uint32_t rampedFrequency = 0;
-	uint32_t dutySetpoint = 0;
-	servoFeederQueue = xQueueCreate(10, sizeof(ballFrequency));
-	if (servoFeederQueue == NULL) 
-	{
-		ESP_LOGE(TAG, "Create servoFeederQueue fail");
-	}
+	servoEvent event;
 	
-	while (1) 
+	for (;;)
 	{
-		BaseType_t r = xQueueReceive(servoFeederQueue, &ballFrequency, portMAX_DELAY);
-		if (r == pdTRUE)
+		if (tripRequest != SERVO_TRIP_NONE)
 		{
-			ESP_LOGI(TAG, "New BPM setpoint received %d", ballFrequency);
-			
-			/*if (ballFrequency < MIN_BPM)
+			if (!core.tripped)
 			{
-				ballFrequency = MIN_BPM;
+				xSemaphoreTake(scheduleMutex, portMAX_DELAY);
+				servo_core_trip(&core, tripRequest, esp_timer_get_time());
+				xQueueReset(servoControlQueue);
+				xSemaphoreGive(scheduleMutex);
+				servo_tripped();
+				servo_publish(SERVO_EVENT_TRIP);
 			}
-			else */
-			if (ballFrequency > MAX_BPM)
+			tripRequest = SERVO_TRIP_NONE;
+		}
+		
+		if (suspendRequest)
+		{
+			suspendRequest = false;
+			if (!core.suspended && !servo_detach())
 			{
-				ballFrequency = MAX_BPM;
-			}	
+				ESP_LOGD(TAG, "Outputs busy, not detached");
+			}
 		}
+		
 
-		while (ballFrequency != rampedFrequency)
+		// Take everything queued before firing, a batch lands as a whole
+		while (xQueueReceive(servoControlQueue, &event, 0) == pdTRUE)
+		{
+			if (!servo_core_insert(&core, &event))
+			{
+				ESP_LOGW(TAG, "Schedule full, setpoint dropped");
+			}
+		}
+		
+		// Anything to put out brings the outputs back
+		if (core.suspended && (resumeRequest || (core.scheduleCount > 0) || (core.latest.fields != 0)))
 		{
-			ramp_speed(ballFrequency, &rampedFrequency, 1);
-			dutySetpoint = ((float)rampedFrequency / 100.0) * (MAX_ANGLE_DUTY - MIN_ANGLE_DUTY) + MIN_ANGLE_DUTY;
-			pwm_set_duty(PWM_BLDC_SERVO_FEEDER_CHANNEL, dutySetpoint);
-			ESP_ERROR_CHECK(pwm_start());
-			ESP_LOGI(TAG, "Ball frequency %d", dutySetpoint);
-			vTaskDelay(pdMS_TO_TICKS(5));
+			servo_attach();
+		}
+		resumeRequest = false;
+		
+		bool precise;
+		int64_t deadline = servo_core_deadline(&core, servo_alive_time(), &precise);
+		
+		if (servo_wait(deadline, precise))
+		{
+			continue;
+		}
+		
+		bool commit;
+		EventBits_t events;
+		
+		// A heartbeat that came in while we waited counts, the expiry is read again
+		xSemaphoreTake(scheduleMutex, portMAX_DELAY);
+		events = servo_core_step(&core, esp_timer_get_time(), servo_alive_time(), &commit);
+		if (events & SERVO_EVENT_TRIP)
+		{
+			// Setpoints queued before the stop go with the pending ones
+			xQueueReset(servoControlQueue);
+		}
+		xSemaphoreGive(scheduleMutex);
+		
+		if (events & SERVO_EVENT_TRIP)
+		{
+			servo_tripped();
+		}
+		
+		if (events & SERVO_EVENT_ARMED)
+		{
+			boot_mark(BOOT_PHASE_ESC_ARMED);
+		}
+		
+		if (commit)
+		{
+			servo_commit();
+		}
+		
+		if (events != 0)
+		{
+			servo_publish(events);
 		}
 	}
 }
-void manual_control()
+
+bool servo_schedule(const servoSetpoint *setpoint, uint8_t count)
 {
+	servoEvent event;
+	bool queued = false;
 	
+	xSemaphoreTake(scheduleMutex, portMAX_DELAY);
+	if (servo_core_immediate(&core, setpoint, count, esp_timer_get_time()))
+	{
+		queued = true;
+	}
+	else if (uxQueueSpacesAvailable(servoControlQueue) >= count)
+	{
+		// All or nothing, a batch is never applied partially
+		for (int i = 0; i < count; i++)
+		{
+			servo_core_event(&core, &setpoint[i], &event);
+			xQueueSend(servoControlQueue, &event, 0);
+		}
+		queued = true;
+	}
+	xSemaphoreGive(scheduleMutex);
+	
+	if (queued)
+	{
+		xTaskNotifyGive(controlTask);
+	}
+	return queued;
 }
-void random_control()
+
+void servo_alive()
 {
+	int64_t now = esp_timer_get_time();
 	
+	taskENTER_CRITICAL();
+	aliveTime = now;
+	taskEXIT_CRITICAL();
 }
 
-static void control(void *argument)
+void servo_safe_stop(servoTrip reason)
 {
-	enum trainingProgram programm = 0;
-	prgogrammSp programmSp = { 0 };
-	for (;;)
-	{			
-		BaseType_t r = xQueueReceive(servoFeederQueue, &programmSp.BPM, portMAX_DELAY);
-		if (r == pdTRUE)
-		{
-			ESP_LOGI(TAG, "New BPM setpoint received %d", programmSp.BPM);
-			
-			/*if (programmSp.BPM < MIN_BPM)
-			{
-				programmSp.BPM = MIN_BPM;
-			}
-			else */
-			if (programmSp.BPM > MAX_BPM)
-			{
-				programmSp.BPM = MAX_BPM;
-			}	
-		}
-		
-		switch (programm)
-		{
-		case MANUAL:
-			manual_control();
-			break;
-		case RANDOM:
-			random_control();
-			break;
-		case BOX:
-			break;
-		case PROGRAMM:
-			break;
-		default:break;
-		}
-		vTaskDelay(pdMS_TO_TICKS(100));
+	tripRequest = reason;
+	xTaskNotifyGive(controlTask);
+}
+
+void servo_suspend()
+{
+	suspendRequest = true;
+	xTaskNotifyGive(controlTask);
+}
+
+void servo_resume()
+{
+	resumeRequest = true;
+	xTaskNotifyGive(controlTask);
+}
+
+bool servo_suspended()
+{
+	return core.suspended;
+}
+
+const char *servo_trip_name(servoTrip reason)
+{
+	return (reason < SERVO_TRIP_NUM) ? tripName[reason] : "unknown";
+}
+
+int32_t servo_idle_ms()
+{
+	return (int32_t)((esp_timer_get_time() - servo_alive_time()) / 1000);
+}
+
+void servo_get_stats(servoStats *out)
+{
+	*out = core.stats;
+}
+
+bool servo_set_calibration(const servoCalibration *table)
+{
+	servoCalibration linear;
+	
+	if (table == NULL)
+	{
+		servo_core_calibration_linear(&linear);
+		table = &linear;
 	}
+	else if (!servo_core_calibration_valid(table))
+	{
+		return false;
+	}
+	
+	xSemaphoreTake(scheduleMutex, portMAX_DELAY);
+	core.calibration = *table;
+	xSemaphoreGive(scheduleMutex);
+	return true;
+}
+
+void servo_get_calibration(servoCalibration *table)
+{
+	xSemaphoreTake(scheduleMutex, portMAX_DELAY);
+	*table = core.calibration;
+	xSemaphoreGive(scheduleMutex);
+}
+
+void servo_get_status(servoStatus *out)
+{
+	taskENTER_CRITICAL();
+	*out = status;
+	taskEXIT_CRITICAL();
+}
+
+void manual_control()
+{
+	
+}
+void random_control()
+{
+	
 }
 
 void gpio_adc_init(void)
@@ -284,13 +474,31 @@ void gpio_adc_init(void)
 
 void servo_init()
 {
-	//Initilize all servo channels with 0 duty
-	pwm_init(PWM_PERIOD, duty, PWM_CHANNEL_NUM, pin_num);
+	// Safe duties and the linear calibration, the ESCs arm from now on
+	servo_core_init(&core, esp_timer_get_time());
+
+	//Initilize all servo channels with the safe duty, wheels at ESC min throttle
+	pwm_init(PWM_PERIOD, core.duty, PWM_CHANNEL_NUM, pin_num);
 	pwm_set_phases(phase);
 	pwm_start();	
 	gpio_adc_init();
-	xTaskCreate(servo_position, "servo_position", 1024, NULL, 5, NULL);
-	xTaskCreate(servo_BLDC, "servo_BLDC", 1024, NULL, 5, NULL);
-	xTaskCreate(servo_feeder, "servo_feeder", 1024, NULL, 5, NULL);
-	//xTaskCreate(control, "servo_control", 256, NULL, 5, NULL);
+	boot_mark(BOOT_PHASE_ACTUATORS_SAFE);
+	
+	// Queue exists before any network task can send to it
+	servoControlQueue = xQueueCreate(SERVO_CONTROL_QUEUE_LENGTH, sizeof(servoEvent));
+	if (servoControlQueue == NULL) 
+	{
+		ESP_LOGE(TAG, "Create servoControlQueue fail");
+	}
+	scheduleMutex = xSemaphoreCreateMutex();
+	
+	servoEventGroup = xEventGroupCreate();
+	if (servoEventGroup == NULL) 
+	{
+		ESP_LOGE(TAG, "Create servoEventGroup fail");
+	}
+	
+	sysmon_register_queue("servo_control", servoControlQueue, SERVO_CONTROL_QUEUE_LENGTH);
+	
+	xTaskCreate(servo_control, "servo_control", TASK_STACK_SERVO_CONTROL, NULL, TASK_PRIORITY_ACTUATOR, &controlTask);
 }
\ No newline at end of file
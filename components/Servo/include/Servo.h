@@ -1,5 +1,26 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#include "servo_channels.h"
+
+#define SERVO_CONTROL_QUEUE_LENGTH	16	/* setpoints in flight to the control task */
+#define SERVO_SCHEDULE_LENGTH		32	/* timed setpoints waiting for their deadline */
+
+#define SERVO_COUNT(...)			+ 1
+#define SERVO_WHEEL_NUM				(0 SERVO_WHEELS(SERVO_COUNT))
+#define SERVO_POSITION_NUM			(0 SERVO_POSITIONS(SERVO_COUNT))
+#define SERVO_SPEED_RANGE			1000	/* wheel speed at full throttle, either direction */
+
+/* Fields carried by a setpoint */
+#define SERVO_FIELD_BPM				(1 << 0)
+#define SERVO_FIELD_SPIN			(1 << 1)
+#define SERVO_FIELD_POSITION		(1 << 2)
+
 typedef struct joystick_t 
 {
 	float angle;
@@ -25,4 +46,95 @@ typedef struct servoSp_t
 	uint32_t servoDuty[2];
 	uint32_t shooterDuty[3];
 } servoSp;
-void servo_init();
\ No newline at end of file
+/* Setpoint committed by the control task in a single PWM update */
+typedef struct servoSetpoint_t
+{
+	int64_t at;					/* time to apply at, esp_timer_get_time() microseconds */
+	uint8_t fields;				/* SERVO_FIELD_* present */
+	uint8_t position[2];		/* x/y 0-100 % of the servo travel */
+	int16_t speed[SERVO_WHEEL_NUM];	/* wheel speeds in SERVO_WHEELS order, +/-SERVO_SPEED_RANGE */
+	uint32_t BPM;
+} servoSetpoint;
+
+/* Wheel calibration: duty per target speed, SERVO_CALIB_POINTS evenly spaced over
+   0..SERVO_SPEED_RANGE. Speeds in between are interpolated in integer math. */
+#define SERVO_CALIB_POINTS			9
+
+typedef struct servoCalibration_t
+{
+	uint16_t duty[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];	/* rising, within the wheel's duty range */
+} servoCalibration;
+
+/* Dead-man timeout, clients send a command or {"heartbeat":1} more often than this */
+#define SERVO_WATCHDOG_TIMEOUT_MS	1000
+
+/* Reason codes of a safe stop */
+typedef enum
+{
+	SERVO_TRIP_NONE = 0,
+	SERVO_TRIP_TIMEOUT,			/* no command or heartbeat within SERVO_WATCHDOG_TIMEOUT_MS */
+	SERVO_TRIP_DISCONNECT,		/* the controlling client went away */
+	SERVO_TRIP_NUM
+} servoTrip;
+
+/* Setpoints that never reached the outputs, and safe stops */
+typedef struct servoStats_t
+{
+	uint32_t coalesced;			/* fields overwritten by a newer immediate setpoint within a control tick */
+	uint32_t dropped;			/* timed setpoints the schedule had no room for */
+	uint32_t trips;				/* safe stops so far */
+	servoTrip lastTrip;
+} servoStats;
+
+/* Actuator state changes, bits of servoEventGroup. The control task sets them,
+   whoever reports them clears them, so changes between two reports coalesce. */
+#define SERVO_EVENT_SETPOINT		(1 << 0)	/* immediate setpoint went out */
+#define SERVO_EVENT_STEP			(1 << 1)	/* timed step of a batch went out */
+#define SERVO_EVENT_RAMP_DONE		(1 << 2)	/* feeder reached its BPM setpoint */
+#define SERVO_EVENT_TRIP			(1 << 3)	/* safe stop started */
+#define SERVO_EVENT_STOPPED			(1 << 4)	/* safe stop finished, wheels at rest */
+#define SERVO_EVENT_ARMED			(1 << 5)	/* ESCs armed, wheel setpoints reach the outputs */
+#define SERVO_EVENT_IDLE			(1 << 6)	/* outputs detached or attached again */
+#define SERVO_EVENT_NUM				7
+#define SERVO_EVENT_ALL				((1 << SERVO_EVENT_NUM) - 1)
+
+/* Actuator state as of the last change */
+typedef struct servoStatus_t
+{
+	uint32_t BPM;				/* feeder setpoint */
+	uint32_t rampedBPM;			/* feeder rate right now */
+	uint8_t pending;			/* timed steps waiting for their deadline */
+	bool armed;
+	bool suspended;				/* outputs detached to save power */
+	bool tripped;				/* safe stop in effect until the next setpoint */
+	servoTrip lastTrip;
+} servoStatus;
+
+extern EventGroupHandle_t servoEventGroup;
+
+void servo_init();
+/* Queue setpoints for the control task, all of them or none, returns false if they don't fit.
+   A single setpoint due now is coalesced with other immediate ones instead of queued. */
+bool servo_schedule(const servoSetpoint *setpoint, uint8_t count);
+/* Spin mixer: joystick angle in whole degrees and distance in % to signed wheel speeds,
+   integer math on a cosine table */
+void servo_spin_mix(const joystick *spin, int16_t speed[SERVO_WHEEL_NUM]);
+void servo_get_stats(servoStats *stats);
+void servo_get_status(servoStatus *status);
+/* Table used for wheel setpoints from now on, NULL restores the linear default.
+   Returns false if a table is out of the wheel's duty range or not rising. */
+bool servo_set_calibration(const servoCalibration *calibration);
+void servo_get_calibration(servoCalibration *calibration);
+/* Feed the dead-man watchdog, on every valid command or heartbeat */
+void servo_alive();
+/* Ramp down to the safe state now, from any task */
+void servo_safe_stop(servoTrip reason);
+const char *servo_trip_name(servoTrip reason);
+/* Idle power state: detach the PWM outputs and let the ESCs disarm, only taken
+   while everything is at rest. Any setpoint or servo_resume() attaches them again,
+   wheel setpoints then wait for the ESCs to re-arm. */
+void servo_suspend();
+void servo_resume();
+bool servo_suspended();
+/* Milliseconds since the last command or heartbeat */
+int32_t servo_idle_ms();
\ No newline at end of file
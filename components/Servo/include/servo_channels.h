@@ -0,0 +1,28 @@
+#pragma once
+
+/* Channel map of the robot, the one place to edit for another variant.
+
+   PWM channels are numbered in table order: wheels, then position servos, then
+   feeders. Pins are GPIO numbers. Duties are pulse widths in microseconds of
+   the 20 ms PWM period. Everything derived from these tables is resolved at
+   compile time, the control loop has no per-channel lookups. */
+
+#define SERVO_NO_PIN			(-1)	/* wheel without a reverse pin */
+
+/* ESC driven shooter wheels, a negative speed sets the reverse pin
+   X(name, pin, reversePin, angle around the ball in degrees, duty at standstill, duty at full speed) */
+#define SERVO_WHEELS(X) \
+	X(BLDC_DOWN,		12,	0,	270,	1000,	2000) \
+	X(BLDC_LEFT,		13,	15,	150,	1000,	2000) \
+	X(BLDC_RIGHT,		14,	16,	30,		1000,	2000)
+
+/* Aiming servos, centered until the first position arrives
+   X(name, pin, axis 0 = x 1 = y, duty at 0 %, duty at 100 %) */
+#define SERVO_POSITIONS(X) \
+	X(SERVO_X,			4,	0,	1000,	19000) \
+	X(SERVO_Y,			5,	1,	1000,	19000)
+
+/* Ball feeders, all of them run at the commanded BPM
+   X(name, pin, duty at 0 BPM, duty at MAX_BPM) */
+#define SERVO_FEEDERS(X) \
+	X(SERVO_FEEDER,		2,	1000,	19000)
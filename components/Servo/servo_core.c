@@ -0,0 +1,436 @@
+/* servo control core
+
+   The control task's decisions, no RTOS or driver calls, built for the robot
+   and for host/replay.c.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <math.h>
+
+#include "servo_core.h"
+
+// Safe state applied before anything else runs: wheels at ESC min throttle, servos centered, feeders stopped
+#define WHEEL_SAFE_DUTY(name, pin, reversePin, angle, minDuty, maxDuty)		minDuty,
+#define POSITION_SAFE_DUTY(name, pin, axis, minDuty, maxDuty)				(((minDuty) + (maxDuty)) / 2),
+#define FEEDER_SAFE_DUTY(name, pin, minDuty, maxDuty)						minDuty,
+#define WHEEL_ANGLE(name, pin, reversePin, angle, ...)						angle,
+#define WHEEL_MIN_DUTY(name, pin, reversePin, angle, minDuty, maxDuty)		minDuty,
+#define WHEEL_MAX_DUTY(name, pin, reversePin, angle, minDuty, maxDuty)		maxDuty,
+
+static const uint32_t safeDuty[PWM_CHANNEL_NUM] = {
+	SERVO_WHEELS(WHEEL_SAFE_DUTY)
+	SERVO_POSITIONS(POSITION_SAFE_DUTY)
+	SERVO_FEEDERS(FEEDER_SAFE_DUTY)
+};
+
+// Direction of each shooter wheel around the ball, degrees
+static const int16_t wheelAngle[SERVO_WHEEL_NUM] = { SERVO_WHEELS(WHEEL_ANGLE) };
+static const uint16_t wheelMinDuty[SERVO_WHEEL_NUM] = { SERVO_WHEELS(WHEEL_MIN_DUTY) };
+static const uint16_t wheelMaxDuty[SERVO_WHEEL_NUM] = { SERVO_WHEELS(WHEEL_MAX_DUTY) };
+
+#define COS_SHIFT						15			// cosine table values are Q15
+// cos() for 0-90 degrees, lroundf(cosf(degrees) * 2^15) capped at INT16_MAX, the mixer never calls into libm
+static const int16_t cosTable[91] = {
+	32767, 32763, 32748, 32723, 32688, 32643, 32588, 32524, 32449, 32365,
+	32270, 32166, 32052, 31928, 31795, 31651, 31499, 31336, 31164, 30983,
+	30792, 30592, 30382, 30163, 29935, 29698, 29452, 29197, 28932, 28660,
+	28378, 28088, 27789, 27482, 27166, 26842, 26510, 26170, 25822, 25466,
+	25102, 24730, 24351, 23965, 23571, 23170, 22763, 22348, 21926, 21498,
+	21063, 20622, 20174, 19720, 19261, 18795, 18324, 17847, 17364, 16877,
+	16384, 15886, 15384, 14876, 14365, 13848, 13328, 12803, 12275, 11743,
+	11207, 10668, 10126, 9580, 9032, 8481, 7927, 7371, 6813, 6252,
+	5690, 5126, 4560, 3993, 3425, 2856, 2286, 1715, 1144, 572,
+	0
+};
+
+static void ramp_speed(uint32_t speed_sp, uint32_t *ramped_speed, float rampKi)
+{
+	int32_t err, err_abs;
+	int8_t sign;
+
+	err = (int32_t)speed_sp - (int32_t)*ramped_speed;
+	err_abs = abs(err);
+	if (err_abs > rampKi)
+	{
+		sign = err / err_abs;
+		*ramped_speed += (rampKi * sign);
+	}
+	else
+	{
+		*ramped_speed = speed_sp;
+	}
+}
+
+static int32_t cos_q15(int32_t degrees)
+{
+	degrees %= 360;
+	if (degrees < 0)
+	{
+		degrees += 360;
+	}
+
+	if (degrees <= 90)
+	{
+		return cosTable[degrees];
+	}
+	else if (degrees <= 180)
+	{
+		return -cosTable[180 - degrees];
+	}
+	else if (degrees <= 270)
+	{
+		return -cosTable[degrees - 180];
+	}
+	return cosTable[360 - degrees];
+}
+
+void servo_core_mix(const joystick *spin, int16_t speed[SERVO_WHEEL_NUM])
+{
+	// Clamped as floats, converting an out of range float to an integer is undefined
+	int32_t distance = (spin->distance > 0) ? (int32_t)MIN(spin->distance, 100.0f) : 0;
+	int32_t angle = isfinite(spin->angle) ? (int32_t)fmodf(spin->angle, 360.0f) : 0;
+
+	int32_t magnitude = distance * SERVO_SPEED_RANGE / 100;
+	for (int i = 0; i < SERVO_WHEEL_NUM; i++)
+	{
+		speed[i] = (magnitude * cos_q15(angle - wheelAngle[i]) + (1 << (COS_SHIFT - 1))) >> COS_SHIFT;
+	}
+}
+
+/* Called with constant ranges from the table expansions, so they fold per channel */
+static inline uint32_t range_duty(uint32_t value, uint32_t range, uint32_t minDuty, uint32_t maxDuty)
+{
+	return minDuty + MIN(value, range) * (maxDuty - minDuty) / range;
+}
+
+/* Duty between the two calibration points around the speed, the sign is the reverse pin's */
+static uint32_t wheel_duty(int16_t speed, const uint16_t *points)
+{
+	uint32_t scaled = MIN(abs(speed), SERVO_SPEED_RANGE) * (SERVO_CALIB_POINTS - 1);
+	uint32_t index = scaled / SERVO_SPEED_RANGE;
+	int32_t fraction = scaled % SERVO_SPEED_RANGE;
+
+	if (index >= SERVO_CALIB_POINTS - 1)
+	{
+		return points[SERVO_CALIB_POINTS - 1];
+	}
+	return points[index] + ((int32_t)points[index + 1] - (int32_t)points[index]) * fraction / SERVO_SPEED_RANGE;
+}
+
+void servo_core_calibration_linear(servoCalibration *table)
+{
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		for (int point = 0; point < SERVO_CALIB_POINTS; point++)
+		{
+			table->duty[wheel][point] = range_duty(point, SERVO_CALIB_POINTS - 1, wheelMinDuty[wheel], wheelMaxDuty[wheel]);
+		}
+	}
+}
+
+bool servo_core_calibration_valid(const servoCalibration *table)
+{
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		for (int point = 0; point < SERVO_CALIB_POINTS; point++)
+		{
+			uint16_t value = table->duty[wheel][point];
+
+			if ((value < wheelMinDuty[wheel]) || (value > wheelMaxDuty[wheel]) ||
+				((point > 0) && (value < table->duty[wheel][point - 1])))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void servo_core_init(servoCore *core, int64_t now)
+{
+	static const uint32_t safeWheelDuty[SERVO_WHEEL_NUM] = { SERVO_WHEELS(WHEEL_SAFE_DUTY) };
+
+	memset(core, 0, sizeof(*core));
+	memcpy(core->duty, safeDuty, sizeof(core->duty));
+	memcpy(core->wheelDuty, safeWheelDuty, sizeof(core->wheelDuty));
+	core->ballFrequency = MIN_BPM;
+	core->rampedFrequency = MIN_BPM;
+	core->armTime = now + (int64_t)ESC_ARM_TIME_MS * 1000;
+
+	// Linear until a stored calibration is loaded
+	servo_core_calibration_linear(&core->calibration);
+}
+
+#define WHEEL_EVENT(name, pin, reversePin, angle, minDuty, maxDuty) \
+	event->wheelDuty[WHEEL_##name] = wheel_duty(setpoint->speed[WHEEL_##name], core->calibration.duty[WHEEL_##name]); \
+	event->wheelReverse |= (setpoint->speed[WHEEL_##name] < 0) ? (1 << WHEEL_##name) : 0;
+#define POSITION_EVENT(name, pin, axis, minDuty, maxDuty) \
+	event->positionDuty[POSITION_##name] = range_duty(setpoint->position[axis], POSITION_RANGE, minDuty, maxDuty);
+
+void servo_core_event(const servoCore *core, const servoSetpoint *setpoint, servoEvent *event)
+{
+	// Duties are worked out here, in the sender's time, not when the event fires
+	memset(event, 0, sizeof(*event));
+	event->at = setpoint->at;
+	event->fields = setpoint->fields;
+	SERVO_POSITIONS(POSITION_EVENT)
+	SERVO_WHEELS(WHEEL_EVENT)
+	event->BPM = (setpoint->BPM > MAX_BPM) ? MAX_BPM : setpoint->BPM;
+}
+
+static void servo_event_merge(servoCore *core, servoEvent *to, const servoEvent *from)
+{
+	uint8_t overwritten = to->fields & from->fields;
+
+	// Values that never reach the outputs
+	for (; overwritten != 0; overwritten &= overwritten - 1)
+	{
+		core->stats.coalesced++;
+	}
+
+	if (from->fields & SERVO_FIELD_POSITION)
+	{
+		memcpy(to->positionDuty, from->positionDuty, sizeof(to->positionDuty));
+	}
+	if (from->fields & SERVO_FIELD_SPIN)
+	{
+		memcpy(to->wheelDuty, from->wheelDuty, sizeof(to->wheelDuty));
+		to->wheelReverse = from->wheelReverse;
+	}
+	if (from->fields & SERVO_FIELD_BPM)
+	{
+		to->BPM = from->BPM;
+	}
+	to->fields |= from->fields;
+	to->at = from->at;
+}
+
+bool servo_core_immediate(servoCore *core, const servoSetpoint *setpoint, uint8_t count, int64_t now)
+{
+	servoEvent event;
+
+	if ((count != 1) || (setpoint[0].at > now))
+	{
+		return false;
+	}
+
+	// Immediate setpoints never queue up, the latest value per field wins
+	servo_core_event(core, &setpoint[0], &event);
+	servo_event_merge(core, &core->latest, &event);
+	return true;
+}
+
+bool servo_core_insert(servoCore *core, const servoEvent *event)
+{
+	int i;
+
+	if (core->scheduleCount >= SERVO_SCHEDULE_LENGTH)
+	{
+		core->stats.dropped++;
+		return false;
+	}
+
+	// Equal times keep their arrival order
+	for (i = core->scheduleCount; i > 0; i--)
+	{
+		if (core->schedule[i - 1].at <= event->at)
+		{
+			break;
+		}
+		core->schedule[i] = core->schedule[i - 1];
+	}
+	core->schedule[i] = *event;
+	core->scheduleCount++;
+	return true;
+}
+
+static void schedule_pop(servoCore *core)
+{
+	core->scheduleCount--;
+	memmove(&core->schedule[0], &core->schedule[1], core->scheduleCount * sizeof(core->schedule[0]));
+}
+
+#define WHEEL_WRITE(name, ...) \
+	core->duty[PWM_CHANNEL_##name] = core->wheelDuty[WHEEL_##name];
+#define POSITION_WRITE(name, ...) \
+	core->duty[PWM_CHANNEL_##name] = event->positionDuty[POSITION_##name];
+#define FEEDER_WRITE(name, pin, minDuty, maxDuty) \
+	core->duty[PWM_CHANNEL_##name] = range_duty(frequency, MAX_BPM, minDuty, maxDuty);
+
+static void servo_write_wheels(servoCore *core)
+{
+	SERVO_WHEELS(WHEEL_WRITE)
+	core->reverse = core->wheelReverse;
+}
+
+static void servo_write_feeders(servoCore *core, uint32_t frequency)
+{
+	SERVO_FEEDERS(FEEDER_WRITE)
+}
+
+#define WHEEL_RUNNING(name, pin, reversePin, angle, minDuty, maxDuty) \
+	|| (core->wheelDuty[WHEEL_##name] != (minDuty))
+#define WHEEL_STOP_STEP(name, pin, reversePin, angle, minDuty, maxDuty) \
+	core->wheelDuty[WHEEL_##name] = MAX((int32_t)(minDuty), \
+		(int32_t)core->wheelDuty[WHEEL_##name] - (int32_t)(((maxDuty) - (minDuty)) * SERVO_CONTROL_TICK_US / WHEEL_STOP_TIME_US));
+
+static bool servo_wheels_running(const servoCore *core)
+{
+	return false SERVO_WHEELS(WHEEL_RUNNING);
+}
+
+bool servo_core_at_rest(const servoCore *core)
+{
+	return (core->ballFrequency == MIN_BPM) && (core->rampedFrequency == MIN_BPM) && !servo_wheels_running(core) &&
+		(core->scheduleCount == 0) && (core->latest.fields == 0);
+}
+
+void servo_core_trip(servoCore *core, servoTrip reason, int64_t now)
+{
+	core->tripped = true;
+	core->stats.trips++;
+	core->stats.lastTrip = reason;
+
+	core->scheduleCount = 0;
+	core->latest.fields = 0;
+
+	core->ballFrequency = MIN_BPM;
+	core->rampTime = now;
+	core->stopTime = now;
+}
+
+/* Write out the fields of an event, the next commit puts them out together */
+static void servo_fire(servoCore *core, const servoEvent *event, int64_t now)
+{
+	if (event->fields & SERVO_FIELD_POSITION)
+	{
+		SERVO_POSITIONS(POSITION_WRITE)
+	}
+
+	if (event->fields & SERVO_FIELD_SPIN)
+	{
+		memcpy(core->wheelDuty, event->wheelDuty, sizeof(core->wheelDuty));
+		core->wheelReverse = event->wheelReverse;
+		if (core->escArmed)
+		{
+			servo_write_wheels(core);
+		}
+	}
+
+	if (event->fields & SERVO_FIELD_BPM)
+	{
+		core->ballFrequency = event->BPM;
+		core->rampTime = now;
+	}
+
+	// A new setpoint takes over from a safe stop
+	core->tripped = false;
+}
+
+int64_t servo_core_deadline(const servoCore *core, int64_t aliveTime, bool *precise)
+{
+	// Next thing due: scheduled event, immediate setpoint, ESC arming, feeder ramp step,
+	// watchdog expiry or wheel spin-down step
+	int64_t deadline = INT64_MAX;
+	bool running = (core->rampedFrequency != MIN_BPM) || servo_wheels_running(core);
+
+	if (core->scheduleCount > 0)
+	{
+		deadline = MIN(deadline, core->schedule[0].at);
+	}
+	// On the robot latest is written by other tasks, a stale read only delays us to the next notification
+	if (core->latest.fields != 0)
+	{
+		deadline = MIN(deadline, core->latestTime + SERVO_CONTROL_TICK_US);
+	}
+	if (!core->escArmed && !core->suspended)
+	{
+		deadline = MIN(deadline, core->armTime);
+	}
+	if (core->ballFrequency != core->rampedFrequency)
+	{
+		deadline = MIN(deadline, core->rampTime);
+	}
+	if (!core->tripped && running)
+	{
+		deadline = MIN(deadline, aliveTime + (int64_t)SERVO_WATCHDOG_TIMEOUT_MS * 1000);
+	}
+	if (core->tripped && (core->rampedFrequency == MIN_BPM) && servo_wheels_running(core))
+	{
+		deadline = MIN(deadline, core->stopTime);
+	}
+
+	// Only a scheduled event due first is worth spinning for
+	*precise = (core->scheduleCount > 0) && (core->schedule[0].at == deadline);
+	return deadline;
+}
+
+EventBits_t servo_core_step(servoCore *core, int64_t now, int64_t aliveTime, bool *commit)
+{
+	bool running = (core->rampedFrequency != MIN_BPM) || servo_wheels_running(core);
+	EventBits_t events = 0;
+
+	*commit = false;
+
+	// Every field of an event goes out in the same commit
+	while ((core->scheduleCount > 0) && (core->schedule[0].at <= now))
+	{
+		servo_fire(core, &core->schedule[0], now);
+		schedule_pop(core);
+		events |= SERVO_EVENT_STEP;
+		*commit = true;
+	}
+
+	// Immediate setpoints last, they are the newest intent
+	if ((core->latest.fields != 0) && (core->latestTime + SERVO_CONTROL_TICK_US <= now))
+	{
+		servo_fire(core, &core->latest, now);
+		core->latest.fields = 0;
+		core->latestTime = now;
+		events |= SERVO_EVENT_SETPOINT;
+		*commit = true;
+	}
+
+	// Dead-man check, the outputs only keep running while a client keeps talking
+	if (!core->tripped && running && (aliveTime + (int64_t)SERVO_WATCHDOG_TIMEOUT_MS * 1000 <= now))
+	{
+		servo_core_trip(core, SERVO_TRIP_TIMEOUT, now);
+		events |= SERVO_EVENT_TRIP;
+	}
+
+	// Feeder first, the wheels only spin down once no more balls come
+	if (core->tripped && (core->rampedFrequency == MIN_BPM) && servo_wheels_running(core) && (core->stopTime <= now))
+	{
+		SERVO_WHEELS(WHEEL_STOP_STEP)
+		if (core->escArmed)
+		{
+			servo_write_wheels(core);
+		}
+		core->stopTime = now + SERVO_CONTROL_TICK_US;
+		events |= servo_wheels_running(core) ? 0 : SERVO_EVENT_STOPPED;
+		*commit = true;
+	}
+
+	// Wheel speeds received while arming are held back until the ESCs are armed
+	if (!core->escArmed && !core->suspended && (core->armTime <= now))
+	{
+		core->escArmed = true;
+		servo_write_wheels(core);
+		events |= SERVO_EVENT_ARMED;
+		*commit = true;
+	}
+
+	// Ramp steps are timed from the previous step, not from when we got here
+	if ((core->ballFrequency != core->rampedFrequency) && (core->rampTime <= now))
+	{
+		ramp_speed(core->ballFrequency, &core->rampedFrequency, 1);
+		servo_write_feeders(core, core->rampedFrequency);
+		core->rampTime += FEEDER_RAMP_PERIOD_US;
+		events |= (core->rampedFrequency == core->ballFrequency) ? SERVO_EVENT_RAMP_DONE : 0;
+		*commit = true;
+	}
+
+	return events;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+/* Output stage of the servo path, without the RTOS and the PWM driver
+
+   Setpoints to duties, the schedule of timed setpoints, coalescing of
+   immediate ones, ESC arming, the feeder ramp, the dead-man watchdog and the
+   safe stop with its wheel spin-down. The caller steps it whenever the next
+   deadline is reached and puts duty[] and reverse out on every commit:
+   Servo.c from the control task, host/replay.c on a stepped clock.
+   Nothing in here locks, Servo.c serializes the calls with its scheduleMutex. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Servo.h"
+
+#define MIN_BPM							0
+#define MAX_BPM							100
+#define POSITION_RANGE					100			// position setpoints are 0-100 %
+
+#define ESC_ARM_TIME_MS					2000		// ESCs need min throttle for this long to arm
+
+#define FEEDER_RAMP_PERIOD_US			5000		// one BPM per 5ms
+#define SERVO_CONTROL_TICK_US			5000		// immediate setpoints are committed at most once per tick
+#define WHEEL_STOP_TIME_US				1000000		// safe stop spins a wheel down from full speed in 1s
+
+/* Channel numbers and array indices, all from servo_channels.h */
+#define SERVO_CHANNEL_ENUM(name, ...)	PWM_CHANNEL_##name,
+#define WHEEL_INDEX_ENUM(name, ...)		WHEEL_##name,
+#define POSITION_INDEX_ENUM(name, ...)	POSITION_##name,
+
+enum
+{
+	SERVO_WHEELS(SERVO_CHANNEL_ENUM)
+	SERVO_POSITIONS(SERVO_CHANNEL_ENUM)
+	SERVO_FEEDERS(SERVO_CHANNEL_ENUM)
+	PWM_CHANNEL_NUM
+};
+enum { SERVO_WHEELS(WHEEL_INDEX_ENUM) };
+enum { SERVO_POSITIONS(POSITION_INDEX_ENUM) };
+
+/* Setpoint with its duties precomputed, firing it only writes them out */
+typedef struct servoEvent_t
+{
+	int64_t at;
+	uint8_t fields;
+	uint32_t positionDuty[SERVO_POSITION_NUM];
+	uint32_t wheelDuty[SERVO_WHEEL_NUM];
+	uint32_t wheelReverse;			/* bit per wheel turning backwards */
+	uint32_t BPM;
+} servoEvent;
+
+typedef struct servoCore_t
+{
+	/* Time ordered events waiting for their deadline */
+	servoEvent schedule[SERVO_SCHEDULE_LENGTH];
+	uint8_t scheduleCount;
+
+	/* Latest immediate setpoint per field, newer values overwrite older ones
+	   until a step takes them once per control tick */
+	servoEvent latest;
+	int64_t latestTime;
+
+	int64_t armTime;
+	bool escArmed;
+	bool suspended;					/* outputs detached, set by the caller */
+	uint32_t wheelDuty[SERVO_WHEEL_NUM];	/* wheel setpoint, reaches duty[] once the ESCs are armed */
+	uint32_t wheelReverse;
+	uint32_t ballFrequency;
+	uint32_t rampedFrequency;
+	int64_t rampTime;
+
+	bool tripped;
+	int64_t stopTime;
+
+	servoCalibration calibration;	/* wheel duty per speed point */
+	servoStats stats;
+
+	/* What the outputs carry from the next commit on */
+	uint32_t duty[PWM_CHANNEL_NUM];
+	uint32_t reverse;				/* reverse pin level, bit per wheel */
+} servoCore;
+
+/* Safe duties on the outputs, linear calibration, the ESCs arm ESC_ARM_TIME_MS from now */
+void servo_core_init(servoCore *core, int64_t now);
+/* Joystick angle in whole degrees and distance in % to signed wheel speeds,
+   integer math on a cosine table */
+void servo_core_mix(const joystick *spin, int16_t speed[SERVO_WHEEL_NUM]);
+void servo_core_event(const servoCore *core, const servoSetpoint *setpoint, servoEvent *event);
+/* A single setpoint due by now is merged into latest. Returns false if the
+   setpoints are timed, the caller passes them to servo_core_insert() in order. */
+bool servo_core_immediate(servoCore *core, const servoSetpoint *setpoint, uint8_t count, int64_t now);
+/* Returns false and counts the event as dropped if the schedule is full */
+bool servo_core_insert(servoCore *core, const servoEvent *event);
+/* Next time servo_core_step() has something to do, INT64_MAX if none. precise
+   is set if it is a scheduled event, one that is timed to the microsecond. */
+int64_t servo_core_deadline(const servoCore *core, int64_t aliveTime, bool *precise);
+/* Everything due by now, returns the SERVO_EVENT_* bits of what happened.
+   commit is set if duty[] or reverse changed and have to go out together. */
+EventBits_t servo_core_step(servoCore *core, int64_t now, int64_t aliveTime, bool *commit);
+/* Drop pending setpoints, ramp the feeder to zero and spin the wheels down once it stopped */
+void servo_core_trip(servoCore *core, servoTrip reason, int64_t now);
+/* Nothing running and nothing pending, the outputs can be detached */
+bool servo_core_at_rest(const servoCore *core);
+void servo_core_calibration_linear(servoCalibration *table);
+bool servo_core_calibration_valid(const servoCalibration *table);
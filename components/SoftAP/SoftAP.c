@@ -15,6 +15,9 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 
+#include "boot.h"
+#include "sysmon.h"
+
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
@@ -50,11 +53,29 @@ static void wifi_event_handler(void* arg,
 	}
 }
 
-void wifi_init_softap()
+static void wifi_sta_event_handler(void* arg,
+	esp_event_base_t event_base,
+	int32_t event_id,
+	void* event_data)
 {
-	tcpip_adapter_init();
-	ESP_ERROR_CHECK(esp_event_loop_create_default());
+	if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_START)) {
+		esp_wifi_connect();
+	}
+	else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_DISCONNECTED)) {
+		wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+		// A robot on the court network keeps trying, the servers stay bound meanwhile
+		ESP_LOGW(TAG, "disconnected from %s, reason %d, reconnecting", EXAMPLE_ESP_WIFI_SSID, event->reason);
+		esp_wifi_connect();
+	}
+	else if ((event_base == IP_EVENT) && (event_id == IP_EVENT_STA_GOT_IP)) {
+		ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+		ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+		boot_mark(BOOT_PHASE_IP_READY);
+	}
+}
 
+void wifi_init_softap()
+{
 	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 	ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
@@ -83,14 +104,68 @@ void wifi_init_softap()
 		EXAMPLE_ESP_WIFI_PASS);
 }
 
-void wifi_init()
+void wifi_init_sta()
+{
+	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+	ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+	ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_sta_event_handler, NULL));
+	ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_sta_event_handler, NULL));
+
+	wifi_config_t wifi_config = {
+		.sta = {
+		.ssid = EXAMPLE_ESP_WIFI_SSID,
+		.password = EXAMPLE_ESP_WIFI_PASS
+		},
+	};
+	// A password implies the network is secured, don't fall back to an open one with the same SSID
+	if (strlen(EXAMPLE_ESP_WIFI_PASS) != 0) {
+		wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+	}
+
+	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+	ESP_ERROR_CHECK(esp_wifi_start());
+	// Modem sleep holds multicast frames until the next DTIM beacon, group commands would arrive late
+	ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+
+	ESP_LOGI(TAG,
+		"wifi_init_sta finished. SSID:%s",
+		EXAMPLE_ESP_WIFI_SSID);
+}
+
+static void nvs_init_task(void *argument)
 {
 	ESP_ERROR_CHECK(nvs_flash_init());
+	boot_mark(BOOT_PHASE_NVS_READY);
+	vTaskDelete(NULL);
+}
+
+static void wifi_init_task(void *argument)
+{
+	// Sockets only need the TCP/IP stack, the server may bind before WiFi is started
+	tcpip_adapter_init();
+	ESP_ERROR_CHECK(esp_event_loop_create_default());
+	boot_mark(BOOT_PHASE_NETIF_READY);
+	
+	// WiFi driver keeps its configuration in NVS
+	boot_wait(BOOT_PHASE_NVS_READY, portMAX_DELAY);
 	
 #ifdef CONFIG_ESP_WIFI_MODE_AP
 	wifi_init_softap();
+	boot_mark(BOOT_PHASE_WIFI_READY);
+	// The AP interface has its static address as soon as it is started
+	boot_mark(BOOT_PHASE_IP_READY);
 #else
 	wifi_init_sta();
+	// IP_READY follows once the court network hands out an address
+	boot_mark(BOOT_PHASE_WIFI_READY);
 #endif
-	
+	vTaskDelete(NULL);
+}
+
+void wifi_init()
+{
+	xTaskCreate(nvs_init_task, "nvs_init", TASK_STACK_NVS_INIT, NULL, TASK_PRIORITY_BOOT, NULL);
+	xTaskCreate(wifi_init_task, "wifi_init", TASK_STACK_WIFI_INIT, NULL, TASK_PRIORITY_BOOT, NULL);
 }
\ No newline at end of file
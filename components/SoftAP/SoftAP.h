@@ -3,4 +3,6 @@
 #include "esp_log.h"
 #include "nvs_flash.h"
 
+/* Starts NVS and WiFi bring-up in their own tasks and returns immediately,
+   completion is signalled through bootEventGroup */
 void wifi_init();
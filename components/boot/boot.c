@@ -0,0 +1,96 @@
+/* Staged startup bookkeeping
+
+   Readiness of every boot phase is signalled through bootEventGroup so the
+   init tasks can run in parallel and only wait for what they depend on.
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "boot.h"
+
+EventGroupHandle_t bootEventGroup;
+
+static const char *TAG = "boot";
+static int64_t phaseTime[BOOT_PHASE_NUM];
+static const char *phaseName[BOOT_PHASE_NUM] = {
+	"safe",
+	"armed",
+	"nvs",
+	"storage",
+	"netif",
+	"wifi",
+	"ip",
+	"server",
+	"cmd"
+};
+
+void boot_init()
+{
+	for (int i = 0; i < BOOT_PHASE_NUM; i++)
+	{
+		phaseTime[i] = -1;
+	}
+	
+	bootEventGroup = xEventGroupCreate();
+	if (bootEventGroup == NULL)
+	{
+		ESP_LOGE(TAG, "Create bootEventGroup fail");
+	}
+}
+
+void boot_mark(bootPhase phase)
+{
+	if (phase >= BOOT_PHASE_NUM)
+	{
+		return;
+	}
+	
+	bool reached;
+	
+	taskENTER_CRITICAL();
+	reached = phaseTime[phase] >= 0;
+	if (!reached)
+	{
+		phaseTime[phase] = esp_timer_get_time();
+	}
+	taskEXIT_CRITICAL();
+	
+	if (reached)
+	{
+		return;
+	}
+	
+	xEventGroupSetBits(bootEventGroup, BOOT_PHASE_BIT(phase));
+	ESP_LOGI(TAG, "Boot phase %s reached at %d ms", phaseName[phase], (int32_t)(phaseTime[phase] / 1000));
+}
+
+bool boot_wait(bootPhase phase, TickType_t timeout)
+{
+	EventBits_t bits = xEventGroupWaitBits(bootEventGroup, BOOT_PHASE_BIT(phase), pdFALSE, pdTRUE, timeout);
+	return (bits & BOOT_PHASE_BIT(phase)) != 0;
+}
+
+int64_t boot_phase_us(bootPhase phase)
+{
+	if (phase >= BOOT_PHASE_NUM)
+	{
+		return -1;
+	}
+	
+	return phaseTime[phase];
+}
+
+const char *boot_phase_name(bootPhase phase)
+{
+	if (phase >= BOOT_PHASE_NUM)
+	{
+		return "unknown";
+	}
+	
+	return phaseName[phase];
+}
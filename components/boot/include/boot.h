@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+/* Boot phases, in the order they are expected to complete.
+   Each phase owns one bit of bootEventGroup (BOOT_PHASE_BIT). */
+typedef enum bootPhase_t
+{
+	BOOT_PHASE_ACTUATORS_SAFE = 0,	/* PWM running with safe duties */
+	BOOT_PHASE_ESC_ARMED,			/* ESCs held at min throttle for the arming time */
+	BOOT_PHASE_NVS_READY,			/* nvs_flash_init() done */
+	BOOT_PHASE_STORAGE_READY,		/* SPIFFS mounted */
+	BOOT_PHASE_NETIF_READY,			/* TCP/IP stack and event loop up, sockets usable */
+	BOOT_PHASE_WIFI_READY,			/* esp_wifi_start() done */
+	BOOT_PHASE_IP_READY,			/* interface has an address, AP started or station got one */
+	BOOT_PHASE_SERVER_READY,		/* WebSocket server listening */
+	BOOT_PHASE_FIRST_COMMAND,		/* First command accepted from a client */
+	BOOT_PHASE_NUM
+} bootPhase;
+
+#define BOOT_PHASE_BIT(phase)	((EventBits_t)1 << (phase))
+
+extern EventGroupHandle_t bootEventGroup;
+
+void boot_init();
+/* Timestamp a phase and set its readiness bit, only the first call counts */
+void boot_mark(bootPhase phase);
+/* Block until the phase is reached, returns false on timeout */
+bool boot_wait(bootPhase phase, TickType_t timeout);
+/* Time of the phase in microseconds since power-on, -1 if not reached yet */
+int64_t boot_phase_us(bootPhase phase);
+const char *boot_phase_name(bootPhase phase);
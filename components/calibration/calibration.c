@@ -0,0 +1,415 @@
+/* Wheel calibration
+
+   The same duty does not give every wheel, ESC and motor the same speed, so
+   the same spin setpoint shoots differently from wheel to wheel and robot to
+   robot. A run sweeps one wheel at a time over the calibration points with
+   the feeder on and times the balls through a light barrier at the shooter
+   exit. The fitted table maps every setpoint to the duty that gives the same
+   exit speed on all wheels, it is kept in NVS and loaded at boot.
+*/
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "driver/adc.h"
+
+#include "calibration.h"
+#include "command.h"
+#include "Servo.h"
+#include "power.h"
+#include "boot.h"
+#include "sysmon.h"
+
+#define CALIB_NVS_NAMESPACE		"calib"
+#define CALIB_NVS_KEY			"wheels"
+#define CALIB_ALIVE_PERIOD_MS	100		/**< \brief Watchdog feed while waiting*/
+#define CALIB_ARM_TIMEOUT_MS	5000	/**< \brief ESCs armed after the outputs were attached*/
+#define CALIB_SETTLE_MS			1500	/**< \brief Wheel spin-up before the first ball is timed*/
+#define CALIB_BALL_TIMEOUT_MS	(2 * 60000 / CONFIG_CALIB_BPM)	/**< \brief Two feeder periods without a ball*/
+#define CALIB_POLL_WINDOW_US	50000	/**< \brief Sensor polled back to back this long before a tick is yielded*/
+#define CALIB_DWELL_MAX_US		200000	/**< \brief Longer in front of the sensor is a stuck ball, not a shot*/
+#define CALIB_RETRY_MS			10000	/**< \brief A new run no sooner than this after the last one ended*/
+
+static const char *TAG = "calibration";
+static calibrationProgress progress;
+static const commandClient *requester;	/* client the running sweep belongs to */
+static int64_t endTime;					/* last run ended, 0 before the first */
+
+static void calibration_set_state(calibrationState state, uint8_t wheel, uint8_t point)
+{
+	taskENTER_CRITICAL();
+	progress.state = state;
+	progress.wheel = wheel;
+	progress.point = point;
+	taskEXIT_CRITICAL();
+}
+
+static bool calibration_tripped()
+{
+	servoStatus status;
+
+	servo_get_status(&status);
+	return status.tripped;
+}
+
+/* The sweep feeds the watchdog only as long as its requester is in control,
+   a disconnect or another client's command ends it */
+static bool calibration_stopped()
+{
+	return !command_is_controller(requester) || calibration_tripped();
+}
+
+/* Keeps the watchdog fed, false if the robot stopped itself or control was lost meanwhile */
+static bool calibration_wait(uint32_t ms)
+{
+	for (uint32_t waited = 0; waited < ms; waited += CALIB_ALIVE_PERIOD_MS)
+	{
+		if (calibration_stopped())
+		{
+			return false;
+		}
+		servo_alive();
+		vTaskDelay(pdMS_TO_TICKS(CALIB_ALIVE_PERIOD_MS));
+	}
+	return !calibration_stopped();
+}
+
+/* Wheel setpoints wait for the ESCs, after an idle stretch they arm again first */
+static bool calibration_armed()
+{
+	servoStatus status;
+
+	for (uint32_t waited = 0; waited < CALIB_ARM_TIMEOUT_MS; waited += CALIB_ALIVE_PERIOD_MS)
+	{
+		servo_get_status(&status);
+		if (status.armed)
+		{
+			return true;
+		}
+		if (calibration_stopped())
+		{
+			return false;
+		}
+		servo_alive();
+		vTaskDelay(pdMS_TO_TICKS(CALIB_ALIVE_PERIOD_MS));
+	}
+	return false;
+}
+
+/* One wheel at the given speed, the others at rest */
+static bool calibration_drive(uint8_t wheel, int16_t speed, uint32_t BPM)
+{
+	servoSetpoint setpoint;
+
+	memset(&setpoint, 0, sizeof(setpoint));
+	setpoint.at = esp_timer_get_time();
+	setpoint.fields = SERVO_FIELD_SPIN | SERVO_FIELD_BPM;
+	setpoint.speed[wheel] = speed;
+	setpoint.BPM = BPM;
+	servo_alive();
+	return servo_schedule(&setpoint, 1);
+}
+
+/* Exit speed of the next ball in mm/s, 0 if none comes. The sensor is polled
+   back to back for CALIB_POLL_WINDOW_US, then a tick lets the lower priority
+   tasks run. A ball already in front of the sensor when a window opens is not
+   timed, its start was missed. */
+static uint32_t calibration_ball_speed()
+{
+	int64_t deadline = esp_timer_get_time() + (int64_t)CALIB_BALL_TIMEOUT_MS * 1000;
+	int64_t now;
+	uint16_t value;
+
+	do
+	{
+		int64_t windowEnd = esp_timer_get_time() + CALIB_POLL_WINDOW_US;
+		int64_t enter = 0;
+		bool missed = true;
+
+		if (calibration_stopped())
+		{
+			return 0;
+		}
+		servo_alive();
+		do
+		{
+			if (adc_read(&value) != ESP_OK)
+			{
+				return 0;
+			}
+			now = esp_timer_get_time();
+
+			if (value < CONFIG_CALIB_ADC_THRESHOLD)
+			{
+				if (enter != 0)
+				{
+					return (uint32_t)((int64_t)CONFIG_CALIB_BALL_DIAMETER_MM * 1000000 / MAX(now - enter, 1));
+				}
+				missed = false;
+			}
+			else if (!missed && (enter == 0))
+			{
+				enter = now;
+			}
+		// A ball in front of the sensor is followed past the end of the window
+		} while ((now < windowEnd) || ((enter != 0) && ((now - enter) < CALIB_DWELL_MAX_US)));
+
+		vTaskDelay(1);
+	} while (now < deadline);
+
+	return 0;
+}
+
+/* Average exit speed per calibration point with the linear table, point 0 is at rest */
+static bool calibration_sweep(uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS])
+{
+	for (uint8_t wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		measured[wheel][0] = 0;
+		for (uint8_t point = 1; point < SERVO_CALIB_POINTS; point++)
+		{
+			int16_t speed = point * SERVO_SPEED_RANGE / (SERVO_CALIB_POINTS - 1);
+			uint32_t sum = 0;
+
+			calibration_set_state(CALIB_RUNNING, wheel, point);
+			if (!calibration_drive(wheel, speed, CONFIG_CALIB_BPM) ||
+				!calibration_armed() ||
+				!calibration_wait(CALIB_SETTLE_MS))
+			{
+				ESP_LOGW(TAG, "Wheel %u did not reach point %u", wheel, point);
+				return false;
+			}
+
+			for (int ball = 0; ball < CONFIG_CALIB_BALLS_PER_POINT; ball++)
+			{
+				uint32_t ballSpeed = calibration_ball_speed();
+
+				if ((ballSpeed == 0) || calibration_stopped())
+				{
+					ESP_LOGW(TAG, "No ball timed on wheel %u point %u", wheel, point);
+					return false;
+				}
+				sum += ballSpeed;
+			}
+			measured[wheel][point] = sum / CONFIG_CALIB_BALLS_PER_POINT;
+			ESP_LOGI(TAG, "Wheel %u point %u: %u mm/s", wheel, point, measured[wheel][point]);
+		}
+	}
+	return true;
+}
+
+/* Duties that give every wheel the same exit speed per calibration point, the
+   top point is the slowest wheel's top speed so all of them reach it. Between
+   two measured points the linear duty is interpolated. Returns the top speed,
+   0 if nothing moved. */
+static uint32_t calibration_fit(uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS],
+	const servoCalibration *linear, servoCalibration *fitted)
+{
+	uint32_t top = UINT32_MAX;
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		// Exit speed only grows with duty, a slower reading above a faster one is noise
+		for (int point = 1; point < SERVO_CALIB_POINTS; point++)
+		{
+			measured[wheel][point] = MAX(measured[wheel][point], measured[wheel][point - 1]);
+		}
+		top = MIN(top, measured[wheel][SERVO_CALIB_POINTS - 1]);
+	}
+
+	if (top == 0)
+	{
+		return 0;
+	}
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		const uint32_t *curve = measured[wheel];
+		const uint16_t *duty = linear->duty[wheel];
+		int segment = 0;
+
+		for (int point = 0; point < SERVO_CALIB_POINTS; point++)
+		{
+			uint32_t target = top * point / (SERVO_CALIB_POINTS - 1);
+
+			// Targets rise, so does the measured segment they fall into
+			while ((segment < SERVO_CALIB_POINTS - 2) && (curve[segment + 1] < target))
+			{
+				segment++;
+			}
+
+			uint32_t span = curve[segment + 1] - curve[segment];
+			fitted->duty[wheel][point] = (span == 0) ? duty[segment] :
+				duty[segment] + (target - curve[segment]) * (duty[segment + 1] - duty[segment]) / span;
+		}
+	}
+	return top;
+}
+
+static bool calibration_store(const servoCalibration *table)
+{
+	nvs_handle handle;
+	esp_err_t err = nvs_open(CALIB_NVS_NAMESPACE, NVS_READWRITE, &handle);
+
+	if (err == ESP_OK)
+	{
+		err = nvs_set_blob(handle, CALIB_NVS_KEY, table, sizeof(*table));
+		if (err == ESP_OK)
+		{
+			err = nvs_commit(handle);
+		}
+		nvs_close(handle);
+	}
+
+	if (err != ESP_OK)
+	{
+		ESP_LOGE(TAG, "Storing the table failed: %s", esp_err_to_name(err));
+	}
+	return err == ESP_OK;
+}
+
+static void calibration_task(void *argument)
+{
+	uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];
+	servoCalibration previous, linear, fitted;
+	uint32_t top = 0;
+	bool stored = false;
+
+	// Measured against the linear table, the fit maps onto its duties
+	servo_get_calibration(&previous);
+	servo_set_calibration(NULL);
+	servo_get_calibration(&linear);
+	power_wake();
+
+	bool ok = calibration_sweep(measured);
+	// Once stopped the wheels are at rest already, a setpoint would take over from the safe stop
+	if (!calibration_stopped())
+	{
+		calibration_drive(0, 0, 0);
+	}
+	else if (!command_is_controller(requester))
+	{
+		ESP_LOGW(TAG, "Requesting client no longer in control");
+	}
+
+	if (ok)
+	{
+		top = calibration_fit(measured, &linear, &fitted);
+		ok = (top != 0) && servo_set_calibration(&fitted);
+	}
+
+	if (ok)
+	{
+		stored = calibration_store(&fitted);
+		ESP_LOGI(TAG, "Calibrated, full speed %u mm/s on every wheel", top);
+	}
+	else
+	{
+		servo_set_calibration(&previous);
+		ESP_LOGW(TAG, "Calibration failed, previous table restored");
+	}
+
+	taskENTER_CRITICAL();
+	progress.state = ok ? CALIB_DONE : CALIB_FAILED;
+	progress.topSpeed = ok ? top : progress.topSpeed;
+	progress.stored = ok ? stored : progress.stored;
+	endTime = esp_timer_get_time();
+	taskEXIT_CRITICAL();
+
+	vTaskDelete(NULL);
+}
+
+static void calibration_load_task(void *argument)
+{
+	servoCalibration table;
+	size_t size = sizeof(table);
+	nvs_handle handle;
+	bool loaded = false;
+
+	boot_wait(BOOT_PHASE_NVS_READY, portMAX_DELAY);
+
+	if (nvs_open(CALIB_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+	{
+		// A table from a build with other wheels or points has another size
+		loaded = (nvs_get_blob(handle, CALIB_NVS_KEY, &table, &size) == ESP_OK) &&
+			(size == sizeof(table)) &&
+			servo_set_calibration(&table);
+		nvs_close(handle);
+	}
+
+	if (loaded)
+	{
+		taskENTER_CRITICAL();
+		progress.stored = true;
+		taskEXIT_CRITICAL();
+		ESP_LOGI(TAG, "Stored wheel calibration loaded");
+	}
+	else
+	{
+		ESP_LOGI(TAG, "No stored wheel calibration, linear duties");
+	}
+
+	vTaskDelete(NULL);
+}
+
+void calibration_init()
+{
+	xTaskCreate(calibration_load_task, "calib_load", TASK_STACK_CALIBRATION_LOAD, NULL, TASK_PRIORITY_BOOT, NULL);
+}
+
+bool calibration_start(const commandClient *client)
+{
+	int64_t now = esp_timer_get_time();
+	bool running, early;
+
+	// The sweep drives the wheels and feeds the watchdog, only for the client in control
+	if (!command_is_controller(client))
+	{
+		ESP_LOGW(TAG, "Calibration refused, client not in control");
+		return false;
+	}
+
+	taskENTER_CRITICAL();
+	running = (progress.state == CALIB_RUNNING);
+	early = !running && (endTime != 0) && ((now - endTime) < (int64_t)CALIB_RETRY_MS * 1000);
+	if (!running && !early)
+	{
+		progress.state = CALIB_RUNNING;
+		requester = client;
+	}
+	taskEXIT_CRITICAL();
+
+	if (running)
+	{
+		ESP_LOGW(TAG, "Calibration already running");
+		return false;
+	}
+	if (early)
+	{
+		ESP_LOGW(TAG, "Calibration refused, last run ended less than %d ms ago", CALIB_RETRY_MS);
+		return false;
+	}
+
+	// Below the network and control tasks, they preempt the sensor polling only briefly
+	if (xTaskCreate(calibration_task, "calibration", TASK_STACK_CALIBRATION, NULL, TASK_PRIORITY_BOOT, NULL) != pdPASS)
+	{
+		ESP_LOGE(TAG, "Create calibration task fail");
+		calibration_set_state(CALIB_FAILED, 0, 0);
+		return false;
+	}
+	return true;
+}
+
+void calibration_get_progress(calibrationProgress *out)
+{
+	taskENTER_CRITICAL();
+	*out = progress;
+	taskEXIT_CRITICAL();
+}
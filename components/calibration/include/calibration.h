@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "command.h"
+
+typedef enum calibrationState_t
+{
+	CALIB_IDLE = 0,				/* stored or linear table in use, no run yet */
+	CALIB_RUNNING,
+	CALIB_DONE,					/* fitted table in use */
+	CALIB_FAILED				/* previous table restored */
+} calibrationState;
+
+/* Progress of the sweep, then its outcome */
+typedef struct calibrationProgress_t
+{
+	calibrationState state;
+	uint8_t wheel;				/* wheel being swept, SERVO_WHEELS order */
+	uint8_t point;				/* duty point being timed, 1..SERVO_CALIB_POINTS - 1 */
+	uint32_t topSpeed;			/* mm/s every wheel reaches, full speed of the fitted table */
+	bool stored;				/* table in use is the one in NVS */
+} calibrationProgress;
+
+/* Loads the stored table in the background once NVS is up */
+void calibration_init();
+/* Sweep every wheel, time the balls and fit a table that gives all wheels the
+   same exit speed per setpoint. The robot has to be free to shoot, it drives
+   the wheels and the feeder itself as long as the client stays in control.
+   Returns false if the client is not in control, a run is going already or
+   the last one ended too recently. */
+bool calibration_start(const commandClient *client);
+void calibration_get_progress(calibrationProgress *progress);
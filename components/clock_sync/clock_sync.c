@@ -0,0 +1,134 @@
+/* Client to robot clock synchronization
+
+   Offset is taken from the midpoint of each exchange, on a Wi-Fi link the
+   error is bounded by half of the round trip, so exchanges with a round trip
+   well above the best one seen are dropped instead of averaged in. Drift is
+   tracked as a frequency error so "execute at" times stay accurate between
+   exchanges.
+*/
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "clock_sync.h"
+
+#define SYNC_RTT_SPIKE_FACTOR	2		/**< \brief Reject round trips above this times the best*/
+#define SYNC_RTT_SPIKE_MIN		5000	/**< \brief ... but never below 5ms, WiFi jitter*/
+#define SYNC_MIN_RTT_RELAX		64		/**< \brief Best round trip creeps up 1/64 per sample, follows a changing link*/
+#define SYNC_MIN_SAMPLES		3		/**< \brief Exchanges needed before times are mapped*/
+#define SYNC_DRIFT_MIN_SPAN		500000	/**< \brief Drift only from samples 0.5s apart, finer spans are noise*/
+#define SYNC_DRIFT_MAX			500		/**< \brief Crystal tolerance, ppm*/
+#define SYNC_TIME_MAX			((int64_t)1 << 50)	/**< \brief 35 years in us, products of times and drift stay in int64_t*/
+#define SYNC_ERROR_MAX			(INT64_MAX / 1000000)	/**< \brief Largest offset error scaled to ppm without overflow*/
+
+void clock_sync_reset(clockSync *sync)
+{
+	memset(sync, 0, sizeof(*sync));
+	sync->minRtt = UINT32_MAX;
+}
+
+static int64_t clock_sync_offset_at(const clockSync *sync, int64_t robotTime)
+{
+	return sync->offset + ((robotTime - sync->refTime) * sync->drift) / 1000000;
+}
+
+static bool clock_sync_in_range(int64_t time)
+{
+	return (time >= -SYNC_TIME_MAX) && (time <= SYNC_TIME_MAX);
+}
+
+bool clock_sync_sample(clockSync *sync, int64_t c0, int64_t r1, int64_t c3)
+{
+	// Absurd times from a broken or hostile client would overflow the arithmetic below
+	if (!clock_sync_in_range(c0) || !clock_sync_in_range(r1) || !clock_sync_in_range(c3) ||
+		(c3 < c0) || ((c3 - c0) > UINT32_MAX))
+	{
+		sync->rejected++;
+		return false;
+	}
+	
+	uint32_t rtt = (uint32_t)(c3 - c0);
+	uint32_t limit = sync->minRtt * SYNC_RTT_SPIKE_FACTOR;
+	
+	if (limit < SYNC_RTT_SPIKE_MIN)
+	{
+		limit = SYNC_RTT_SPIKE_MIN;
+	}
+	
+	if (rtt < sync->minRtt)
+	{
+		sync->minRtt = rtt;
+	}
+	else
+	{
+		sync->minRtt += (sync->minRtt / SYNC_MIN_RTT_RELAX) + 1;
+	}
+	
+	if ((sync->samples > 0) && (rtt > limit))
+	{
+		sync->rejected++;
+		return false;
+	}
+	
+	// r1 was taken half way through the exchange on the client clock
+	int64_t offset = r1 - (c0 + (int64_t)(rtt / 2));
+	
+	if (sync->samples == 0)
+	{
+		sync->offset = offset;
+		sync->refTime = r1;
+	}
+	else
+	{
+		int64_t span = r1 - sync->refTime;
+		int64_t error = offset - clock_sync_offset_at(sync, r1);
+		
+		// A jump that large is clamped by SYNC_DRIFT_MAX anyway, saturate before scaling
+		int64_t scaled = MAX(MIN(error, SYNC_ERROR_MAX), -SYNC_ERROR_MAX);
+		
+		// Phase follows half of the error, frequency a quarter of the rate it implies
+		if (span >= SYNC_DRIFT_MIN_SPAN)
+		{
+			int64_t step = (scaled * 1000000 / span) / 4;
+			int32_t drift = sync->drift + (int32_t)MAX(MIN(step, 2 * SYNC_DRIFT_MAX), -2 * SYNC_DRIFT_MAX);
+			
+			if (drift > SYNC_DRIFT_MAX)
+			{
+				drift = SYNC_DRIFT_MAX;
+			}
+			else if (drift < -SYNC_DRIFT_MAX)
+			{
+				drift = -SYNC_DRIFT_MAX;
+			}
+			sync->offset = clock_sync_offset_at(sync, r1) + error / 2;
+			sync->drift = drift;
+			sync->refTime = r1;
+		}
+		else
+		{
+			sync->offset += error / 2;
+		}
+	}
+	
+	sync->rtt = rtt;
+	sync->samples++;
+	return true;
+}
+
+bool clock_sync_valid(const clockSync *sync)
+{
+	return sync->samples >= SYNC_MIN_SAMPLES;
+}
+
+bool clock_sync_to_robot(const clockSync *sync, int64_t clientTime, int64_t *robotTime)
+{
+	if (!clock_sync_valid(sync) || !clock_sync_in_range(clientTime))
+	{
+		return false;
+	}
+	
+	// Offset depends on the robot time it is evaluated at, one refinement is plenty at ppm drift
+	int64_t estimate = clientTime + sync->offset;
+	*robotTime = clientTime + clock_sync_offset_at(sync, estimate);
+	return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Client clock estimate built from NTP-style exchanges:
+   client sends c0, robot stamps r1 on receipt, client receives the reply at c3.
+   Times are microseconds, robot time is esp_timer_get_time(). */
+typedef struct clockSync_t
+{
+	int64_t offset;			/* robot - client time at refTime */
+	int64_t refTime;		/* robot time the offset was estimated at */
+	int32_t drift;			/* client clock rate error against the robot, ppm */
+	uint32_t rtt;			/* round trip of the last accepted exchange */
+	uint32_t minRtt;		/* best round trip seen, spikes above it are rejected */
+	uint16_t samples;		/* accepted exchanges */
+	uint16_t rejected;		/* exchanges dropped as latency spikes */
+} clockSync;
+
+void clock_sync_reset(clockSync *sync);
+/* Feed one completed exchange, returns false if it was rejected */
+bool clock_sync_sample(clockSync *sync, int64_t c0, int64_t r1, int64_t c3);
+/* Map a client time to robot time, returns false while not synchronized or if the time is absurd */
+bool clock_sync_to_robot(const clockSync *sync, int64_t clientTime, int64_t *robotTime);
+bool clock_sync_valid(const clockSync *sync);
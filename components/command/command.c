@@ -0,0 +1,430 @@
+/* Control commands
+
+   Every transport (WebSocket, UDP, TCP) decodes into a command and applies it
+   here, so the command set and its mapping to servo setpoints are the same
+   whichever channel it arrived on.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "command.h"
+#include "boot.h"
+#include "recorder.h"
+#include "power.h"
+
+#define POSITION_MIN		0
+#define POSITION_MAX		100
+#define SPIN_DISTANCE_MIN	0.0		/**< \brief Joystick at rest*/
+#define SPIN_DISTANCE_MAX	100.0	/**< \brief Joystick at full throw, full wheel speed*/
+#define COMMAND_AT_MAX_MS	60000	/**< \brief Furthest ahead an "at" time may be scheduled*/
+#define COMMAND_TIME_MAX_MS	1e15	/**< \brief Largest client time that converts to int64_t microseconds*/
+#define COMMAND_TOKEN		1000	/**< \brief Bucket units per command, refills of a fraction don't round away*/
+
+static const char *TAG = "command";
+
+/* Client whose command was applied last, its disconnect stops the robot. Set and
+   read from every transport's task, always in a critical section. */
+static const commandClient *controller;
+
+bool command_json_number(const cJSON *root, const char *name, double *value)
+{
+	cJSON *item = cJSON_GetObjectItem(root, name);
+	
+	// cJSON parses 1e999 to infinity, no integer or trigonometry survives that
+	if ((item == NULL) || !cJSON_IsNumber(item) || !isfinite(item->valuedouble))
+	{
+		return false;
+	}
+	*value = item->valuedouble;
+	return true;
+}
+
+bool command_json_time(const cJSON *root, const char *name, int64_t *time)
+{
+	double value;
+	
+	// Beyond COMMAND_TIME_MAX_MS the conversion to microseconds leaves int64_t
+	if (!command_json_number(root, name, &value) || (fabs(value) > COMMAND_TIME_MAX_MS))
+	{
+		return false;
+	}
+	*time = (int64_t)(value * 1000);
+	return true;
+}
+
+static uint8_t position_percent(float value)
+{
+	if (value < POSITION_MIN)
+	{
+		return POSITION_MIN;
+	}
+	else if (value > POSITION_MAX)
+	{
+		return POSITION_MAX;
+	}
+	return (uint8_t)value;
+}
+
+bool command_parse_json(const cJSON *root, command *cmd)
+{
+	double value[2];
+	
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->at = esp_timer_get_time();
+	if (root == NULL)
+	{
+		return false;
+	}
+	
+	if (command_json_number(root, "BPM", &value[0]))
+	{
+		cmd->fields |= COMMAND_FIELD_BPM;
+		cmd->BPM = (value[0] < 0) ? 0 : (uint32_t)MIN(value[0], UINT16_MAX);
+	}
+	
+	if (command_json_number(root, "angle", &value[0]) && command_json_number(root, "distance", &value[1]))
+	{
+		cmd->fields |= COMMAND_FIELD_SPIN;
+		cmd->spin.angle = fmod(value[0], 360.0);
+		// The mixer converts to integers, a huge or negative throw is clamped first
+		cmd->spin.distance = MIN(MAX(value[1], SPIN_DISTANCE_MIN), SPIN_DISTANCE_MAX);
+	}
+	
+	if (command_json_number(root, "x", &value[0]) && command_json_number(root, "y", &value[1]))
+	{
+		cmd->fields |= COMMAND_FIELD_POSITION;
+		cmd->position.x = value[0];
+		cmd->position.y = value[1];
+	}
+	
+	return cmd->fields != 0;
+}
+
+bool command_parse_binary(const uint8_t *data, size_t length, command *cmd)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->at = esp_timer_get_time();
+	if (length < COMMAND_BINARY_LENGTH)
+	{
+		return false;
+	}
+	
+	cmd->fields = data[0] & (COMMAND_FIELD_BPM | COMMAND_FIELD_SPIN | COMMAND_FIELD_POSITION);
+	cmd->BPM = ((uint32_t)data[1] << 8) | data[2];
+	cmd->spin.angle = (int16_t)(((uint16_t)data[3] << 8) | data[4]);
+	cmd->spin.distance = MIN(data[5], SPIN_DISTANCE_MAX);
+	cmd->position.x = data[6];
+	cmd->position.y = data[7];
+	
+	return cmd->fields != 0;
+}
+
+void command_encode_binary(const command *cmd, uint8_t *data)
+{
+	int16_t angle = (int16_t)cmd->spin.angle;
+	uint32_t BPM = MIN(cmd->BPM, UINT16_MAX);
+	
+	data[0] = cmd->fields;
+	data[1] = BPM >> 8;
+	data[2] = BPM;
+	data[3] = (uint16_t)angle >> 8;
+	data[4] = (uint16_t)angle;
+	data[5] = position_percent(cmd->spin.distance);
+	data[6] = position_percent(cmd->position.x);
+	data[7] = position_percent(cmd->position.y);
+}
+
+int command_parse_batch(const cJSON *root, int64_t base, command *cmds, uint8_t max)
+{
+	cJSON *batch = cJSON_GetObjectItem(root, "batch");
+	cJSON *step;
+	double offset;
+	int count = 0;
+	
+	if ((batch == NULL) || !cJSON_IsArray(batch) || (cJSON_GetArraySize(batch) > max))
+	{
+		return -1;
+	}
+	
+	// Steps are relative to the start of the whole batch, not to each other
+	cJSON_ArrayForEach(step, batch)
+	{
+		if (!command_parse_json(step, &cmds[count]))
+		{
+			return -1;
+		}
+		if (!command_json_number(step, "t", &offset) || (offset < 0))
+		{
+			offset = 0;
+		}
+		else if (offset > COMMAND_AT_MAX_MS)
+		{
+			return -1;
+		}
+		cmds[count].at = base + (int64_t)(offset * 1000);
+		count++;
+	}
+	return count;
+}
+
+static void command_to_setpoint(const command *cmd, servoSetpoint *setpoint)
+{
+	memset(setpoint, 0, sizeof(*setpoint));
+	setpoint->at = cmd->at;
+	setpoint->fields = cmd->fields;
+	setpoint->BPM = cmd->BPM;
+	
+	if (cmd->fields & COMMAND_FIELD_SPIN)
+	{
+		servo_spin_mix(&cmd->spin, setpoint->speed);
+	}
+	
+	if (cmd->fields & COMMAND_FIELD_POSITION)
+	{
+		setpoint->position[0] = position_percent(cmd->position.x);
+		setpoint->position[1] = position_percent(cmd->position.y);
+	}
+}
+
+bool command_apply_batch(const command *cmds, uint8_t count)
+{
+	servoSetpoint setpoint[COMMAND_BATCH_LENGTH];
+	
+	if ((count == 0) || (count > COMMAND_BATCH_LENGTH))
+	{
+		return false;
+	}
+	
+	for (int i = 0; i < count; i++)
+	{
+		command_to_setpoint(&cmds[i], &setpoint[i]);
+	}
+	
+	if (!servo_schedule(setpoint, count))
+	{
+		ESP_LOGW(TAG, "Servo queue full, %d setpoints dropped", count);
+		return false;
+	}
+	
+	boot_mark(BOOT_PHASE_FIRST_COMMAND);
+	return true;
+}
+
+bool command_apply(const command *cmd)
+{
+	return command_apply_batch(cmd, 1);
+}
+
+void command_client_init(commandClient *client)
+{
+	// A new client brings the robot out of idle before its first command
+	power_wake();
+	memset(client, 0, sizeof(*client));
+	clock_sync_reset(&client->sync);
+	client->refillTime = esp_timer_get_time();
+	client->tokens = COMMAND_BURST * COMMAND_TOKEN;
+}
+
+/* Token bucket per client, one fast client can't take the servo queue from the others */
+static bool command_admit(commandClient *client, uint8_t count)
+{
+	int64_t now = esp_timer_get_time();
+	int64_t elapsed = now - client->refillTime;
+	uint32_t full = COMMAND_BURST * COMMAND_TOKEN;
+	
+	client->refillTime = now;
+	if (elapsed >= (int64_t)COMMAND_BURST * 1000000 / COMMAND_RATE)
+	{
+		client->tokens = full;
+	}
+	else
+	{
+		client->tokens = MIN(full, client->tokens + (uint32_t)(elapsed * COMMAND_RATE / 1000));
+	}
+	
+	if (client->tokens < count * COMMAND_TOKEN)
+	{
+		client->rejected += count;
+		ESP_LOGD(TAG, "Rate limited, %d commands rejected", count);
+		return false;
+	}
+	client->tokens -= count * COMMAND_TOKEN;
+	return true;
+}
+
+static void command_record(const command *cmds, uint8_t count, recordStatus status)
+{
+	uint8_t payload[5 + COMMAND_BINARY_LENGTH];
+	int64_t now = esp_timer_get_time();
+	
+	for (int i = 0; i < count; i++)
+	{
+		int32_t ahead = (int32_t)(cmds[i].at - now);
+		
+		payload[0] = status;
+		payload[1] = ahead >> 24;
+		payload[2] = ahead >> 16;
+		payload[3] = ahead >> 8;
+		payload[4] = ahead;
+		command_encode_binary(&cmds[i], &payload[5]);
+		recorder_write(RECORD_COMMAND, payload, sizeof(payload));
+	}
+}
+
+static bool command_handle_batch(commandClient *client, const command *cmds, uint8_t count)
+{
+	if ((client != NULL) && !command_admit(client, count))
+	{
+		command_record(cmds, count, RECORD_REJECTED);
+		return false;
+	}
+	
+	if (!command_apply_batch(cmds, count))
+	{
+		command_record(cmds, count, RECORD_DROPPED);
+		if (client != NULL)
+		{
+			client->dropped += count;
+		}
+		return false;
+	}
+	
+	command_record(cmds, count, RECORD_ACCEPTED);
+	power_wake();
+	servo_alive();
+	if (client != NULL)
+	{
+		client->accepted += count;
+		taskENTER_CRITICAL();
+		controller = client;
+		taskEXIT_CRITICAL();
+	}
+	return true;
+}
+
+void command_heartbeat(commandClient *client)
+{
+	// Only the client in control keeps the robot running, a spectator can't mask its silence
+	if ((client == NULL) || command_is_controller(client))
+	{
+		power_wake();
+		servo_alive();
+	}
+}
+
+void command_client_close(commandClient *client)
+{
+	bool wasController;
+	
+	// Compared and cleared at once, a batch from another client may take over meanwhile
+	taskENTER_CRITICAL();
+	wasController = (controller == client);
+	if (wasController)
+	{
+		controller = NULL;
+	}
+	taskEXIT_CRITICAL();
+	
+	if (wasController)
+	{
+		ESP_LOGW(TAG, "Controlling client disconnected");
+		servo_safe_stop(SERVO_TRIP_DISCONNECT);
+	}
+}
+
+bool command_is_controller(const commandClient *client)
+{
+	bool isController;
+	
+	taskENTER_CRITICAL();
+	isController = (client != NULL) && (client == controller);
+	taskEXIT_CRITICAL();
+	return isController;
+}
+
+bool command_handle(commandClient *client, const command *cmd)
+{
+	return command_handle_batch(client, cmd, 1);
+}
+
+static bool command_time_to_robot(const commandClient *client, double at, int64_t *time)
+{
+	int64_t robotTime;
+	
+	if (fabs(at) > COMMAND_TIME_MAX_MS)
+	{
+		ESP_LOGW(TAG, "Execute at time out of range");
+		return false;
+	}
+	
+	if ((client == NULL) || !clock_sync_to_robot(&client->sync, (int64_t)(at * 1000), &robotTime))
+	{
+		ESP_LOGW(TAG, "Execute at time from a client without clock sync");
+		return false;
+	}
+	
+	int64_t now = esp_timer_get_time();
+	
+	if ((robotTime - now) > (int64_t)COMMAND_AT_MAX_MS * 1000)
+	{
+		ESP_LOGW(TAG, "Execute at time too far ahead");
+		return false;
+	}
+	
+	if (robotTime < now)
+	{
+		ESP_LOGW(TAG, "Execute at time %d us late", (int32_t)(now - robotTime));
+		robotTime = now;
+	}
+	*time = robotTime;
+	return true;
+}
+
+bool command_handle_json(commandClient *client, const cJSON *root)
+{
+	command cmds[COMMAND_BATCH_LENGTH];
+	int64_t base = esp_timer_get_time();
+	double at;
+	
+	if (root == NULL)
+	{
+		return false;
+	}
+	
+	if (cJSON_HasObjectItem(root, "heartbeat"))
+	{
+		command_heartbeat(client);
+	}
+	
+	// "at" is in client time, milliseconds
+	if (command_json_number(root, "at", &at) && !command_time_to_robot(client, at, &base))
+	{
+		return false;
+	}
+	
+	if (cJSON_HasObjectItem(root, "batch"))
+	{
+		int count = command_parse_batch(root, base, cmds, COMMAND_BATCH_LENGTH);
+		if (count < 0)
+		{
+			ESP_LOGW(TAG, "Invalid batch");
+			return false;
+		}
+		return command_handle_batch(client, cmds, count);
+	}
+	
+	if (command_parse_json(root, &cmds[0]))
+	{
+		cmds[0].at = base;
+		return command_handle(client, &cmds[0]);
+	}
+	return false;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+#include "Servo.h"
+#include "clock_sync.h"
+
+/* Fields carried by a command */
+#define COMMAND_FIELD_BPM			SERVO_FIELD_BPM
+#define COMMAND_FIELD_SPIN			SERVO_FIELD_SPIN
+#define COMMAND_FIELD_POSITION		SERVO_FIELD_POSITION
+
+/* Most timed steps in one batch, {"batch":[{"t":ms,...},...]} */
+#define COMMAND_BATCH_LENGTH		SERVO_CONTROL_QUEUE_LENGTH
+
+/* Per client rate limit, commands past it are rejected before reaching the servo path */
+#define COMMAND_RATE				50						/* sustained commands per second */
+#define COMMAND_BURST				COMMAND_BATCH_LENGTH	/* bucket depth, a full batch fits */
+
+/* Binary command encoding, big-endian:
+   [0] fields, [1..2] BPM, [3..4] spin angle in degrees (signed),
+   [5] spin distance %, [6] position x %, [7] position y % */
+#define COMMAND_BINARY_LENGTH		8
+
+/* Decoded control command, shared by all transports */
+typedef struct command_t
+{
+	int64_t at;					/* time to apply at, esp_timer_get_time() microseconds */
+	uint8_t fields;				/* COMMAND_FIELD_* present in this command */
+	uint32_t BPM;				/* balls per minute */
+	joystick spin;				/* angle in degrees, distance 0-100 % */
+	coordinates position;		/* x/y 0-100 % of the servo travel */
+} command;
+
+/* Per connection state of a commanding client */
+typedef struct commandClient_t
+{
+	clockSync sync;				/* client clock, for "at" times */
+	int64_t refillTime;			/* last token bucket refill, microseconds */
+	uint32_t tokens;			/* token bucket, thousandths of a command */
+	uint32_t accepted;			/* commands handed to the servo path */
+	uint32_t rejected;			/* commands over the rate limit */
+	uint32_t dropped;			/* commands the servo path had no room for */
+} commandClient;
+
+/* Finite number member, returns false if missing, not a number or not finite */
+bool command_json_number(const cJSON *root, const char *name, double *value);
+/* Client time member in milliseconds to microseconds, returns false if missing or out of int64_t range */
+bool command_json_time(const cJSON *root, const char *name, int64_t *time);
+/* Decode the command fields of a JSON object to apply now, returns false if it has none */
+bool command_parse_json(const cJSON *root, command *cmd);
+/* Decode the steps of a batch timed relative to base, returns their number, -1 if malformed */
+int command_parse_batch(const cJSON *root, int64_t base, command *cmds, uint8_t max);
+/* Decode a binary encoded command, returns false if malformed or empty */
+bool command_parse_binary(const uint8_t *data, size_t length, command *cmd);
+/* Binary encoding of a command, COMMAND_BINARY_LENGTH bytes, out of range values are clamped */
+void command_encode_binary(const command *cmd, uint8_t *data);
+/* Hand a command to the servo path, returns false if it was dropped */
+bool command_apply(const command *cmd);
+/* Hand the steps of a batch to the servo path together, returns false if they were dropped */
+bool command_apply_batch(const command *cmds, uint8_t count);
+void command_client_init(commandClient *client);
+/* The client's connection is gone, safe stop if it was in control */
+void command_client_close(commandClient *client);
+/* True if the client's commands drive the robot, it is the last one a command was accepted from */
+bool command_is_controller(const commandClient *client);
+/* Keep the dead-man watchdog from tripping without sending a setpoint */
+void command_heartbeat(commandClient *client);
+/* Apply a decoded command within the client's rate limit */
+bool command_handle(commandClient *client, const command *cmd);
+/* Decode and apply a JSON command or batch, optionally "at" a synchronized client time */
+bool command_handle_json(commandClient *client, const cJSON *root);
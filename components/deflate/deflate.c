@@ -0,0 +1,518 @@
+/* DEFLATE compressor and inflater
+
+   Sized for the ESP8266: the compressor keeps a small hash of recent
+   positions on the stack, the inflater needs about 1.5 KB of tables on the
+   heap while it runs. Neither keeps state between messages.
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "deflate.h"
+
+#define DEFLATE_HASH_BITS		8
+#define DEFLATE_HASH_SIZE		(1 << DEFLATE_HASH_BITS)
+#define DEFLATE_NO_POSITION		0xFFFF
+#define DEFLATE_MIN_MATCH		3
+#define DEFLATE_MAX_MATCH		258
+
+#define HUFFMAN_MAX_BITS		15
+#define HUFFMAN_LITERAL_CODES	288		/* literal/length alphabet incl. the 2 unused fixed codes */
+#define HUFFMAN_LENGTH_CODES	29
+#define HUFFMAN_DISTANCE_CODES	30
+#define HUFFMAN_CODE_LENGTHS	19		/* code length alphabet of dynamic blocks */
+#define HUFFMAN_END_OF_BLOCK	256
+
+/* Base value and extra bits of the length and distance codes */
+static const uint16_t lengthBase[HUFFMAN_LENGTH_CODES] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[HUFFMAN_LENGTH_CODES] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distanceBase[HUFFMAN_DISTANCE_CODES] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distanceExtra[HUFFMAN_DISTANCE_CODES] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+/* Order code lengths of the code length alphabet are sent in */
+static const uint8_t codeLengthOrder[HUFFMAN_CODE_LENGTHS] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+/* Compressor */
+
+typedef struct deflateState_t
+{
+	uint8_t *out;
+	size_t outSize;
+	size_t outPos;
+	uint32_t bitBuf;
+	uint8_t bitCount;
+	bool full;
+} deflateState;
+
+static void deflate_bits(deflateState *s, uint32_t value, uint8_t count)
+{
+	s->bitBuf |= value << s->bitCount;
+	s->bitCount += count;
+	while (s->bitCount >= 8)
+	{
+		if (s->outPos >= s->outSize)
+		{
+			s->full = true;
+			return;
+		}
+		s->out[s->outPos++] = s->bitBuf;
+		s->bitBuf >>= 8;
+		s->bitCount -= 8;
+	}
+}
+
+/* Huffman codes go out most significant bit first */
+static void deflate_code(deflateState *s, uint32_t code, uint8_t length)
+{
+	uint32_t reversed = 0;
+	
+	for (int i = 0; i < length; i++)
+	{
+		reversed = (reversed << 1) | ((code >> i) & 1);
+	}
+	deflate_bits(s, reversed, length);
+}
+
+static void deflate_symbol(deflateState *s, uint16_t symbol)
+{
+	if (symbol < 144)
+	{
+		deflate_code(s, 0x30 + symbol, 8);
+	}
+	else if (symbol < 256)
+	{
+		deflate_code(s, 0x190 + symbol - 144, 9);
+	}
+	else if (symbol < 280)
+	{
+		deflate_code(s, symbol - 256, 7);
+	}
+	else
+	{
+		deflate_code(s, 0xC0 + symbol - 280, 8);
+	}
+}
+
+static void deflate_match(deflateState *s, uint16_t length, uint16_t distance)
+{
+	int code = HUFFMAN_LENGTH_CODES - 1;
+	
+	while (lengthBase[code] > length)
+	{
+		code--;
+	}
+	deflate_symbol(s, 257 + code);
+	deflate_bits(s, length - lengthBase[code], lengthExtra[code]);
+	
+	code = HUFFMAN_DISTANCE_CODES - 1;
+	while (distanceBase[code] > distance)
+	{
+		code--;
+	}
+	deflate_code(s, code, 5);
+	deflate_bits(s, distance - distanceBase[code], distanceExtra[code]);
+}
+
+static uint16_t deflate_hash(const uint8_t *p)
+{
+	return ((p[0] << 4) ^ (p[1] << 2) ^ p[2]) & (DEFLATE_HASH_SIZE - 1);
+}
+
+size_t deflate_compress(const uint8_t *in, size_t length, uint8_t *out, size_t outSize)
+{
+	uint16_t head[DEFLATE_HASH_SIZE];
+	deflateState s = { .out = out, .outSize = outSize };
+	size_t pos = 0;
+	
+	// Positions are kept in 16 bits
+	if (length >= DEFLATE_NO_POSITION)
+	{
+		return 0;
+	}
+	memset(head, 0xFF, sizeof(head));
+	
+	// One final block with the fixed codes
+	deflate_bits(&s, 1, 1);
+	deflate_bits(&s, 1, 2);
+	
+	while ((pos < length) && !s.full)
+	{
+		uint16_t matchLength = 0;
+		
+		if (pos + DEFLATE_MIN_MATCH <= length)
+		{
+			uint16_t hash = deflate_hash(&in[pos]);
+			uint16_t candidate = head[hash];
+			
+			head[hash] = pos;
+			if ((candidate != DEFLATE_NO_POSITION) && (pos - candidate <= DEFLATE_WINDOW))
+			{
+				size_t max = MIN(length - pos, DEFLATE_MAX_MATCH);
+				
+				while ((matchLength < max) && (in[candidate + matchLength] == in[pos + matchLength]))
+				{
+					matchLength++;
+				}
+			}
+			
+			if (matchLength >= DEFLATE_MIN_MATCH)
+			{
+				deflate_match(&s, matchLength, pos - candidate);
+				// Keep the skipped positions findable
+				for (size_t i = pos + 1; (i < pos + matchLength) && (i + DEFLATE_MIN_MATCH <= length); i++)
+				{
+					head[deflate_hash(&in[i])] = i;
+				}
+				pos += matchLength;
+				continue;
+			}
+		}
+		
+		deflate_symbol(&s, in[pos]);
+		pos++;
+	}
+	
+	deflate_symbol(&s, HUFFMAN_END_OF_BLOCK);
+	deflate_bits(&s, 0, 7);		// flush the last partial byte
+	
+	return s.full ? 0 : s.outPos;
+}
+
+/* Inflater */
+
+typedef struct huffman_t
+{
+	uint16_t count[HUFFMAN_MAX_BITS + 1];	/* number of codes of each length */
+	uint16_t symbol[HUFFMAN_LITERAL_CODES];	/* symbols in canonical code order */
+} huffman;
+
+typedef struct inflateState_t
+{
+	const uint8_t *in;
+	size_t inLength;
+	size_t inPos;
+	uint32_t bitBuf;
+	uint8_t bitCount;
+	bool error;
+	uint8_t *out;
+	size_t outSize;
+	size_t outPos;
+	huffman literal;
+	huffman distance;
+	uint8_t lengths[HUFFMAN_LITERAL_CODES + HUFFMAN_DISTANCE_CODES];
+} inflateState;
+
+/* The sender stripped the 00 00 ff ff of its final flush, put it back */
+static const uint8_t inflateTail[] = { 0x00, 0x00, 0xFF, 0xFF };
+
+static bool inflate_input_left(const inflateState *s)
+{
+	return s->inPos < s->inLength + sizeof(inflateTail);
+}
+
+static uint32_t inflate_bits(inflateState *s, uint8_t need)
+{
+	uint32_t value = s->bitBuf;
+	
+	while (s->bitCount < need)
+	{
+		if (!inflate_input_left(s))
+		{
+			s->error = true;
+			return 0;
+		}
+		uint8_t byte = (s->inPos < s->inLength) ? s->in[s->inPos] : inflateTail[s->inPos - s->inLength];
+		s->inPos++;
+		value |= (uint32_t)byte << s->bitCount;
+		s->bitCount += 8;
+	}
+	s->bitBuf = value >> need;
+	s->bitCount -= need;
+	return value & ((1UL << need) - 1);
+}
+
+/* Canonical code from code lengths, returns false if it is oversubscribed */
+static bool inflate_build(huffman *h, const uint8_t *length, uint16_t n)
+{
+	uint16_t offset[HUFFMAN_MAX_BITS + 1];
+	int left = 1;
+	
+	memset(h->count, 0, sizeof(h->count));
+	for (int i = 0; i < n; i++)
+	{
+		h->count[length[i]]++;
+	}
+	
+	for (int len = 1; len <= HUFFMAN_MAX_BITS; len++)
+	{
+		left = (left << 1) - h->count[len];
+		if (left < 0)
+		{
+			return false;
+		}
+	}
+	
+	offset[1] = 0;
+	for (int len = 1; len < HUFFMAN_MAX_BITS; len++)
+	{
+		offset[len + 1] = offset[len] + h->count[len];
+	}
+	for (int i = 0; i < n; i++)
+	{
+		if (length[i] != 0)
+		{
+			h->symbol[offset[length[i]]++] = i;
+		}
+	}
+	return true;
+}
+
+/* One bit at a time, slow but needs no lookup tables */
+static int inflate_decode(inflateState *s, const huffman *h)
+{
+	int code = 0, first = 0, index = 0;
+	
+	for (int len = 1; len <= HUFFMAN_MAX_BITS; len++)
+	{
+		code |= inflate_bits(s, 1);
+		if (s->error)
+		{
+			return -1;
+		}
+		int count = h->count[len];
+		if (code - count < first)
+		{
+			return h->symbol[index + (code - first)];
+		}
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	s->error = true;
+	return -1;
+}
+
+static bool inflate_stored(inflateState *s)
+{
+	// Stored blocks start on a byte boundary
+	s->bitBuf = 0;
+	s->bitCount = 0;
+	
+	uint16_t length = inflate_bits(s, 16);
+	uint16_t check = inflate_bits(s, 16);
+	
+	if (s->error || (length != (uint16_t)~check) || (s->outPos + length > s->outSize))
+	{
+		return false;
+	}
+	
+	for (uint16_t i = 0; i < length; i++)
+	{
+		s->out[s->outPos++] = inflate_bits(s, 8);
+	}
+	return !s->error;
+}
+
+static bool inflate_codes(inflateState *s)
+{
+	for (;;)
+	{
+		int symbol = inflate_decode(s, &s->literal);
+		
+		if (symbol < 0)
+		{
+			return false;
+		}
+		
+		if (symbol < HUFFMAN_END_OF_BLOCK)
+		{
+			if (s->outPos >= s->outSize)
+			{
+				return false;
+			}
+			s->out[s->outPos++] = symbol;
+			continue;
+		}
+		
+		if (symbol == HUFFMAN_END_OF_BLOCK)
+		{
+			return true;
+		}
+		
+		symbol -= 257;
+		if (symbol >= HUFFMAN_LENGTH_CODES)
+		{
+			return false;
+		}
+		uint16_t length = lengthBase[symbol] + inflate_bits(s, lengthExtra[symbol]);
+		
+		symbol = inflate_decode(s, &s->distance);
+		if ((symbol < 0) || (symbol >= HUFFMAN_DISTANCE_CODES))
+		{
+			return false;
+		}
+		uint16_t distance = distanceBase[symbol] + inflate_bits(s, distanceExtra[symbol]);
+		
+		// No context between messages, the window is what this message produced so far
+		if (s->error || (distance > s->outPos) || (s->outPos + length > s->outSize))
+		{
+			return false;
+		}
+		for (uint16_t i = 0; i < length; i++)
+		{
+			s->out[s->outPos] = s->out[s->outPos - distance];
+			s->outPos++;
+		}
+	}
+}
+
+static bool inflate_fixed(inflateState *s)
+{
+	int i = 0;
+	
+	for (; i < 144; i++) s->lengths[i] = 8;
+	for (; i < 256; i++) s->lengths[i] = 9;
+	for (; i < 280; i++) s->lengths[i] = 7;
+	for (; i < HUFFMAN_LITERAL_CODES; i++) s->lengths[i] = 8;
+	inflate_build(&s->literal, s->lengths, HUFFMAN_LITERAL_CODES);
+	
+	memset(s->lengths, 5, HUFFMAN_DISTANCE_CODES);
+	inflate_build(&s->distance, s->lengths, HUFFMAN_DISTANCE_CODES);
+	
+	return inflate_codes(s);
+}
+
+static bool inflate_dynamic(inflateState *s)
+{
+	uint16_t literals = inflate_bits(s, 5) + 257;
+	uint16_t distances = inflate_bits(s, 5) + 1;
+	uint16_t codeLengths = inflate_bits(s, 4) + 4;
+	int index = 0;
+	
+	if (s->error || (literals > HUFFMAN_LITERAL_CODES) || (distances > HUFFMAN_DISTANCE_CODES))
+	{
+		return false;
+	}
+	
+	// Code lengths of the code length alphabet, it decodes the other two
+	memset(s->lengths, 0, HUFFMAN_CODE_LENGTHS);
+	for (int i = 0; i < codeLengths; i++)
+	{
+		s->lengths[codeLengthOrder[i]] = inflate_bits(s, 3);
+	}
+	if (s->error || !inflate_build(&s->literal, s->lengths, HUFFMAN_CODE_LENGTHS))
+	{
+		return false;
+	}
+	
+	while (index < literals + distances)
+	{
+		int symbol = inflate_decode(s, &s->literal);
+		uint8_t repeat, value = 0;
+		
+		if (symbol < 0)
+		{
+			return false;
+		}
+		if (symbol < 16)
+		{
+			s->lengths[index++] = symbol;
+			continue;
+		}
+		
+		if (symbol == 16)
+		{
+			if (index == 0)
+			{
+				return false;
+			}
+			value = s->lengths[index - 1];
+			repeat = 3 + inflate_bits(s, 2);
+		}
+		else if (symbol == 17)
+		{
+			repeat = 3 + inflate_bits(s, 3);
+		}
+		else
+		{
+			repeat = 11 + inflate_bits(s, 7);
+		}
+		
+		if (s->error || (index + repeat > literals + distances))
+		{
+			return false;
+		}
+		memset(&s->lengths[index], value, repeat);
+		index += repeat;
+	}
+	
+	// A block without an end code can't be decoded
+	if (s->lengths[HUFFMAN_END_OF_BLOCK] == 0)
+	{
+		return false;
+	}
+	
+	if (!inflate_build(&s->literal, s->lengths, literals) ||
+		!inflate_build(&s->distance, &s->lengths[literals], distances))
+	{
+		return false;
+	}
+	
+	return inflate_codes(s);
+}
+
+int deflate_inflate(const uint8_t *in, size_t length, uint8_t *out, size_t outSize)
+{
+	inflateState *s = calloc(1, sizeof(inflateState));
+	bool last = false;
+	bool valid = true;
+	int result = -1;
+	
+	if (s == NULL)
+	{
+		return -1;
+	}
+	s->in = in;
+	s->inLength = length;
+	s->out = out;
+	s->outSize = outSize;
+	
+	// Blocks until the final one, or until the flush that ended the message
+	while (valid && !last && inflate_input_left(s))
+	{
+		last = inflate_bits(s, 1);
+		switch (inflate_bits(s, 2))
+		{
+		case 0:
+			valid = inflate_stored(s);
+			break;
+		case 1:
+			valid = inflate_fixed(s);
+			break;
+		case 2:
+			valid = inflate_dynamic(s);
+			break;
+		default:
+			valid = false;
+			break;
+		}
+		valid = valid && !s->error;
+	}
+	
+	if (valid)
+	{
+		result = s->outPos;
+	}
+	free(s);
+	return result;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Raw DEFLATE (RFC 1951) for WebSocket permessage-deflate, no context kept
+   between messages. The compressor emits a single fixed Huffman block and
+   looks back at most DEFLATE_WINDOW bytes. The inflater takes any block type,
+   the window is the output buffer itself. */
+#define DEFLATE_WINDOW_BITS		10
+#define DEFLATE_WINDOW			(1 << DEFLATE_WINDOW_BITS)
+
+/* Compress in to out, returns the compressed length, 0 if it doesn't fit in outSize */
+size_t deflate_compress(const uint8_t *in, size_t length, uint8_t *out, size_t outSize);
+/* Inflate a message with its 00 00 ff ff tail stripped, returns the inflated length, -1 if
+   malformed or longer than outSize */
+int deflate_inflate(const uint8_t *in, size_t length, uint8_t *out, size_t outSize);
@@ -0,0 +1,300 @@
+/* Multi-robot group channel
+
+   Robots on a shared station network join one multicast group, so a coach
+   reaches all of them with a single datagram. The coach syncs its clock with
+   every robot over unicast first, then one command carrying an "at" time is
+   applied by all addressed robots at the same moment. Every addressed robot
+   answers with its receive time and latency, the coach sees late robots.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+
+#include "group.h"
+#include "command.h"
+#include "boot.h"
+#include "sysmon.h"
+
+#define PORT					CONFIG_GROUP_PORT
+#define GROUP_PACKET_LENGTH		512		/**< \brief Room for a full batch*/
+#define GROUP_COACH_TIMEOUT_MS	2000	/**< \brief Silent coach hands the group over to another sender*/
+#define GROUP_ROBOT_BIT			((uint32_t)1 << (CONFIG_GROUP_ROBOT_ID - 1))
+
+/* Only one coach drives the group at a time */
+typedef struct groupCoach_t
+{
+	uint32_t addr;
+	uint16_t port;
+	uint32_t seq;
+	TickType_t lastTick;
+	bool used;
+	bool restarted;				/* back after a silence, its sequence starts over */
+	commandClient client;
+} groupCoach;
+
+static const char *TAG = "group";
+static groupCoach coach;
+static uint32_t dropped;
+
+static bool group_coach_expired(TickType_t now)
+{
+	return !coach.used || ((now - coach.lastTick) > pdMS_TO_TICKS(GROUP_COACH_TIMEOUT_MS));
+}
+
+/* Coach state for the sender, NULL while another coach is active */
+static groupCoach *group_coach_find(const struct sockaddr_in *sourceAddr, TickType_t now)
+{
+	bool same = coach.used &&
+		(coach.addr == sourceAddr->sin_addr.s_addr) &&
+		(coach.port == sourceAddr->sin_port);
+
+	if (same)
+	{
+		// A coach back after a silence keeps control and its clock sync
+		coach.restarted = coach.restarted || group_coach_expired(now);
+		return &coach;
+	}
+	if (!group_coach_expired(now))
+	{
+		return NULL;
+	}
+
+	if (coach.used)
+	{
+		command_client_close(&coach.client);
+	}
+	coach.addr = sourceAddr->sin_addr.s_addr;
+	coach.port = sourceAddr->sin_port;
+	coach.used = false;
+	coach.restarted = false;
+	return &coach;
+}
+
+static void group_reply(int sock, const struct sockaddr_in *sourceAddr, cJSON *reply)
+{
+	char* stringSend = cJSON_PrintUnformatted(reply);
+
+	if (stringSend != NULL)
+	{
+		if (sendto(sock, stringSend, strlen(stringSend), 0, (const struct sockaddr *)sourceAddr, sizeof(*sourceAddr)) < 0)
+		{
+			ESP_LOGW(TAG, "Reply failed: errno %d", errno);
+		}
+		free(stringSend);
+	}
+	cJSON_Delete(reply);
+}
+
+static void group_discover(int sock, const struct sockaddr_in *sourceAddr, uint32_t seq)
+{
+	cJSON *reply = cJSON_CreateObject();
+
+	cJSON_AddNumberToObject(reply, "robot", CONFIG_GROUP_ROBOT_ID);
+	cJSON_AddNumberToObject(reply, "seq", seq);
+	// Synced only to the coach itself, not to another sender on its host
+	cJSON_AddNumberToObject(reply, "synced", (sourceAddr->sin_addr.s_addr == coach.addr) &&
+		(sourceAddr->sin_port == coach.port) && clock_sync_valid(&coach.client.sync));
+	group_reply(sock, sourceAddr, reply);
+}
+
+/* Clock sync, same exchange as on the WebSocket, times are milliseconds */
+static void group_sync(int sock, const struct sockaddr_in *sourceAddr, const cJSON *root, int64_t received)
+{
+	cJSON *item = cJSON_GetObjectItem(root, "sync");
+
+	if ((item != NULL) && cJSON_IsNumber(item))
+	{
+		cJSON *reply = cJSON_CreateObject();
+		cJSON *sync = cJSON_CreateObject();
+		cJSON_AddNumberToObject(sync, "c0", item->valuedouble);
+		cJSON_AddNumberToObject(sync, "r1", (double)received / 1000.0);
+		cJSON_AddItemToObject(reply, "sync", sync);
+		group_reply(sock, sourceAddr, reply);
+	}
+
+	item = cJSON_GetObjectItem(root, "synced");
+	if (item != NULL)
+	{
+		int64_t c0, r1, c3;
+
+		if (!command_json_time(item, "c0", &c0) ||
+			!command_json_time(item, "r1", &r1) ||
+			!command_json_time(item, "c3", &c3))
+		{
+			ESP_LOGW(TAG, "Incomplete sync exchange");
+			return;
+		}
+
+		if (!clock_sync_sample(&coach.client.sync, c0, r1, c3))
+		{
+			ESP_LOGD(TAG, "Sync exchange rejected");
+		}
+	}
+}
+
+/* Apply a command addressed to this robot and report back:
+   "r1" receive time, "latency" one-way from the coach's "sent" time,
+   "lead" from receipt to the "at" time, negative if it came too late */
+static void group_command(int sock, const struct sockaddr_in *sourceAddr, const cJSON *root, uint32_t seq, int64_t received)
+{
+	int64_t clientTime, robotTime;
+	double to;
+
+	// A mask that is no 32 bit number addresses nobody
+	if (cJSON_HasObjectItem(root, "to") &&
+		(!command_json_number(root, "to", &to) || (to < 0) || (to > UINT32_MAX) ||
+		 !((uint32_t)to & GROUP_ROBOT_BIT)))
+	{
+		return;
+	}
+
+	bool ok = command_handle_json(&coach.client, root);
+
+	cJSON *reply = cJSON_CreateObject();
+	cJSON_AddNumberToObject(reply, "ack", seq);
+	cJSON_AddNumberToObject(reply, "robot", CONFIG_GROUP_ROBOT_ID);
+	cJSON_AddNumberToObject(reply, "ok", ok);
+	cJSON_AddNumberToObject(reply, "r1", (double)received / 1000.0);
+
+	if (command_json_time(root, "sent", &clientTime) &&
+		clock_sync_to_robot(&coach.client.sync, clientTime, &robotTime))
+	{
+		cJSON_AddNumberToObject(reply, "latency", (double)(received - robotTime) / 1000.0);
+	}
+
+	if (command_json_time(root, "at", &clientTime) &&
+		clock_sync_to_robot(&coach.client.sync, clientTime, &robotTime))
+	{
+		cJSON_AddNumberToObject(reply, "lead", (double)(robotTime - received) / 1000.0);
+	}
+
+	group_reply(sock, sourceAddr, reply);
+}
+
+/* One datagram from the group socket, data has room to null-terminate it */
+static void group_datagram(int sock, const struct sockaddr_in *sourceAddr, uint8_t *data, int len, int64_t received)
+{
+	if (len <= GROUP_SEQ_LENGTH) {
+		return;
+	}
+
+	uint32_t seq = ((uint32_t)data[0] << 24) |
+				   ((uint32_t)data[1] << 16) |
+				   ((uint32_t)data[2] << 8) |
+				   (uint32_t)data[3];
+
+	data[len] = 0;
+	cJSON *root = cJSON_Parse((char*)&data[GROUP_SEQ_LENGTH]);
+	if (root == NULL) {
+		ESP_LOGW(TAG, "Invalid JSON");
+		return;
+	}
+
+	// Any sender may look for robots, only the coach drives them
+	if (cJSON_HasObjectItem(root, "discover")) {
+		group_discover(sock, sourceAddr, seq);
+		cJSON_Delete(root);
+		return;
+	}
+
+	TickType_t now = xTaskGetTickCount();
+	groupCoach *peer = group_coach_find(sourceAddr, now);
+
+	// Serial number arithmetic, survives the sequence wrapping around
+	if ((peer == NULL) || (peer->used && !peer->restarted && ((int32_t)(seq - peer->seq) <= 0))) {
+		dropped++;
+		ESP_LOGD(TAG, "Dropped datagram %u, %u dropped so far", seq, dropped);
+		cJSON_Delete(root);
+		return;
+	}
+
+	if (!peer->used) {
+		command_client_init(&peer->client);
+	}
+	peer->seq = seq;
+	peer->lastTick = now;
+	peer->used = true;
+	peer->restarted = false;
+
+	if (cJSON_HasObjectItem(root, "sync") || cJSON_HasObjectItem(root, "synced")) {
+		group_sync(sock, sourceAddr, root, received);
+	}
+	else {
+		group_command(sock, sourceAddr, root, seq, received);
+	}
+	cJSON_Delete(root);
+}
+
+static void group_task(void *pvParameters)
+{
+	uint8_t rx_buffer[GROUP_PACKET_LENGTH];
+	struct sockaddr_in destAddr, sourceAddr;
+	struct ip_mreq mreq;
+	socklen_t addrLen;
+
+	// Joining the group needs an interface with an address
+	boot_wait(BOOT_PHASE_IP_READY, portMAX_DELAY);
+
+	mreq.imr_multiaddr.s_addr = inet_addr(CONFIG_GROUP_ADDRESS);
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (!IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr)))
+	{
+		ESP_LOGE(TAG, "%s is not a multicast address", CONFIG_GROUP_ADDRESS);
+		vTaskDelete(NULL);
+		return;
+	}
+
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+		vTaskDelete(NULL);
+		return;
+	}
+
+	destAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	destAddr.sin_family = AF_INET;
+	destAddr.sin_port = htons(PORT);
+	if (bind(sock, (struct sockaddr *)&destAddr, sizeof(destAddr)) != 0) {
+		ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+		close(sock);
+		vTaskDelete(NULL);
+		return;
+	}
+
+	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+		ESP_LOGE(TAG, "Unable to join %s: errno %d", CONFIG_GROUP_ADDRESS, errno);
+		close(sock);
+		vTaskDelete(NULL);
+		return;
+	}
+	ESP_LOGI(TAG, "Robot %d joined group %s port %d", CONFIG_GROUP_ROBOT_ID, CONFIG_GROUP_ADDRESS, PORT);
+
+	while (1) {
+		addrLen = sizeof(sourceAddr);
+		// Leave room to null-terminate the JSON part
+		int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&sourceAddr, &addrLen);
+		// Receive time for sync and latency, taken before parsing delays it
+		int64_t received = esp_timer_get_time();
+		if (len < 0) {
+			ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+			continue;
+		}
+
+		group_datagram(sock, &sourceAddr, rx_buffer, len, received);
+	}
+
+	close(sock);
+	vTaskDelete(NULL);
+}
+
+void group_init()
+{
+	xTaskCreate(group_task, "group", TASK_STACK_GROUP, NULL, TASK_PRIORITY_CONTROL, NULL);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+/* Group datagram: 4 byte big-endian sequence number followed by JSON,
+   the same layout as the UDP control channel.
+   {"discover":1}                      every robot answers {"robot":id,"seq":n,"synced":0|1}
+   {"sync":c0}, {"synced":{...}}       clock sync, sent unicast to each robot
+   {"to":mask,"sent":ms,"at":ms,...}   command or batch for the robots in mask, all if absent,
+                                       answered {"ack":n,"robot":id,"ok":0|1,"r1":ms,...} */
+#define GROUP_SEQ_LENGTH	4
+
+void group_init();
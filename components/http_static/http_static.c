@@ -0,0 +1,380 @@
+/* Static HTTP file server
+
+   Just enough HTTP/1.1 for a browser to fetch the control page: one request
+   per connection, files streamed from flash a chunk at a time.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "http_static.h"
+#include "boot.h"
+#include "storage.h"
+
+#define HTTP_ROOT				STORAGE_BASE_PATH "/www"
+#define HTTP_INDEX				"/index.html"
+#define HTTP_GZIP_SUFFIX		".gz"
+#define HTTP_PATH_LENGTH		64		/**< \brief Longest request path*/
+#define HTTP_FILE_LENGTH		(sizeof(HTTP_ROOT) + HTTP_PATH_LENGTH + sizeof(HTTP_GZIP_SUFFIX))
+#define HTTP_ETAG_LENGTH		24
+#define HTTP_ETAG_CACHE_NUM		8		/**< \brief Files whose content hash is kept, the web app is a handful*/
+#define HTTP_HASH_INIT			2166136261u	/**< \brief FNV-1a offset basis*/
+#define HTTP_ENCODING_LENGTH	96		/**< \brief Longest Accept-Encoding value looked at*/
+#define HTTP_HEADER_LENGTH		320		/**< \brief Response head*/
+#define HTTP_CHUNK_LENGTH		1024	/**< \brief File bytes read and sent at a time*/
+
+static const char *TAG = "http_static";
+
+/* Content hash of a served file. The partition is only rewritten by
+   flashing it, which reboots, so a hash stays valid until then. */
+typedef struct httpEtag_t
+{
+	uint32_t name;				/* hash of the file name */
+	uint32_t size;
+	uint32_t content;
+} httpEtag;
+
+/* Only the listener task serves files, no lock needed */
+static httpEtag etagCache[HTTP_ETAG_CACHE_NUM];
+static uint8_t etagNext;
+
+typedef struct httpType_t
+{
+	const char *extension;
+	const char *type;
+} httpType;
+
+static const httpType contentTypes[] = {
+	{ ".html", "text/html" },
+	{ ".js", "application/javascript" },
+	{ ".css", "text/css" },
+	{ ".json", "application/json" },
+	{ ".svg", "image/svg+xml" },
+	{ ".png", "image/png" },
+	{ ".ico", "image/x-icon" },
+};
+
+static const char *http_content_type(const char *path)
+{
+	const char *extension = strrchr(path, '.');
+	
+	if (extension != NULL)
+	{
+		for (int i = 0; i < sizeof(contentTypes) / sizeof(contentTypes[0]); i++)
+		{
+			if (strcasecmp(extension, contentTypes[i].extension) == 0)
+			{
+				return contentTypes[i].type;
+			}
+		}
+	}
+	return "application/octet-stream";
+}
+
+static bool http_send_all(int sock, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		int sent = send(sock, data, length, 0);
+		
+		if (sent <= 0)
+		{
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+static void http_send_status(int sock, const char *status, const char *extra)
+{
+	char header[HTTP_HEADER_LENGTH];
+	int length = snprintf(header, sizeof(header),
+		"HTTP/1.1 %s\r\n%sContent-Length: 0\r\nConnection: close\r\n\r\n",
+		status,
+		(extra != NULL) ? extra : "");
+	
+	if (length < sizeof(header))
+	{
+		http_send_all(sock, header, length);
+	}
+}
+
+/* Path of the request line, without query, "/" mapped to the index page */
+static bool http_request_path(const char *request, char *path, bool *head)
+{
+	const char *start;
+	size_t length;
+	
+	if (strncmp(request, "GET ", 4) == 0)
+	{
+		*head = false;
+		start = request + 4;
+	}
+	else if (strncmp(request, "HEAD ", 5) == 0)
+	{
+		*head = true;
+		start = request + 5;
+	}
+	else
+	{
+		return false;
+	}
+	
+	length = strcspn(start, " ?#\r\n");
+	if ((length == 0) || (start[0] != '/') || (length >= HTTP_PATH_LENGTH))
+	{
+		return false;
+	}
+	memcpy(path, start, length);
+	path[length] = '\0';
+	
+	if (strcmp(path, "/") == 0)
+	{
+		strcpy(path, HTTP_INDEX);
+	}
+	return true;
+}
+
+bool http_header_value(const char *request, const char *name, char *value, size_t size)
+{
+	size_t nameLength = strlen(name);
+	const char *line = strstr(request, "\r\n");
+	
+	while (line != NULL)
+	{
+		line += 2;
+		if ((strncasecmp(line, name, nameLength) == 0) && (line[nameLength] == ':'))
+		{
+			const char *start = line + nameLength + 1;
+			start += strspn(start, " \t");
+			size_t length = strcspn(start, "\r\n");
+			
+			if (length >= size)
+			{
+				return false;
+			}
+			memcpy(value, start, length);
+			value[length] = '\0';
+			return true;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return false;
+}
+
+/* True unless the client leaves gzip out of Accept-Encoding or gives it q=0 */
+static bool http_accepts_gzip(const char *request)
+{
+	char value[HTTP_ENCODING_LENGTH];
+	const char *token = value;
+	
+	if (!http_header_value(request, "Accept-Encoding", value, sizeof(value)))
+	{
+		return false;
+	}
+	
+	while (*token != '\0')
+	{
+		token += strspn(token, " \t,");
+		size_t length = strcspn(token, ",");
+		size_t name = strcspn(token, " \t;,");
+		
+		if ((name == 4) && (strncasecmp(token, "gzip", 4) == 0))
+		{
+			const char *q = strstr(token, "q=");
+			return (q == NULL) || (q >= token + length) || (strtod(q + 2, NULL) > 0);
+		}
+		token += length;
+	}
+	return false;
+}
+
+/* FNV-1a, enough to tell two versions of a file apart */
+static uint32_t http_hash(uint32_t hash, const uint8_t *data, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/* Content hash of file, read once per boot and then taken from the cache */
+static bool http_file_hash(const char *file, uint32_t size, uint32_t *content)
+{
+	uint32_t name = http_hash(HTTP_HASH_INIT, (const uint8_t*)file, strlen(file));
+	
+	for (int i = 0; i < HTTP_ETAG_CACHE_NUM; i++)
+	{
+		if ((etagCache[i].name == name) && (etagCache[i].size == size))
+		{
+			*content = etagCache[i].content;
+			return true;
+		}
+	}
+	
+	uint8_t *chunk = malloc(HTTP_CHUNK_LENGTH);
+	FILE *f = fopen(file, "r");
+	uint32_t hash = HTTP_HASH_INIT;
+	size_t length;
+	bool ok = (chunk != NULL) && (f != NULL);
+	
+	if (ok)
+	{
+		while ((length = fread(chunk, 1, HTTP_CHUNK_LENGTH, f)) > 0)
+		{
+			hash = http_hash(hash, chunk, length);
+		}
+		ok = !ferror(f);
+	}
+	if (f != NULL)
+	{
+		fclose(f);
+	}
+	free(chunk);
+	
+	if (ok)
+	{
+		// Oldest entry makes room
+		etagCache[etagNext].name = name;
+		etagCache[etagNext].size = size;
+		etagCache[etagNext].content = hash;
+		etagNext = (etagNext + 1) % HTTP_ETAG_CACHE_NUM;
+		*content = hash;
+	}
+	return ok;
+}
+
+static void http_send_file(int sock, const char *file)
+{
+	char *chunk = malloc(HTTP_CHUNK_LENGTH);
+	FILE *f = fopen(file, "r");
+	size_t length;
+	
+	if ((chunk == NULL) || (f == NULL))
+	{
+		ESP_LOGW(TAG, "Can't send %s", file);
+	}
+	else
+	{
+		// Only one chunk in RAM, whatever the file size
+		while ((length = fread(chunk, 1, HTTP_CHUNK_LENGTH, f)) > 0)
+		{
+			if (!http_send_all(sock, chunk, length))
+			{
+				break;
+			}
+		}
+	}
+	
+	if (f != NULL)
+	{
+		fclose(f);
+	}
+	free(chunk);
+}
+
+void http_static_serve(int sock, const char *request)
+{
+	char path[HTTP_PATH_LENGTH];
+	char file[HTTP_FILE_LENGTH];
+	char etag[HTTP_ETAG_LENGTH];
+	char match[HTTP_ETAG_LENGTH];
+	char header[HTTP_HEADER_LENGTH];
+	struct stat st;
+	uint32_t content;
+	bool head, gzip;
+	
+	if (!http_request_path(request, path, &head))
+	{
+		http_send_status(sock, "405 Method Not Allowed", "Allow: GET, HEAD\r\n");
+		return;
+	}
+	
+	if (strstr(path, "..") != NULL)
+	{
+		http_send_status(sock, "404 Not Found", NULL);
+		return;
+	}
+	
+	if (!boot_wait(BOOT_PHASE_STORAGE_READY, 0))
+	{
+		http_send_status(sock, "503 Service Unavailable", "Retry-After: 1\r\n");
+		return;
+	}
+	
+	// The gzipped copy only for clients that take it, the plain file for the others
+	snprintf(file, sizeof(file), "%s%s%s", HTTP_ROOT, path, HTTP_GZIP_SUFFIX);
+	gzip = (stat(file, &st) == 0);
+	if (!gzip || !http_accepts_gzip(request))
+	{
+		snprintf(file, sizeof(file), "%s%s", HTTP_ROOT, path);
+		if (stat(file, &st) != 0)
+		{
+			ESP_LOGI(TAG, "%s not found%s", path, gzip ? " uncompressed" : "");
+			http_send_status(sock, gzip ? "406 Not Acceptable" : "404 Not Found", NULL);
+			return;
+		}
+		gzip = false;
+	}
+	
+	// SPIFFS keeps no modification time, the content tells versions apart
+	if (!http_file_hash(file, st.st_size, &content))
+	{
+		ESP_LOGW(TAG, "Can't read %s", file);
+		http_send_status(sock, "500 Internal Server Error", NULL);
+		return;
+	}
+	snprintf(etag, sizeof(etag), "\"%lx-%08x\"", (unsigned long)st.st_size, content);
+	// The page is checked for a new version on every load, what it loads is cached
+	char cacheControl[HTTP_ETAG_LENGTH];
+	if (strcmp(http_content_type(path), "text/html") == 0)
+	{
+		strcpy(cacheControl, "no-cache");
+	}
+	else
+	{
+		snprintf(cacheControl, sizeof(cacheControl), "max-age=%d", HTTP_MAX_AGE_S);
+	}
+	
+	if (http_header_value(request, "If-None-Match", match, sizeof(match)) && (strcmp(match, etag) == 0))
+	{
+		int length = snprintf(header, sizeof(header),
+			"HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: %s\r\nVary: Accept-Encoding\r\nConnection: close\r\n\r\n",
+			etag,
+			cacheControl);
+		http_send_all(sock, header, length);
+		return;
+	}
+	
+	int length = snprintf(header, sizeof(header),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %ld\r\n"
+		"%s"
+		"ETag: %s\r\n"
+		"Cache-Control: %s\r\n"
+		"Vary: Accept-Encoding\r\n"
+		"Connection: close\r\n\r\n",
+		http_content_type(path),
+		(long)st.st_size,
+		gzip ? "Content-Encoding: gzip\r\n" : "",
+		etag,
+		cacheControl);
+	
+	if ((length >= sizeof(header)) || !http_send_all(sock, header, length) || head)
+	{
+		return;
+	}
+	http_send_file(sock, file);
+}
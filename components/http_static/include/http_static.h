@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Static files for plain HTTP requests on the WebSocket port.
+
+   Files live under STORAGE_BASE_PATH "/www" on the storage partition, "/" is
+   "/index.html". A gzipped copy, name.gz, is preferred over the plain file
+   when the request's Accept-Encoding allows gzip, and sent with
+   Content-Encoding: gzip. Responses carry an ETag from the file size and a
+   hash of its content, a matching If-None-Match gets 304. The HTML page is
+   revalidated on every load, other files are cached for HTTP_MAX_AGE_S. */
+#define HTTP_MAX_AGE_S			604800
+
+/* Answer a GET or HEAD request, request is the null-terminated request head.
+   The connection is not kept alive, the caller closes sock afterwards. */
+void http_static_serve(int sock, const char *request);
+/* Value of a request header, names are case-insensitive. Returns false if the
+   header is missing or its value does not fit in size. */
+bool http_header_value(const char *request, const char *name, char *value, size_t size);
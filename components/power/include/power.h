@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef enum powerState_t
+{
+	POWER_ACTIVE = 0,			/* 160 MHz, no modem sleep, outputs attached */
+	POWER_IDLE					/* 80 MHz, modem sleep, outputs detached */
+} powerState;
+
+/* Time spent in each state and how long waking took */
+typedef struct powerStats_t
+{
+	powerState state;
+	uint32_t idleCount;			/* times idle was entered */
+	uint32_t idleMs;			/* total time idle, the current stretch included */
+	uint32_t activeMs;			/* total time active */
+	uint32_t lastWakeUs;		/* last wake, from the request to CPU, WiFi and outputs back */
+	uint32_t maxWakeUs;
+} powerStats;
+
+void power_init();
+/* A client connected or sent something, back to full performance. Cheap while active. */
+void power_wake();
+void power_get_stats(powerStats *stats);
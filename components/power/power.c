@@ -0,0 +1,234 @@
+/* Idle power state
+
+   Between sessions nothing needs the outputs, the full CPU clock or a radio
+   that wakes for every beacon. After CONFIG_POWER_IDLE_TIMEOUT_S without a
+   command or heartbeat the outputs are detached, modem sleep is enabled and
+   the CPU drops to 80 MHz. power_wake() from the command path undoes it,
+   how long that takes is measured and reported with the time in each state.
+*/
+
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "power.h"
+#include "Servo.h"
+#include "boot.h"
+#include "sysmon.h"
+
+#define POWER_CHECK_PERIOD_MS		1000	/**< \brief Inactivity check interval*/
+
+static const char *TAG = "power";
+static TaskHandle_t powerTask;
+static volatile powerState state = POWER_ACTIVE;
+
+/* Shared with the callers of power_wake() and power_get_stats(), 64 bit
+   accesses are not atomic here so all of them are guarded by a critical section */
+static int64_t wakeRequest;
+static int64_t stateTime;		/* start of the current state */
+static powerStats stats;
+/* Entering idle takes a while, the outputs detach first. A wake before the
+   idle decision holds it off like a command, one after it calls it off. */
+static int64_t lastWake;
+static bool idleEntering;		/* between the idle decision and the idle state */
+static bool wakePending;		/* power_wake() came while idle was entered */
+
+static void power_set_performance(bool full)
+{
+	ESP_ERROR_CHECK(esp_set_cpu_freq(full ? ESP_CPU_FREQ_160M : ESP_CPU_FREQ_80M));
+#ifndef CONFIG_ESP_WIFI_MODE_AP
+	// An AP has to stay awake for its stations, only a station may sleep
+	ESP_ERROR_CHECK(esp_wifi_set_ps(full ? WIFI_PS_NONE : WIFI_PS_MIN_MODEM));
+#endif
+}
+
+/* Close the current state's stretch and start the next one */
+static void power_enter(powerState next, int64_t now)
+{
+	uint32_t ms = (uint32_t)((now - stateTime) / 1000);
+
+	taskENTER_CRITICAL();
+	if (state == POWER_IDLE)
+	{
+		stats.idleMs += ms;
+	}
+	else
+	{
+		stats.activeMs += ms;
+	}
+	stats.state = next;
+	stats.idleCount += (next == POWER_IDLE) ? 1 : 0;
+	stateTime = now;
+	state = next;
+	taskEXIT_CRITICAL();
+}
+
+static void power_idle(int64_t timeout)
+{
+	bool woken;
+
+	taskENTER_CRITICAL();
+	woken = (esp_timer_get_time() - lastWake) < timeout;
+	idleEntering = !woken;
+	wakePending = false;
+	taskEXIT_CRITICAL();
+	if (woken)
+	{
+		return;
+	}
+
+	// The control task runs at a higher priority, it has answered by the time this returns
+	servo_suspend();
+	bool suspended = servo_suspended();
+	if (suspended)
+	{
+		power_set_performance(false);
+	}
+
+	// Checked and committed in one go, a wake from here on sees the idle state
+	taskENTER_CRITICAL();
+	woken = wakePending || !suspended;
+	idleEntering = false;
+	if (!woken)
+	{
+		power_enter(POWER_IDLE, esp_timer_get_time());
+	}
+	taskEXIT_CRITICAL();
+
+	if (!suspended)
+	{
+		return;
+	}
+	if (woken)
+	{
+		power_set_performance(true);
+		servo_resume();
+		ESP_LOGI(TAG, "Idle called off by a wake");
+		return;
+	}
+	ESP_LOGI(TAG, "Idle after %d s without commands", servo_idle_ms() / 1000);
+}
+
+static void power_active()
+{
+	int64_t request;
+
+	power_set_performance(true);
+	servo_resume();
+
+	int64_t now = esp_timer_get_time();
+
+	taskENTER_CRITICAL();
+	request = wakeRequest;
+	wakeRequest = 0;
+	taskEXIT_CRITICAL();
+
+	uint32_t wake = (uint32_t)(now - request);
+	power_enter(POWER_ACTIVE, now);
+
+	taskENTER_CRITICAL();
+	stats.lastWakeUs = wake;
+	stats.maxWakeUs = MAX(stats.maxWakeUs, wake);
+	taskEXIT_CRITICAL();
+	ESP_LOGI(TAG, "Awake in %u us", wake);
+}
+
+#ifdef CONFIG_POWER_IDLE_ENABLE
+static void power_task(void *argument)
+{
+	int64_t timeout = (int64_t)CONFIG_POWER_IDLE_TIMEOUT_S * 1000000;
+
+	// Modem sleep can only be set once WiFi runs
+	boot_wait(BOOT_PHASE_WIFI_READY, portMAX_DELAY);
+	power_set_performance(true);
+	taskENTER_CRITICAL();
+	stateTime = esp_timer_get_time();
+	taskEXIT_CRITICAL();
+
+	for (;;)
+	{
+		if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(POWER_CHECK_PERIOD_MS)) > 0)
+		{
+			if (state == POWER_IDLE)
+			{
+				power_active();
+			}
+			continue;
+		}
+
+		// A wake without a command yet, a client that just connected, also holds off idle
+		int64_t now = esp_timer_get_time();
+		if ((state == POWER_ACTIVE) &&
+			((now - stateTime) >= timeout) &&
+			((int64_t)servo_idle_ms() * 1000 >= timeout))
+		{
+			power_idle(timeout);
+		}
+	}
+}
+#endif
+
+void power_init()
+{
+#ifdef CONFIG_POWER_IDLE_ENABLE
+	// Above the network tasks, a wake is handled before the command that caused it
+	xTaskCreate(power_task, "power", TASK_STACK_POWER, NULL, TASK_PRIORITY_CONTROL, &powerTask);
+#endif
+}
+
+void power_wake()
+{
+	bool idle;
+
+	if (powerTask == NULL)
+	{
+		return;
+	}
+
+	int64_t now = esp_timer_get_time();
+
+	// Recorded even while active, power_idle() may be about to detach the outputs
+	taskENTER_CRITICAL();
+	lastWake = now;
+	wakePending = wakePending || idleEntering;
+	idle = (state == POWER_IDLE);
+	// The first request of a wake is the one the latency is measured from
+	if (idle && (wakeRequest == 0))
+	{
+		wakeRequest = now;
+	}
+	taskEXIT_CRITICAL();
+
+	if (idle)
+	{
+		xTaskNotifyGive(powerTask);
+	}
+}
+
+void power_get_stats(powerStats *out)
+{
+	int64_t now = esp_timer_get_time();
+	int64_t since;
+
+	taskENTER_CRITICAL();
+	*out = stats;
+	since = stateTime;
+	taskEXIT_CRITICAL();
+
+	// The current stretch counts too
+	if (out->state == POWER_IDLE)
+	{
+		out->idleMs += (uint32_t)((now - since) / 1000);
+	}
+	else if (since != 0)
+	{
+		out->activeMs += (uint32_t)((now - since) / 1000);
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Capture format, a stream of records, all fields big-endian:
+   [0] type, [1] payload length, [2..5] time, low 32 bits of
+   esp_timer_get_time() microseconds (wraps every ~71 minutes, records are in
+   time order so a decoder can unwrap it), then the payload. */
+#define RECORD_HEADER_LENGTH		6
+#define RECORD_PAYLOAD_MAX			32
+
+typedef enum
+{
+	RECORD_COMMAND = 1,		/* [0] recordStatus, [1..4] "at" minus time in us (signed), [5..12] command binary encoding */
+	RECORD_PWM_COMMIT,		/* u16 duty per PWM channel, in channel order */
+	RECORD_MARK,			/* recording (re)started, no payload */
+	RECORD_TRIP,			/* safe stop, [0] servoTrip reason */
+} recordType;
+
+typedef enum
+{
+	RECORD_ACCEPTED = 0,
+	RECORD_REJECTED,		/* over the client's rate limit */
+	RECORD_DROPPED,			/* servo path full */
+} recordStatus;
+
+/* Position in the capture of a reader, absolute byte count since boot */
+typedef struct recordCursor_t
+{
+	uint32_t position;
+	uint32_t lost;			/* bytes overwritten before this reader got to them */
+} recordCursor;
+
+void recorder_init();
+/* Append a record, safe from any task including the actuator loop, never blocks */
+void recorder_write(recordType type, const uint8_t *payload, uint8_t length);
+/* Drop everything recorded so far */
+void recorder_clear();
+/* Start a reader at the oldest record still in the ring */
+void recorder_cursor_init(recordCursor *cursor);
+/* Copy whole records from the cursor on, returns the number of bytes, 0 when it caught up */
+size_t recorder_read(recordCursor *cursor, uint8_t *buf, size_t size);
@@ -0,0 +1,220 @@
+/* Session recorder
+
+   Decoded commands and PWM commits go into a RAM ring buffer as they happen.
+   Readers (WebSocket download, SPIFFS flush) keep their own cursor and copy
+   whole records out at their own pace, the writers never wait for them.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "recorder.h"
+#include "boot.h"
+#include "storage.h"
+#include "sysmon.h"
+
+#ifdef CONFIG_RECORDER_ENABLE
+#define RECORDER_RING_SIZE		CONFIG_RECORDER_BUFFER_SIZE
+#if (RECORDER_RING_SIZE & (RECORDER_RING_SIZE - 1))
+#error "CONFIG_RECORDER_BUFFER_SIZE must be a power of two"
+#endif
+#define RECORDER_RING_MASK		(RECORDER_RING_SIZE - 1)
+#endif
+
+#define RECORDER_FILE			STORAGE_BASE_PATH "/session.bin"
+#define RECORDER_FILE_OLD		STORAGE_BASE_PATH "/session.old"
+#define RECORDER_FLUSH_LENGTH	256		/**< \brief Bytes copied out of the ring at a time*/
+
+static const char *TAG = "recorder";
+
+#ifdef CONFIG_RECORDER_ENABLE
+static uint8_t ring[RECORDER_RING_SIZE];
+#endif
+/* Absolute byte positions, the ring index is the low bits */
+static uint32_t head;			/* next byte written */
+static uint32_t tail;			/* oldest record still in the ring */
+
+#ifdef CONFIG_RECORDER_ENABLE
+static void ring_copy_in(uint32_t position, const uint8_t *data, uint32_t length)
+{
+	for (uint32_t i = 0; i < length; i++)
+	{
+		ring[(position + i) & RECORDER_RING_MASK] = data[i];
+	}
+}
+
+static void ring_copy_out(uint32_t position, uint8_t *data, uint32_t length)
+{
+	for (uint32_t i = 0; i < length; i++)
+	{
+		data[i] = ring[(position + i) & RECORDER_RING_MASK];
+	}
+}
+
+static uint32_t ring_record_length(uint32_t position)
+{
+	return RECORD_HEADER_LENGTH + ring[(position + 1) & RECORDER_RING_MASK];
+}
+#endif
+
+void recorder_write(recordType type, const uint8_t *payload, uint8_t length)
+{
+#ifdef CONFIG_RECORDER_ENABLE
+	uint8_t header[RECORD_HEADER_LENGTH];
+	uint32_t time = (uint32_t)esp_timer_get_time();
+	
+	if (length > RECORD_PAYLOAD_MAX)
+	{
+		return;
+	}
+	
+	header[0] = type;
+	header[1] = length;
+	header[2] = time >> 24;
+	header[3] = time >> 16;
+	header[4] = time >> 8;
+	header[5] = time;
+	
+	// A few dozen bytes at most, short enough to do with interrupts off
+	taskENTER_CRITICAL();
+	// Oldest whole records make room for the new one
+	while ((head - tail) + RECORD_HEADER_LENGTH + length > RECORDER_RING_SIZE)
+	{
+		tail += ring_record_length(tail);
+	}
+	ring_copy_in(head, header, RECORD_HEADER_LENGTH);
+	ring_copy_in(head + RECORD_HEADER_LENGTH, payload, length);
+	head += RECORD_HEADER_LENGTH + length;
+	taskEXIT_CRITICAL();
+#endif
+}
+
+void recorder_clear()
+{
+	taskENTER_CRITICAL();
+	tail = head;
+	taskEXIT_CRITICAL();
+	recorder_write(RECORD_MARK, NULL, 0);
+}
+
+void recorder_cursor_init(recordCursor *cursor)
+{
+	taskENTER_CRITICAL();
+	cursor->position = tail;
+	cursor->lost = 0;
+	taskEXIT_CRITICAL();
+}
+
+size_t recorder_read(recordCursor *cursor, uint8_t *buf, size_t size)
+{
+	size_t length = 0;
+	
+#ifdef CONFIG_RECORDER_ENABLE
+	bool more = true;
+	
+	// One record per critical section, as short as a write, so a whole chunk
+	// never holds interrupts off long enough to jitter the PWM
+	while (more)
+	{
+		taskENTER_CRITICAL();
+		// Writers went past this reader, carry on from the oldest record left
+		if ((int32_t)(cursor->position - tail) < 0)
+		{
+			cursor->lost += tail - cursor->position;
+			cursor->position = tail;
+		}
+		
+		uint32_t record = ring_record_length(cursor->position);
+		more = (cursor->position != head) && (length + record <= size);
+		if (more)
+		{
+			ring_copy_out(cursor->position, &buf[length], record);
+			cursor->position += record;
+			length += record;
+		}
+		taskEXIT_CRITICAL();
+	}
+#endif
+	return length;
+}
+
+#ifdef CONFIG_RECORDER_SPIFFS_FLUSH
+static FILE *recorder_file_open()
+{
+	FILE *file = fopen(RECORDER_FILE, "a");
+	
+	if (file == NULL)
+	{
+		ESP_LOGE(TAG, "Failed to open %s", RECORDER_FILE);
+	}
+	return file;
+}
+
+static void recorder_flush(void *argument)
+{
+	static uint8_t buf[RECORDER_FLUSH_LENGTH];
+	recordCursor cursor;
+	uint32_t lost = 0;
+	size_t length;
+	
+	boot_wait(BOOT_PHASE_STORAGE_READY, portMAX_DELAY);
+	
+	recorder_cursor_init(&cursor);
+	for (;;)
+	{
+		vTaskDelay(CONFIG_RECORDER_FLUSH_PERIOD_S * 1000 / portTICK_PERIOD_MS);
+		
+		FILE *file = recorder_file_open();
+		if (file == NULL)
+		{
+			continue;
+		}
+		
+		while ((length = recorder_read(&cursor, buf, sizeof(buf))) > 0)
+		{
+			if (fwrite(buf, 1, length, file) != length)
+			{
+				ESP_LOGE(TAG, "Failed to write %s", RECORDER_FILE);
+				break;
+			}
+			
+			// Keep the previous file when starting a new one
+			if (ftell(file) >= CONFIG_RECORDER_FILE_SIZE)
+			{
+				fclose(file);
+				remove(RECORDER_FILE_OLD);
+				rename(RECORDER_FILE, RECORDER_FILE_OLD);
+				file = recorder_file_open();
+				if (file == NULL)
+				{
+					break;
+				}
+			}
+		}
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+		
+		if (cursor.lost != lost)
+		{
+			ESP_LOGW(TAG, "%u bytes overwritten before they were flushed", cursor.lost - lost);
+			lost = cursor.lost;
+		}
+	}
+}
+#endif
+
+void recorder_init()
+{
+	recorder_write(RECORD_MARK, NULL, 0);
+	
+#ifdef CONFIG_RECORDER_SPIFFS_FLUSH
+	xTaskCreate(recorder_flush, "recorder_flush", TASK_STACK_RECORDER, NULL, TASK_PRIORITY_MONITOR, NULL);
+#endif
+}
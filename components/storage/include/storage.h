@@ -0,0 +1,8 @@
+#pragma once
+
+/* SPIFFS "storage" partition, see partitions.csv. It is mounted in the
+   background, wait for BOOT_PHASE_STORAGE_READY before using files. */
+#define STORAGE_BASE_PATH		"/spiffs"
+#define STORAGE_MAX_FILES		4		/* open at the same time */
+
+void storage_init();
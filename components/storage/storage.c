@@ -0,0 +1,49 @@
+/* Flash file storage
+
+   Mounting SPIFFS scans the partition, and formats it on first boot, so it
+   runs in its own boot task and nobody waits for it who doesn't need files.
+*/
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_spiffs.h"
+
+#include "storage.h"
+#include "boot.h"
+#include "sysmon.h"
+
+static const char *TAG = "storage";
+
+static void storage_init_task(void *argument)
+{
+	size_t total = 0, used = 0;
+	esp_vfs_spiffs_conf_t conf = {
+		.base_path = STORAGE_BASE_PATH,
+		.partition_label = NULL,
+		.max_files = STORAGE_MAX_FILES,
+		.format_if_mount_failed = true
+	};
+	esp_err_t ret = esp_vfs_spiffs_register(&conf);
+	
+	if (ret != ESP_OK)
+	{
+		ESP_LOGE(TAG, "Failed to mount SPIFFS (%s)", esp_err_to_name(ret));
+		vTaskDelete(NULL);
+		return;
+	}
+	
+	if (esp_spiffs_info(NULL, &total, &used) == ESP_OK)
+	{
+		ESP_LOGI(TAG, "SPIFFS mounted, %d of %d bytes used", used, total);
+	}
+	boot_mark(BOOT_PHASE_STORAGE_READY);
+	vTaskDelete(NULL);
+}
+
+void storage_init()
+{
+	xTaskCreate(storage_init_task, "storage_init", TASK_STACK_STORAGE_INIT, NULL, TASK_PRIORITY_BOOT, NULL);
+}
@@ -0,0 +1,4 @@
+#Created by VisualGDB. Right-click on the component in Solution Explorer to edit properties using convenient GUI.
+
+
+COMPONENT_SRCDIRS +=
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "lwip/opt.h"
+
+/* Task priorities, highest first. The WiFi driver, the event loop and the
+   TCP/IP thread keep their SDK priorities, all of which sit below
+   TASK_PRIORITY_ACTUATOR:
+   - actuator: commits PWM at its deadline, must never wait for networking
+   - control: low-latency command channels (UDP, raw TCP), short bursts only
+   - network: WebSocket listener and client connections, JSON and handshakes,
+     web app requests
+   - boot: NVS/WiFi init tasks, done within the first seconds
+   - monitor: reporting, runs on idle time */
+#define TASK_PRIORITY_ACTUATOR		(configMAX_PRIORITIES - 2)
+#define TASK_PRIORITY_CONTROL		7
+#define TASK_PRIORITY_NETWORK		6
+#define TASK_PRIORITY_BOOT			5
+#define TASK_PRIORITY_MONITOR		1
+
+/* Task stack sizes, check {"telemetry":"tasks"} before shrinking one */
+#define TASK_STACK_SERVO_CONTROL	2048
+#define TASK_STACK_UDP_SERVER		4096
+#define TASK_STACK_GROUP			4096
+#define TASK_STACK_TCP_SERVER		4096
+#define TASK_STACK_WS_SERVER		2048
+#define TASK_STACK_WS_CLIENT		(DEFAULT_THREAD_STACKSIZE * 2)
+#define TASK_STACK_HTTP_STATIC		3072
+#define TASK_STACK_WS_STATUS		2048
+#define TASK_STACK_NVS_INIT			2048
+#define TASK_STACK_STORAGE_INIT		2048
+#define TASK_STACK_WIFI_INIT		4096
+#define TASK_STACK_SYSMON			2048
+#define TASK_STACK_POWER			2048
+#define TASK_STACK_CALIBRATION		3072
+#define TASK_STACK_CALIBRATION_LOAD	2048
+#define TASK_STACK_RECORDER			3072
+
+#define SYSMON_QUEUE_NUM			4		/* queues whose depth is reported */
+
+void sysmon_init();
+/* Report the depth of a queue along with the task statistics */
+void sysmon_register_queue(const char *name, QueueHandle_t queue, UBaseType_t length);
+/* JSON report of tasks, queues and heap, returns its length or -1 if buf is too small.
+   CPU share is over the time since the previous report. */
+int sysmon_report(char *buf, size_t size);
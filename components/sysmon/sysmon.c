@@ -0,0 +1,219 @@
+/* System monitor
+
+   Task stack high-water marks, CPU share and queue depths, to size stacks
+   and check the priority scheme in sysmon.h against real data.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "sysmon.h"
+
+#define SYSMON_TASK_MAX				24		/**< \brief Tasks whose run time is remembered between reports*/
+#define SYSMON_REPORT_LENGTH		1536
+
+typedef struct sysmonQueue_t
+{
+	const char *name;
+	QueueHandle_t queue;
+	UBaseType_t length;
+} sysmonQueue;
+
+typedef struct sysmonRunTime_t
+{
+	TaskHandle_t handle;
+	UBaseType_t number;			/* tells a new task apart from a deleted one with the same handle */
+	uint32_t runTime;
+} sysmonRunTime;
+
+static const char *TAG = "sysmon";
+static sysmonQueue queues[SYSMON_QUEUE_NUM];
+static sysmonRunTime lastRunTime[SYSMON_TASK_MAX];
+static uint32_t lastTotalRunTime;
+static SemaphoreHandle_t reportMutex;
+
+void sysmon_register_queue(const char *name, QueueHandle_t queue, UBaseType_t length)
+{
+	for (int i = 0; i < SYSMON_QUEUE_NUM; i++)
+	{
+		if (queues[i].queue == NULL)
+		{
+			queues[i].name = name;
+			queues[i].queue = queue;
+			queues[i].length = length;
+			return;
+		}
+	}
+	ESP_LOGW(TAG, "No room to monitor queue %s", name);
+}
+
+#if (configUSE_TRACE_FACILITY == 1)
+static bool sysmon_run_time_matches(const sysmonRunTime *slot, const TaskStatus_t *task)
+{
+	return (slot->handle == task->xHandle) && (slot->number == task->xTaskNumber);
+}
+
+/* Frees the slots of tasks deleted since the previous report, client
+   connections and one-shot tasks come and go */
+static void sysmon_run_time_prune(const TaskStatus_t *tasks, UBaseType_t count)
+{
+	for (int i = 0; i < SYSMON_TASK_MAX; i++)
+	{
+		bool alive = false;
+		
+		for (UBaseType_t j = 0; (j < count) && !alive && (lastRunTime[i].handle != NULL); j++)
+		{
+			alive = sysmon_run_time_matches(&lastRunTime[i], &tasks[j]);
+		}
+		if (!alive)
+		{
+			lastRunTime[i].handle = NULL;
+		}
+	}
+}
+
+/* Run time of the task since the previous report, remembers the current one */
+static uint32_t sysmon_run_time_delta(const TaskStatus_t *task)
+{
+	sysmonRunTime *slot = NULL;
+	
+	for (int i = 0; i < SYSMON_TASK_MAX; i++)
+	{
+		if (sysmon_run_time_matches(&lastRunTime[i], task))
+		{
+			slot = &lastRunTime[i];
+			break;
+		}
+		if ((slot == NULL) && (lastRunTime[i].handle == NULL))
+		{
+			slot = &lastRunTime[i];
+		}
+	}
+	
+	if (slot == NULL)
+	{
+		return task->ulRunTimeCounter;
+	}
+	
+	uint32_t delta = sysmon_run_time_matches(slot, task) ? (task->ulRunTimeCounter - slot->runTime) : task->ulRunTimeCounter;
+	slot->handle = task->xHandle;
+	slot->number = task->xTaskNumber;
+	slot->runTime = task->ulRunTimeCounter;
+	return delta;
+}
+#endif
+
+int sysmon_report(char *buf, size_t size)
+{
+	int len = snprintf(buf, size, "{\"tasks\":[");
+	
+#if (configUSE_TRACE_FACILITY == 1)
+	UBaseType_t count = uxTaskGetNumberOfTasks();
+	TaskStatus_t *tasks = malloc(count * sizeof(TaskStatus_t));
+	uint32_t totalRunTime = 0;
+	
+	if (tasks == NULL)
+	{
+		return -1;
+	}
+	
+	// Reports from the console and the WebSocket share the previous run times
+	xSemaphoreTake(reportMutex, portMAX_DELAY);
+	count = uxTaskGetSystemState(tasks, count, &totalRunTime);
+	uint32_t totalDelta = totalRunTime - lastTotalRunTime;
+	lastTotalRunTime = totalRunTime;
+	sysmon_run_time_prune(tasks, count);
+	
+	for (UBaseType_t i = 0; (i < count) && (len < size); i++)
+	{
+		uint32_t delta = sysmon_run_time_delta(&tasks[i]);
+		int cpu = -1;
+		
+#if (configGENERATE_RUN_TIME_STATS == 1)
+		if (totalDelta > 0)
+		{
+			cpu = (int)(((uint64_t)delta * 100) / totalDelta);
+		}
+#endif
+		len += snprintf(buf + len,
+			size - len,
+			"%s{\"name\":\"%s\",\"prio\":%u,\"stack_free\":%u,\"cpu\":%d}",
+			(i == 0) ? "" : ",",
+			tasks[i].pcTaskName,
+			tasks[i].uxCurrentPriority,
+			tasks[i].usStackHighWaterMark * sizeof(StackType_t),
+			cpu);
+	}
+	xSemaphoreGive(reportMutex);
+	free(tasks);
+#endif
+	
+	if (len < size)
+	{
+		len += snprintf(buf + len, size - len, "],\"queues\":[");
+	}
+	
+	for (int i = 0; (i < SYSMON_QUEUE_NUM) && (queues[i].queue != NULL) && (len < size); i++)
+	{
+		len += snprintf(buf + len,
+			size - len,
+			"%s{\"name\":\"%s\",\"used\":%u,\"size\":%u}",
+			(i == 0) ? "" : ",",
+			queues[i].name,
+			uxQueueMessagesWaiting(queues[i].queue),
+			queues[i].length);
+	}
+	
+	if (len < size)
+	{
+		len += snprintf(buf + len,
+			size - len,
+			"],\"heap\":%u,\"heap_min\":%u}",
+			esp_get_free_heap_size(),
+			esp_get_minimum_free_heap_size());
+	}
+	
+	return (len < size) ? len : -1;
+}
+
+#if (CONFIG_SYSMON_CONSOLE_REPORT_S > 0)
+static void sysmon_console(void *argument)
+{
+	char *report = malloc(SYSMON_REPORT_LENGTH);
+	
+	if (report == NULL)
+	{
+		ESP_LOGE(TAG, "No memory for the console report");
+		vTaskDelete(NULL);
+		return;
+	}
+	
+	for (;;)
+	{
+		vTaskDelay(pdMS_TO_TICKS(CONFIG_SYSMON_CONSOLE_REPORT_S * 1000));
+		if (sysmon_report(report, SYSMON_REPORT_LENGTH) > 0)
+		{
+			ESP_LOGI(TAG, "%s", report);
+		}
+	}
+}
+
+#endif
+
+void sysmon_init()
+{
+	reportMutex = xSemaphoreCreateMutex();
+	
+#if (CONFIG_SYSMON_CONSOLE_REPORT_S > 0)
+	xTaskCreate(sysmon_console, "sysmon", TASK_STACK_SYSMON, NULL, TASK_PRIORITY_MONITOR, NULL);
+#endif
+}
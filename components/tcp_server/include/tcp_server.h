@@ -1,5 +1,17 @@
 #pragma once
 
+/* Command port message: 2 byte big-endian length of what follows,
+   1 byte message type, payload */
+#define TCP_MSG_LENGTH_SIZE		2
+#define TCP_MSG_TYPE_SIZE		1
 
+typedef enum {
+	TCP_MSG_JSON = 0x01,
+	/*!< JSON command, same as a WebSocket text frame*/
+	TCP_MSG_BINARY = 0x02,
+	/*!< Binary command, see COMMAND_BINARY_LENGTH*/
+	TCP_MSG_HEARTBEAT = 0x03,
+	/*!< No payload, keeps the safe-stop watchdog from tripping*/
+} TCP_MSG_TYPES;
 
-void tcp_server_init();
\ No newline at end of file
+void tcp_server_init();
@@ -1,19 +1,14 @@
-/* BSD Socket API Example
+/* Raw TCP command port
 
-   This example code is in the Public Domain (or CC0 licensed, at your option.)
-
-   Unless required by applicable law or agreed to in writing, this
-   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
-   CONDITIONS OF ANY KIND, either express or implied.
+   Length-prefixed command messages without WebSocket framing, for test rigs
+   and PC software. All clients are served from one task with non-blocking
+   sockets and select(), Nagle is disabled so every setpoint leaves at once.
 */
 #include <string.h>
 #include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
 #include "esp_system.h"
-#include "esp_wifi.h"
-#include "esp_event_loop.h"
 #include "esp_log.h"
 
 #include "lwip/err.h"
@@ -22,28 +17,174 @@
 #include <lwip/netdb.h>
 
 #include "tcp_server.h"
-/* The examples use simple WiFi configuration that you can set via
-   'make menuconfig'.
-   If you'd rather not, just change the below entries to strings with
-   the config you want - ie #define EXAMPLE_WIFI_SSID "mywifissid"
-*/
+#include "command.h"
+#include "boot.h"
+#include "sysmon.h"
 
 #define PORT CONFIG_SERVER_PORT
 
-const int IPV4_GOTIP_BIT = BIT0;
-#ifdef CONFIG_SERVER_IPV6
-const int IPV6_GOTIP_BIT = BIT1;
-#endif
+#define TCP_CLIENT_NUM				4
+#define TCP_MESSAGE_LENGTH			256		/**< \brief Maximum type + payload length*/
+#define TCP_KEEPALIVE_IDLE_S		5
+#define TCP_KEEPALIVE_INTERVAL_S	2
+#define TCP_KEEPALIVE_COUNT			3
+
+typedef struct tcpClient_t
+{
+	int sock;
+	commandClient client;
+	uint16_t rxLength;
+	uint8_t rx[TCP_MSG_LENGTH_SIZE + TCP_MESSAGE_LENGTH];
+} tcpClient;
 
 static const char *TAG = "tcp_server";
+static tcpClient clients[TCP_CLIENT_NUM];
+
+static void tcp_dispatch(tcpClient *client, uint8_t *msg, uint16_t length)
+{
+	command cmd;
+	bool valid = false;
+	
+	switch (msg[0])
+	{
+	case TCP_MSG_JSON:
+		{
+			// Payload is not null-terminated, copy it out of the receive buffer
+			char json[TCP_MESSAGE_LENGTH];
+			memcpy(json, &msg[TCP_MSG_TYPE_SIZE], length - TCP_MSG_TYPE_SIZE);
+			json[length - TCP_MSG_TYPE_SIZE] = 0;
+			
+			cJSON *root = cJSON_Parse(json);
+			command_handle_json(&client->client, root);
+			cJSON_Delete(root);
+		}
+		break;
+	case TCP_MSG_BINARY:
+		valid = command_parse_binary(&msg[TCP_MSG_TYPE_SIZE], length - TCP_MSG_TYPE_SIZE, &cmd);
+		break;
+	case TCP_MSG_HEARTBEAT:
+		command_heartbeat(&client->client);
+		break;
+	default:
+		ESP_LOGW(TAG, "Unknown message type %d", msg[0]);
+		break;
+	}
+	
+	if (valid)
+	{
+		command_handle(&client->client, &cmd);
+	}
+}
+
+static void tcp_client_close(tcpClient *client)
+{
+	ESP_LOGI(TAG, "Connection %d closed", client->sock);
+	command_client_close(&client->client);
+	shutdown(client->sock, 0);
+	close(client->sock);
+	client->sock = -1;
+	client->rxLength = 0;
+}
+
+static void tcp_client_receive(tcpClient *client)
+{
+	int len = recv(client->sock, &client->rx[client->rxLength], sizeof(client->rx) - client->rxLength, 0);
+	
+	if (len < 0)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		ESP_LOGE(TAG, "recv failed: errno %d", errno);
+		tcp_client_close(client);
+		return;
+	}
+	else if (len == 0)
+	{
+		tcp_client_close(client);
+		return;
+	}
+	client->rxLength += len;
+	
+	// Dispatch every complete message, keep a partial one for the next recv
+	uint16_t offset = 0;
+	while ((client->rxLength - offset) >= TCP_MSG_LENGTH_SIZE)
+	{
+		uint16_t msgLength = ((uint16_t)client->rx[offset] << 8) | client->rx[offset + 1];
+		
+		if ((msgLength < TCP_MSG_TYPE_SIZE) || (msgLength > TCP_MESSAGE_LENGTH))
+		{
+			ESP_LOGW(TAG, "Invalid message length %d", msgLength);
+			tcp_client_close(client);
+			return;
+		}
+		
+		if ((client->rxLength - offset) < (TCP_MSG_LENGTH_SIZE + msgLength))
+		{
+			break;
+		}
+		
+		tcp_dispatch(client, &client->rx[offset + TCP_MSG_LENGTH_SIZE], msgLength);
+		offset += TCP_MSG_LENGTH_SIZE + msgLength;
+	}
+	
+	client->rxLength -= offset;
+	memmove(client->rx, &client->rx[offset], client->rxLength);
+}
+
+static void tcp_client_accept(int listen_sock)
+{
+	struct sockaddr_storage sourceAddr; // Large enough for both IPv4 or IPv6
+	socklen_t addrLen = sizeof(sourceAddr);
+	int opt;
+	
+	int sock = accept(listen_sock, (struct sockaddr *)&sourceAddr, &addrLen);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+		return;
+	}
+	
+	for (int i = 0; i < TCP_CLIENT_NUM; i++)
+	{
+		if (clients[i].sock < 0)
+		{
+			fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+			opt = 1;
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+			setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+			opt = TCP_KEEPALIVE_IDLE_S;
+			setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+			opt = TCP_KEEPALIVE_INTERVAL_S;
+			setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
+			opt = TCP_KEEPALIVE_COUNT;
+			setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+			
+			clients[i].sock = sock;
+			clients[i].rxLength = 0;
+			command_client_init(&clients[i].client);
+			ESP_LOGI(TAG, "Socket %d accepted", sock);
+			return;
+		}
+	}
+	
+	ESP_LOGW(TAG, "No free client slot, connection refused");
+	close(sock);
+}
 
 static void tcp_server_task(void *pvParameters)
 {
-	char rx_buffer[128];
 	char addr_str[128];
 	int addr_family;
 	int ip_protocol;
 
+	for (int i = 0; i < TCP_CLIENT_NUM; i++)
+	{
+		clients[i].sock = -1;
+	}
+	
+	boot_wait(BOOT_PHASE_NETIF_READY, portMAX_DELAY);
+	
 #ifdef CONFIG_IPV4
 	struct sockaddr_in destAddr;
 	destAddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -65,86 +206,67 @@ static void tcp_server_task(void *pvParameters)
 	int listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
 	if (listen_sock < 0) {
 		ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-		//break;
+		vTaskDelete(NULL);
+		return;
 	}
-	ESP_LOGI(TAG, "Socket created");
 
 	int err = bind(listen_sock, (struct sockaddr *)&destAddr, sizeof(destAddr));
 	if (err != 0) {
 		ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
-		//break;
+		close(listen_sock);
+		vTaskDelete(NULL);
+		return;
 	}
-	ESP_LOGI(TAG, "Socket binded to port %d", PORT);
+	
+	err = listen(listen_sock, TCP_CLIENT_NUM);
+	if (err != 0) {
+		ESP_LOGE(TAG, "Error occured during listen: errno %d", errno);
+		close(listen_sock);
+		vTaskDelete(NULL);
+		return;
+	}
+	ESP_LOGI(TAG, "Command port listening on port %d", PORT);
 	
 	while (1) {
-		err = listen(listen_sock, 1);
-		if (err != 0) {
-			ESP_LOGE(TAG, "Error occured during listen: errno %d", errno);
-			break;
+		fd_set readSet;
+		int maxFd = listen_sock;
+		
+		FD_ZERO(&readSet);
+		FD_SET(listen_sock, &readSet);
+		for (int i = 0; i < TCP_CLIENT_NUM; i++)
+		{
+			if (clients[i].sock >= 0)
+			{
+				FD_SET(clients[i].sock, &readSet);
+				maxFd = MAX(maxFd, clients[i].sock);
+			}
 		}
-		ESP_LOGI(TAG, "Socket listening to port %d", PORT);
-
-#ifdef CONFIG_IPV6
-		struct sockaddr_in6 sourceAddr; // Large enough for both IPv4 or IPv6
-#else
-		        struct sockaddr_in sourceAddr;
-#endif
-		uint addrLen = sizeof(sourceAddr);
-		int sock = accept(listen_sock, (struct sockaddr *)&sourceAddr, &addrLen);
-		if (sock < 0) {
-			ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-			break;
+		
+		if (select(maxFd + 1, &readSet, NULL, NULL, NULL) < 0) {
+			ESP_LOGE(TAG, "select failed: errno %d", errno);
+			vTaskDelay(pdMS_TO_TICKS(100));
+			continue;
 		}
-		ESP_LOGI(TAG, "Socket accepted");
-
-		while (1) {
-			int len = recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-			// Error occured during receiving
-			if(len < 0) {
-				ESP_LOGE(TAG, "recv failed: errno %d", errno);
-				break;
-			}
-			// Connection closed
-			else if(len == 0) {
-				ESP_LOGI(TAG, "Connection closed");
-				break;
-			}
-			// Data received
-			else {
-#ifdef CONFIG_IPV6
-				// Get the sender's ip address as string
-				if(sourceAddr.sin6_family == PF_INET) {
-					inet_ntoa_r(((struct sockaddr_in *)&sourceAddr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-				} else if(sourceAddr.sin6_family == PF_INET6) {
-					inet6_ntoa_r(sourceAddr.sin6_addr, addr_str, sizeof(addr_str) - 1);
-				}
-#else
-				inet_ntoa_r(((struct sockaddr_in *)&sourceAddr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-#endif
-
-				rx_buffer[len] = 0;  // Null-terminate whatever we received and treat like a string
-				ESP_LOGI(TAG, "Received %d bytes from %s:", len, addr_str);
-				ESP_LOGI(TAG, "%s", rx_buffer);
-
-				int err = send(sock, rx_buffer, len, 0);
-				if (err < 0) {
-					ESP_LOGE(TAG, "Error occured during sending: errno %d", errno);
-					break;
-				}
-			}
+		
+		if (FD_ISSET(listen_sock, &readSet)) {
+			tcp_client_accept(listen_sock);
 		}
-
-		if (sock != -1) {
-			ESP_LOGE(TAG, "Shutting down socket and restarting...");
-			shutdown(sock, 0);
-			close(sock);
+		
+		for (int i = 0; i < TCP_CLIENT_NUM; i++)
+		{
+			if ((clients[i].sock >= 0) && FD_ISSET(clients[i].sock, &readSet))
+			{
+				tcp_client_receive(&clients[i]);
+			}
 		}
 	}
+	
+	close(listen_sock);
 	vTaskDelete(NULL);
 }
 
 
 void tcp_server_init()
 {
-	xTaskCreate(tcp_server_task, "tcp_server", 4096, NULL, 5, NULL);
-}
\ No newline at end of file
+	xTaskCreate(tcp_server_task, "tcp_server", TASK_STACK_TCP_SERVER, NULL, TASK_PRIORITY_CONTROL, NULL);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+/* UDP control datagram: 4 byte big-endian sequence number followed by
+   the same JSON command object the WebSocket accepts */
+#define UDP_SEQ_LENGTH		4
+
+void udp_server_init();
@@ -0,0 +1,167 @@
+/* UDP control channel
+
+   Low-latency alternative to the WebSocket for setpoints. Every datagram is
+   self-contained and carries a sequence number per sender; anything not newer
+   than the last applied datagram of that sender is dropped, so a lost packet
+   costs one setpoint instead of stalling the ones behind it.
+*/
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+
+#include "udp_server.h"
+#include "command.h"
+#include "boot.h"
+#include "sysmon.h"
+
+#define PORT				CONFIG_UDP_CONTROL_PORT
+#define UDP_PACKET_LENGTH	256
+#define UDP_PEER_NUM		4		/**< \brief Senders tracked at the same time*/
+#define UDP_PEER_TIMEOUT_MS	2000	/**< \brief Silent sender forgets its sequence, allows client restart*/
+
+typedef struct udpPeer_t
+{
+	uint32_t addr;
+	uint16_t port;
+	uint32_t seq;
+	TickType_t lastTick;
+	bool used;
+	commandClient client;
+} udpPeer;
+
+static const char *TAG = "udp_server";
+static udpPeer peers[UDP_PEER_NUM];
+
+static bool udp_peer_expired(const udpPeer *peer, TickType_t now)
+{
+	return !peer->used || ((now - peer->lastTick) > pdMS_TO_TICKS(UDP_PEER_TIMEOUT_MS));
+}
+
+/* Slot of the sender, NULL if every slot is taken. A sender back after a silence
+   keeps its slot and control, it only starts a new sequence. A new sender takes
+   a free or expired slot, never the controlling one: the dead-man watchdog trips
+   on a silent controller, a stray datagram must not. */
+static udpPeer *udp_peer_find(const struct sockaddr_in *sourceAddr, TickType_t now)
+{
+	udpPeer *oldest = NULL;
+	
+	for (int i = 0; i < UDP_PEER_NUM; i++)
+	{
+		if (peers[i].used &&
+			(peers[i].addr == sourceAddr->sin_addr.s_addr) &&
+			(peers[i].port == sourceAddr->sin_port))
+		{
+			if (udp_peer_expired(&peers[i], now))
+			{
+				peers[i].used = false;
+			}
+			return &peers[i];
+		}
+		
+		if (udp_peer_expired(&peers[i], now) && !command_is_controller(&peers[i].client) &&
+			((oldest == NULL) || !peers[i].used || ((now - peers[i].lastTick) > (now - oldest->lastTick))))
+		{
+			oldest = &peers[i];
+		}
+	}
+	
+	if (oldest == NULL)
+	{
+		return NULL;
+	}
+	if (oldest->used)
+	{
+		command_client_close(&oldest->client);
+	}
+	oldest->addr = sourceAddr->sin_addr.s_addr;
+	oldest->port = sourceAddr->sin_port;
+	oldest->used = false;
+	return oldest;
+}
+
+static void udp_server_task(void *pvParameters)
+{
+	uint8_t rx_buffer[UDP_PACKET_LENGTH];
+	struct sockaddr_in destAddr, sourceAddr;
+	socklen_t addrLen;
+	uint32_t dropped = 0;
+
+	boot_wait(BOOT_PHASE_NETIF_READY, portMAX_DELAY);
+	
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+		vTaskDelete(NULL);
+		return;
+	}
+	
+	destAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	destAddr.sin_family = AF_INET;
+	destAddr.sin_port = htons(PORT);
+	if (bind(sock, (struct sockaddr *)&destAddr, sizeof(destAddr)) != 0) {
+		ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+		close(sock);
+		vTaskDelete(NULL);
+		return;
+	}
+	ESP_LOGI(TAG, "UDP control channel listening on port %d", PORT);
+	
+	while (1) {
+		addrLen = sizeof(sourceAddr);
+		// Leave room to null-terminate the JSON part
+		int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&sourceAddr, &addrLen);
+		if (len < 0) {
+			ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+			continue;
+		}
+		
+		if (len <= UDP_SEQ_LENGTH) {
+			continue;
+		}
+		
+		uint32_t seq = ((uint32_t)rx_buffer[0] << 24) |
+					   ((uint32_t)rx_buffer[1] << 16) |
+					   ((uint32_t)rx_buffer[2] << 8) |
+					   (uint32_t)rx_buffer[3];
+		TickType_t now = xTaskGetTickCount();
+		udpPeer *peer = udp_peer_find(&sourceAddr, now);
+		
+		if (peer == NULL) {
+			dropped++;
+			ESP_LOGD(TAG, "No slot for a new sender, %u dropped so far", dropped);
+			continue;
+		}
+		
+		// Serial number arithmetic, survives the sequence wrapping around
+		if (peer->used && ((int32_t)(seq - peer->seq) <= 0)) {
+			dropped++;
+			ESP_LOGD(TAG, "Dropped stale datagram %u, last %u, %u dropped so far", seq, peer->seq, dropped);
+			continue;
+		}
+		
+		if (!peer->used) {
+			command_client_init(&peer->client);
+		}
+		peer->seq = seq;
+		peer->lastTick = now;
+		peer->used = true;
+		
+		rx_buffer[len] = 0;
+		cJSON *root = cJSON_Parse((char*)&rx_buffer[UDP_SEQ_LENGTH]);
+		command_handle_json(&peer->client, root);
+		cJSON_Delete(root);
+	}
+	
+	close(sock);
+	vTaskDelete(NULL);
+}
+
+void udp_server_init()
+{
+	xTaskCreate(udp_server_task, "udp_server", TASK_STACK_UDP_SERVER, NULL, TASK_PRIORITY_CONTROL, NULL);
+}
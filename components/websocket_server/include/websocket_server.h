@@ -31,8 +31,25 @@
 #ifndef	_WEBSOCKET_TASK_H_
 #define _WEBSOCKET_TASK_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "lwip/api.h"
 
+#define WS_HEADER_LENGTH	2
+#define WS_MASK_LENGTH		4
+#define WS_STD_LEN			125		/**< \brief Maximum Length of standard length frames*/
+#define WS_EXT16_LENGTH		2		/**< \brief Extended 16 bit payload length*/
+#define WS_EXT16_CODE		126
+#define WS_EXT64_LENGTH		8		/**< \brief Extended 64 bit payload length*/
+#define WS_EXT64_CODE		127
+#define WS_HEADER_MAX_LENGTH	(WS_HEADER_LENGTH + WS_EXT64_LENGTH + WS_MASK_LENGTH)
+#define WS_PAYLOAD_MAX		4096	/**< \brief Largest client frame payload, longer frames close the connection*/
+#define WS_ACCEPT_LENGTH	29		/**< \brief Base64 of the SHA1 result, null terminated*/
+
+/** \brief Handshake request header carrying the client key*/
+extern const char WS_sec_WS_keys[];
+
 typedef enum {
 	WStype_ERROR,
 	WStype_DISCONNECTED,
@@ -84,12 +101,34 @@ typedef struct
 /**
  * \brief Send data to the websocket client
  *
- * \return 	#ERR_VAL: 	Payload length exceeded 2^7 bytes.
- * 			#ERR_CONN:	There is no open connection
- * 			#ERR_OK:	Header and payload send
- * 			all other values: derived from #netconn_write (sending frame header or payload)
+ * \return 	Payload bytes sent, the count returned by send()
+ * 			-1:	No open connection, payload length exceeded 2^16 - 1 bytes or send() failed
+ */
+int websocket_write(int conn, WS_OPCODES opcode, char* p_data, size_t length);
+
+/**
+ * \brief Length of a frame header from its first two bytes, extended payload length and mask key included
+ */
+size_t ws_header_length(const uint8_t *data);
+
+/**
+ * \brief Decode a client frame header of #ws_header_length bytes
+ *
+ * \return false if the frame is unmasked, a malformed control frame or too long to accept
+ */
+bool ws_parse_header(const uint8_t *data, size_t length, WS_frame_full_t *frame);
+
+/**
+ * \brief Unmask a client frame payload in place
+ */
+void ws_unmask(char *payload, size_t length, const char *mask_key);
+
+/**
+ * \brief Sec-WebSocket-Accept value for a handshake request, null terminated
+ *
+ * \return false if the request has no well-formed Sec-WebSocket-Key or accept is too small
  */
-err_t websocket_write(int conn, WS_OPCODES opcode, char* p_data, size_t length);
+bool ws_handshake_accept(const char *request, char *accept, size_t size);
 
 /**
  * \brief WebSocket Server task
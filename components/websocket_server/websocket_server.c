@@ -1,90 +1,622 @@
 /* Websocket server
 */
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_heap_caps.h"
-#include "mbedtls/base64.h"
-#include "mbedtls/sha1.h"
 #include "lwip/sockets.h"
 
+#include "esp_timer.h"
+
 #include "cJSON.h"
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
 #include "websocket_server.h"
 #include "Servo.h"
+#include "boot.h"
+#include "command.h"
+#include "sysmon.h"
+#include "recorder.h"
+#include "deflate.h"
+#include "http_static.h"
+#include "power.h"
+#include "calibration.h"
 
 #define PORT CONFIG_SERVER_PORT
-#define TASK_NORMAL_PRIORITY  (configMAX_PRIORITIES / 2)
 
 #define WS_PORT				8080	/**< \brief TCP Port for the Server*/
-#define WS_CLIENT_KEY_L		24		/**< \brief Length of the Client Key*/
-#define SHA1_RES_L			20		/**< \brief SHA1 result*/
-#define WS_STD_LEN			125		/**< \brief Maximum Length of standard length frames*/
 #define WS_SPRINTF_ARG_L	4		/**< \brief Length of sprintf argument for string (%.*s)*/
-#define WS_PACKET_LENGTH	2048
-#define WS_HEADER_LENGTH	2
-#define WS_MASK_LENGTH		4
+#define WS_CLIENT_NUM		4		/**< \brief Clients connected at the same time*/
+#define WS_STATUS_PERIOD_MS	100		/**< \brief Actuator changes within this period go out in one status message*/
+#define WS_STATUS_LENGTH	192		/**< \brief Buffer for a status message, all events and fields*/
+#define WS_RECORD_CHUNK		1024	/**< \brief Most capture bytes per binary frame*/
+#define WS_REPORT_LENGTH	1536	/**< \brief Buffer for reports sent in one frame*/
+#define WS_RSV1				0x4		/**< \brief RSV1 in the header's reserved bits, set on compressed messages*/
+#define WS_DEFLATE_MIN_LENGTH	256	/**< \brief Smaller messages go out uncompressed, deflating them costs more than it saves*/
+#define WS_INFLATE_LENGTH	4096	/**< \brief Largest compressed message we accept, inflated*/
+#define WS_REQUEST_TIMEOUT_MS	2000	/**< \brief Longest wait for the request of a new connection*/
+#define WS_SEND_TIMEOUT_MS	2000	/**< \brief Longest a send may block before the peer counts as gone*/
+#define WS_EXTENSIONS_LENGTH	160	/**< \brief Longest Sec-WebSocket-Extensions value looked at*/
+#define WS_REQUEST_LENGTH	1024	/**< \brief Buffer for the request head of a new connection*/
+#define WS_RESPONSE_LENGTH	256		/**< \brief Handshake response, with the deflate parameters*/
+#define WS_HTTP_NUM			2		/**< \brief Web app requests served next to a full set of clients*/
+#define WS_CONNECTION_NUM	(WS_CLIENT_NUM + WS_HTTP_NUM)	/**< \brief Connection tasks at the same time*/
+#define WS_DEFLATE_RESPONSE	"Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; " \
+							"client_no_context_takeover; server_max_window_bits=10\r\n"
 
-const char WS_sec_WS_keys[] = "Sec-WebSocket-Key:";
-const char WS_sec_conKey[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 const char WS_srv_hs[] = "HTTP/1.1 101 Switching Protocols \r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %.*s\r\n\r\n";
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
 static const char *TAG = "websocket_server";
-char guid_str[] = { "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" };
-unsigned char hash[20] = { 0 };
-char str_buf[1000] = { '\0' };
-char str_key[512] = { };
-char str_out[32] = { };
-char str_buf2[256] = { };
-extern QueueHandle_t servoFeederQueue;
 /* USER CODE END PV */
 
+/** \brief State of one WebSocket connection*/
+typedef struct wsClient_t
+{
+	int sock;
+	bool deflate;				/* permessage-deflate negotiated */
+	commandClient command;
+} wsClient;
+
+/** \brief New connection and the request head read from it*/
+typedef struct wsRequest_t
+{
+	int sock;
+	char head[WS_REQUEST_LENGTH];
+} wsRequest;
+
+/* Connected clients with a write lock per socket. A frame goes out as header
+   and payload in two sends, the lock keeps the client's own replies and the
+   status broadcast from interleaving. Only the client's own task registers
+   and unregisters it. */
+typedef struct wsSlot_t
+{
+	int sock;					/* -1 while free */
+	bool stale;					/* missed a status delta, the next broadcast is the full status */
+	SemaphoreHandle_t lock;
+} wsSlot;
+
+static wsSlot slots[WS_CLIENT_NUM];
+/* One per connection task, the listener waits for one before it hands a connection on */
+static SemaphoreHandle_t connectionTokens;
+/* Status the next delta starts from, only the status task writes it. Copied
+   and updated in critical sections, the generation counts the updates. */
+static servoStatus statusLast;
+static uint32_t statusGeneration;
+
+static const char *const servoEventName[SERVO_EVENT_NUM] = { "setpoint", "step", "ramp", "trip", "stopped", "armed", "idle" };
+
+static int websocket_write_frame(int conn, WS_OPCODES opcode, bool compressed, const char* p_data, size_t length);
+static size_t ws_encode_header(uint8_t *header, WS_OPCODES opcode, bool compressed, size_t length);
+static int ws_status_frame(uint8_t *buf, uint8_t **start, EventBits_t events, const servoStatus *now, const servoStatus *last);
+
+static wsSlot *ws_slot_find(int sock)
+{
+	for (int i = 0; i < WS_CLIENT_NUM; i++)
+	{
+		if (slots[i].sock == sock)
+		{
+			return &slots[i];
+		}
+	}
+	return NULL;
+}
+
+/* Connection tasks register at the same time, a slot is checked free under its lock */
+static bool ws_slot_register(int sock)
+{
+	for (int i = 0; i < WS_CLIENT_NUM; i++)
+	{
+		wsSlot *slot = &slots[i];
+		bool free;
+		
+		xSemaphoreTake(slot->lock, portMAX_DELAY);
+		free = (slot->sock < 0);
+		if (free)
+		{
+			slot->sock = sock;
+			// No delta before a full status, from the client's task or a broadcast
+			slot->stale = true;
+		}
+		xSemaphoreGive(slot->lock);
+		if (free)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void ws_slot_unregister(int sock)
+{
+	wsSlot *slot = ws_slot_find(sock);
+	
+	if (slot != NULL)
+	{
+		xSemaphoreTake(slot->lock, portMAX_DELAY);
+		slot->sock = -1;
+		xSemaphoreGive(slot->lock);
+	}
+}
+
+/* Bulk transfers (reports, capture downloads) are deflated when the client negotiated it.
+   Control and telemetry frames never are, they stay small and go out without the extra work. */
+static int websocket_write_bulk(const wsClient *client, WS_OPCODES opcode, char* p_data, size_t length)
+{
+	if (client->deflate && (length >= WS_DEFLATE_MIN_LENGTH))
+	{
+		uint8_t *compressed = malloc(length);
+		
+		if (compressed != NULL)
+		{
+			// Sent as is unless it actually got smaller
+			size_t compressed_length = deflate_compress((uint8_t*)p_data, length, compressed, length - 1);
+			if (compressed_length > 0)
+			{
+				int result = websocket_write_frame(client->sock, opcode, true, (char*)compressed, compressed_length);
+				free(compressed);
+				return result;
+			}
+			free(compressed);
+		}
+	}
+	return websocket_write(client->sock, opcode, p_data, length);
+}
+
+/* Telemetry functions*/
+static void send_ws_telemetry_boot(int conn)
+{
+	// One entry per boot phase, outgrows a standard length frame
+	char str_telemetry[2 * WS_STD_LEN];
+	int len = snprintf(str_telemetry, sizeof(str_telemetry), "{\"boot\":{");
+	
+	for (bootPhase phase = 0; phase < BOOT_PHASE_NUM; phase++)
+	{
+		// Milliseconds since power-on, -1 for phases not reached yet
+		int64_t time_us = boot_phase_us(phase);
+		len += snprintf(str_telemetry + len,
+			sizeof(str_telemetry) - len,
+			"%s\"%s\":%d",
+			(phase == 0) ? "" : ",",
+			boot_phase_name(phase),
+			(time_us < 0) ? -1 : (int32_t)(time_us / 1000));
+		if (len >= sizeof(str_telemetry))
+		{
+			ESP_LOGW(TAG, "Boot telemetry truncated");
+			return;
+		}
+	}
+	len += snprintf(str_telemetry + len, sizeof(str_telemetry) - len, "}}");
+	if (len >= sizeof(str_telemetry))
+	{
+		ESP_LOGW(TAG, "Boot telemetry truncated");
+		return;
+	}
+	
+	websocket_write(conn, WS_OP_TXT, str_telemetry, len);
+}
+
+static void send_ws_telemetry_sync(int conn, const commandClient *client)
+{
+	char str_telemetry[WS_STD_LEN + 1];
+	int len = snprintf(str_telemetry,
+		sizeof(str_telemetry),
+		"{\"sync\":{\"valid\":%d,\"offset\":%d,\"drift\":%d,\"rtt\":%u,\"samples\":%u,\"rejected\":%u}}",
+		clock_sync_valid(&client->sync),
+		(int32_t)(client->sync.offset / 1000),
+		client->sync.drift,
+		client->sync.rtt,
+		client->sync.samples,
+		client->sync.rejected);
+	
+	if (len < sizeof(str_telemetry))
+	{
+		websocket_write(conn, WS_OP_TXT, str_telemetry, len);
+	}
+}
+
+static void send_ws_telemetry_commands(int conn, const commandClient *client)
+{
+	char str_telemetry[WS_STD_LEN + 1];
+	servoStats servo;
+	
+	servo_get_stats(&servo);
+	int len = snprintf(str_telemetry,
+		sizeof(str_telemetry),
+		"{\"commands\":{\"accepted\":%u,\"rejected\":%u,\"dropped\":%u,\"coalesced\":%u,\"overflow\":%u}}",
+		client->accepted,
+		client->rejected,
+		client->dropped,
+		servo.coalesced,
+		servo.dropped);
+	
+	if (len < sizeof(str_telemetry))
+	{
+		websocket_write(conn, WS_OP_TXT, str_telemetry, len);
+	}
+}
+
+static void send_ws_telemetry_safety(int conn)
+{
+	char str_telemetry[WS_STD_LEN + 1];
+	servoStats servo;
+	
+	servo_get_stats(&servo);
+	int len = snprintf(str_telemetry,
+		sizeof(str_telemetry),
+		"{\"safety\":{\"trips\":%u,\"reason\":\"%s\",\"idle_ms\":%d,\"timeout_ms\":%d}}",
+		servo.trips,
+		servo_trip_name(servo.lastTrip),
+		servo_idle_ms(),
+		SERVO_WATCHDOG_TIMEOUT_MS);
+	
+	if (len < sizeof(str_telemetry))
+	{
+		websocket_write(conn, WS_OP_TXT, str_telemetry, len);
+	}
+}
+
+/* Idle current is measured on the bench, this tells how much of the day is spent at it */
+static void send_ws_telemetry_power(int conn)
+{
+	// Long counters outgrow a standard length frame
+	char str_telemetry[2 * WS_STD_LEN];
+	powerStats power;
+	
+	power_get_stats(&power);
+	int len = snprintf(str_telemetry,
+		sizeof(str_telemetry),
+		"{\"power\":{\"state\":\"%s\",\"idle\":%u,\"idle_ms\":%u,\"active_ms\":%u,\"wake_us\":%u,\"wake_max_us\":%u}}",
+		(power.state == POWER_IDLE) ? "idle" : "active",
+		power.idleCount,
+		power.idleMs,
+		power.activeMs,
+		power.lastWakeUs,
+		power.maxWakeUs);
+	
+	if (len < sizeof(str_telemetry))
+	{
+		websocket_write(conn, WS_OP_TXT, str_telemetry, len);
+	}
+}
+
+static void send_ws_telemetry_calibration(int conn)
+{
+	static const char *stateName[] = { "idle", "running", "done", "failed" };
+	char str_telemetry[WS_STD_LEN];
+	calibrationProgress calibration;
+	
+	calibration_get_progress(&calibration);
+	int len = snprintf(str_telemetry,
+		sizeof(str_telemetry),
+		"{\"calibration\":{\"state\":\"%s\",\"wheel\":%u,\"point\":%u,\"top_mm_s\":%u,\"stored\":%d}}",
+		stateName[calibration.state],
+		calibration.wheel,
+		calibration.point,
+		calibration.topSpeed,
+		calibration.stored);
+	
+	if (len < sizeof(str_telemetry))
+	{
+		websocket_write(conn, WS_OP_TXT, str_telemetry, len);
+	}
+}
+
+/* {"status":{"ev":[...],...}} with the events given and the fields that differ
+   from last, all fields without last. Returns the length, -1 if it doesn't fit. */
+static int ws_status_encode(char *out, size_t size, EventBits_t events, const servoStatus *now, const servoStatus *last)
+{
+	int len = snprintf(out, size, "{\"status\":{\"ev\":[");
+	bool first = true;
+	
+	for (int i = 0; i < SERVO_EVENT_NUM; i++)
+	{
+		if (events & (1 << i))
+		{
+			len += snprintf(out + len, size - len, "%s\"%s\"", first ? "" : ",", servoEventName[i]);
+			first = false;
+		}
+	}
+	len += snprintf(out + len, size - len, "]");
+	
+	if ((last == NULL) || (now->BPM != last->BPM))
+	{
+		len += snprintf(out + len, size - len, ",\"bpm\":%u", now->BPM);
+	}
+	if ((last == NULL) || (now->rampedBPM != last->rampedBPM))
+	{
+		len += snprintf(out + len, size - len, ",\"fed\":%u", now->rampedBPM);
+	}
+	if ((last == NULL) || (now->pending != last->pending))
+	{
+		len += snprintf(out + len, size - len, ",\"pending\":%u", now->pending);
+	}
+	if ((last == NULL) || (now->armed != last->armed))
+	{
+		len += snprintf(out + len, size - len, ",\"armed\":%d", now->armed);
+	}
+	if ((last == NULL) || (now->suspended != last->suspended))
+	{
+		len += snprintf(out + len, size - len, ",\"idle\":%d", now->suspended);
+	}
+	if ((last == NULL) || (now->tripped != last->tripped) || (now->lastTrip != last->lastTrip))
+	{
+		len += snprintf(out + len, size - len, ",\"tripped\":%d,\"trip\":\"%s\"", now->tripped, servo_trip_name(now->lastTrip));
+	}
+	len += snprintf(out + len, size - len, "}}");
+	
+	return (len < size) ? len : -1;
+}
+
+/* Full status, a client starts from it and applies the broadcast deltas. It is
+   the state the next delta starts from, sent under the client's write lock so
+   no delta overtakes it. If a broadcast came in between the client stays stale
+   and gets the full status from the status task. */
+static void send_ws_telemetry_status(int conn)
+{
+	uint8_t buf[WS_HEADER_LENGTH + WS_EXT16_LENGTH + WS_STATUS_LENGTH];
+	uint8_t *frame;
+	servoStatus status;
+	uint32_t generation;
+	wsSlot *slot = ws_slot_find(conn);
+	
+	if (slot == NULL)
+	{
+		return;
+	}
+	
+	xSemaphoreTake(slot->lock, portMAX_DELAY);
+	taskENTER_CRITICAL();
+	status = statusLast;
+	generation = statusGeneration;
+	taskEXIT_CRITICAL();
+	
+	int length = ws_status_frame(buf, &frame, 0, &status, NULL);
+	if ((length > 0) && (send(conn, frame, length, 0) == length))
+	{
+		taskENTER_CRITICAL();
+		slot->stale = (generation != statusGeneration);
+		taskEXIT_CRITICAL();
+	}
+	xSemaphoreGive(slot->lock);
+}
+
+static void send_ws_telemetry_tasks(const wsClient *client)
+{
+	char *report = malloc(WS_REPORT_LENGTH);
+	
+	if (report == NULL)
+	{
+		ESP_LOGW(TAG, "No memory for the task report");
+		return;
+	}
+	
+	int len = sysmon_report(report, WS_REPORT_LENGTH);
+	if (len > 0)
+	{
+		websocket_write_bulk(client, WS_OP_TXT, report, len);
+	}
+	free(report);
+}
+
+#ifdef CONFIG_RECORDER_ENABLE
+static void send_ws_record(const wsClient *client)
+{
+	char str_status[WS_STD_LEN + 1];
+	recordCursor cursor;
+	uint32_t sent = 0;
+	size_t len;
+	char *buf = malloc(WS_RECORD_CHUNK);
+	
+	if (buf == NULL)
+	{
+		ESP_LOGW(TAG, "No memory for the record download");
+		return;
+	}
+	
+	// Whole records per binary frame, stop after one ring's worth so a busy robot can't keep us here
+	recorder_cursor_init(&cursor);
+	while ((sent < CONFIG_RECORDER_BUFFER_SIZE) &&
+		((len = recorder_read(&cursor, (uint8_t*)buf, WS_RECORD_CHUNK)) > 0))
+	{
+		if (websocket_write_bulk(client, WS_OP_BIN, buf, len) < 0)
+		{
+			break;
+		}
+		sent += len;
+	}
+	free(buf);
+	
+	len = snprintf(str_status, sizeof(str_status), "{\"record\":{\"bytes\":%u,\"lost\":%u}}", sent, cursor.lost);
+	websocket_write(client->sock, WS_OP_TXT, str_status, len);
+}
+
+static void read_ws_record(const wsClient *client, const char *action)
+{
+	if (action == NULL)
+	{
+		return;
+	}
+	
+	if (strcmp(action, "download") == 0)
+	{
+		send_ws_record(client);
+	}
+	else if (strcmp(action, "clear") == 0)
+	{
+		recorder_clear();
+	}
+	else
+	{
+		ESP_LOGW(TAG, "Unknown record action %s", action);
+	}
+}
+#endif
+
+/* {"calibrate":"start"} sweeps the wheels, progress is in the "calibration" telemetry */
+static void read_ws_calibrate(const wsClient *client, const char *action)
+{
+	if (action == NULL)
+	{
+		return;
+	}
+	
+	if (strcmp(action, "start") == 0)
+	{
+		calibration_start(&client->command);
+		send_ws_telemetry_calibration(client->sock);
+	}
+	else
+	{
+		ESP_LOGW(TAG, "Unknown calibrate action %s", action);
+	}
+}
+
+static void send_ws_telemetry(const wsClient *client, const char* name)
+{
+	int conn = client->sock;
+	
+	if (name == NULL)
+	{
+		return;
+	}
+	
+	if (strcmp(name, "boot") == 0)
+	{
+		send_ws_telemetry_boot(conn);
+	}
+	else if (strcmp(name, "sync") == 0)
+	{
+		send_ws_telemetry_sync(conn, &client->command);
+	}
+	else if (strcmp(name, "commands") == 0)
+	{
+		send_ws_telemetry_commands(conn, &client->command);
+	}
+	else if (strcmp(name, "safety") == 0)
+	{
+		send_ws_telemetry_safety(conn);
+	}
+	else if (strcmp(name, "tasks") == 0)
+	{
+		send_ws_telemetry_tasks(client);
+	}
+	else if (strcmp(name, "status") == 0)
+	{
+		send_ws_telemetry_status(conn);
+	}
+	else if (strcmp(name, "power") == 0)
+	{
+		send_ws_telemetry_power(conn);
+	}
+	else if (strcmp(name, "calibration") == 0)
+	{
+		send_ws_telemetry_calibration(conn);
+	}
+	else
+	{
+		ESP_LOGW(TAG, "Unknown telemetry %s", name);
+	}
+}
+
+/* Clock sync, times are milliseconds on the wire:
+   {"sync":c0} is answered with {"sync":{"c0":c0,"r1":r1}} right away,
+   the client reports the finished exchange with {"synced":{"c0":c0,"r1":r1,"c3":c3}} */
+static void read_ws_sync(int conn, commandClient *client, const cJSON *root, int64_t received)
+{
+	cJSON *item = cJSON_GetObjectItem(root, "sync");
+	
+	if ((item != NULL) && cJSON_IsNumber(item))
+	{
+		cJSON *reply = cJSON_CreateObject();
+		cJSON *sync = cJSON_CreateObject();
+		cJSON_AddNumberToObject(sync, "c0", item->valuedouble);
+		cJSON_AddNumberToObject(sync, "r1", (double)received / 1000.0);
+		cJSON_AddItemToObject(reply, "sync", sync);
+		
+		char* stringSend = cJSON_PrintUnformatted(reply);
+		if (stringSend != NULL)
+		{
+			websocket_write(conn, WS_OP_TXT, stringSend, strlen(stringSend));
+			free(stringSend);
+		}
+		cJSON_Delete(reply);
+	}
+	
+	item = cJSON_GetObjectItem(root, "synced");
+	if (item != NULL)
+	{
+		int64_t c0, r1, c3;
+		
+		if (!command_json_time(item, "c0", &c0) ||
+			!command_json_time(item, "r1", &r1) ||
+			!command_json_time(item, "c3", &c3))
+		{
+			ESP_LOGW(TAG, "Incomplete sync exchange");
+			return;
+		}
+		
+		if (!clock_sync_sample(&client->sync, c0, r1, c3))
+		{
+			ESP_LOGD(TAG, "Sync exchange rejected");
+		}
+	}
+}
+
 /* Read functions*/
-void read_ws_text(int conn, char* data, uint64_t length)
+void read_ws_text(wsClient *client, char* data, uint64_t length)
 {
+	int conn = client->sock;
+	// Receive time of a sync request, taken before anything else delays it
+	int64_t received = esp_timer_get_time();
+	
 	ESP_LOGI(TAG, "Received TXT");
 	data[length] = '\0';
 
 	ESP_LOGI(TAG, "%s", data);
 	cJSON *root = cJSON_Parse(data);
 	
-	joystick ballSpin = { 0 };
-	coordinates boxPosition = { 0 };
+	if (root == NULL)
+	{
+		ESP_LOGW(TAG, "Invalid JSON");
+		return;
+	}
+	
+	if (cJSON_HasObjectItem(root, "telemetry") == true)
+	{
+		send_ws_telemetry(client, cJSON_GetObjectItem(root, "telemetry")->valuestring);
+	}
 	
-	if (cJSON_HasObjectItem(root, "BPM") == true)
+	if (cJSON_HasObjectItem(root, "sync") || cJSON_HasObjectItem(root, "synced"))
 	{
-		uint32_t BPM = cJSON_GetObjectItem(root, "BPM")->valueint;
-		xQueueSend(servoFeederQueue, &BPM, 0);
+		read_ws_sync(conn, &client->command, root, received);
 	}
 	
-	if (cJSON_HasObjectItem(root, "angle") == true)
+#ifdef CONFIG_RECORDER_ENABLE
+	if (cJSON_HasObjectItem(root, "record"))
 	{
-		ballSpin.angle = cJSON_GetObjectItem(root, "angle")->valuedouble;
-		ballSpin.distance = cJSON_GetObjectItem(root, "distance")->valuedouble;
-		//xQueueSend(servoFeederQueue, &ballSpin, 0);
+		read_ws_record(client, cJSON_GetObjectItem(root, "record")->valuestring);
 	}
+#endif
 	
-	if (cJSON_HasObjectItem(root, "x") == true)
+	if (cJSON_HasObjectItem(root, "calibrate"))
 	{
-		boxPosition.x = cJSON_GetObjectItem(root, "x")->valuedouble;
-		boxPosition.y = cJSON_GetObjectItem(root, "y")->valuedouble;
-		//xQueueSend(servoFeederQueue, &ballSpin, 0);
+		read_ws_calibrate(client, cJSON_GetObjectItem(root, "calibrate")->valuestring);
 	}
 	
+	command_handle_json(&client->command, root);
+	
 	cJSON_Delete(root);
 }
 
 void read_ws_binary(int conn, uint8_t* data, uint64_t length)
 {
-	ESP_LOGI(TAG, "Received BIN");
-	int i;
-	for (i = 0; i < length; i++)
-	{
-		if (i > 0) printf(":");
-		printf("%02X", data[i]);
-	}
-	printf("\n");
+	// Commands come as text on this transport, a binary frame is only noted
+	ESP_LOGD(TAG, "Received BIN, %u bytes", (unsigned)length);
 }
 
 void read_ws_ping(int conn, uint8_t* data, uint64_t length)
@@ -104,189 +636,516 @@ void read_ws_close(int conn, uint8_t* data, uint64_t length)
 }
 
 /*Write websocket message function*/
-err_t websocket_write(int conn, WS_OPCODES opcode, char* p_data, size_t length) 
+int websocket_write(int conn, WS_OPCODES opcode, char* p_data, size_t length) 
+{
+	return websocket_write_frame(conn, opcode, false, p_data, length);
+}
+
+static int websocket_write_frame(int conn, WS_OPCODES opcode, bool compressed, const char* p_data, size_t length)
 {
 	//check if we have an open connection
 	if(conn < 0)
-		return ERR_CONN;
+		return -1;
 
-	//currently only frames with a payload length <WS_STD_LEN are supported
-	if(length > WS_STD_LEN)
-		return ERR_VAL;
+	//frames up to a 16 bit extended payload length are supported
+	if(length > UINT16_MAX)
+		return -1;
 
-	//write result buffer
-	err_t result;
+	//byte count of send(), too wide for an err_t
+	int result;
+	uint8_t header[WS_HEADER_LENGTH + WS_EXT16_LENGTH];
+	size_t header_length = ws_encode_header(header, opcode, compressed, length);
+	wsSlot *slot = ws_slot_find(conn);
 
-	//prepare header
-	WS_frame_header_t hdr;
-	hdr.FIN = true;
-	hdr.payload_code = length;
-	hdr.mask = false;
-	hdr.reserved = 0;
-	hdr.opcode = opcode;
+	//header and payload go out back to back
+	if (slot != NULL)
+		xSemaphoreTake(slot->lock, portMAX_DELAY);
 
 	//send header
-	result = send(conn, &hdr, WS_HEADER_LENGTH, 0);
-	
-	//check if header was send
-	if(result == ESP_FAIL)
-		return result;
+	result = send(conn, header, header_length, 0);
 	
-	//send payload
-	result = send(conn, p_data, length, 0);
+	//send payload if the whole header was sent
+	if (result == (int)header_length)
+		result = send(conn, p_data, length, 0);
+	else
+		result = -1;
 	
-	//check if payload was send
-	if (result == ESP_FAIL)
-		return result;
+	if (slot != NULL)
+		xSemaphoreGive(slot->lock);
 	
 	return result;
 }
 
-static void  client_connection(void *argument)
+/* Server frame header, never masked, returns its length */
+static size_t ws_encode_header(uint8_t *header, WS_OPCODES opcode, bool compressed, size_t length)
 {
-	char data[WS_PACKET_LENGTH] = {};
-	int ret_r, accept_sock;
+	size_t header_length = WS_HEADER_LENGTH;
+	
+	WS_frame_header_t *hdr = (WS_frame_header_t*)header;
+	hdr->FIN = true;
+	hdr->payload_code = (length > WS_STD_LEN) ? WS_EXT16_CODE : length;
+	hdr->mask = false;
+	hdr->reserved = compressed ? WS_RSV1 : 0;
+	hdr->opcode = opcode;
+	
+	if (length > WS_STD_LEN)
+	{
+		header[WS_HEADER_LENGTH] = (uint8_t)(length >> 8);
+		header[WS_HEADER_LENGTH + 1] = (uint8_t)length;
+		header_length += WS_EXT16_LENGTH;
+	}
+	return header_length;
+}
 
-	WS_frame_full_t frame_full;
-	accept_sock = *(int*)argument;
+/* Status message with its header right in front, for one send per client.
+   Returns the frame length and where it starts in buf, -1 if it didn't fit. */
+static int ws_status_frame(uint8_t *buf, uint8_t **start, EventBits_t events, const servoStatus *now, const servoStatus *last)
+{
+	uint8_t header[WS_HEADER_LENGTH + WS_EXT16_LENGTH];
+	char *payload = (char*)&buf[sizeof(header)];
+	int length = ws_status_encode(payload, WS_STATUS_LENGTH, events, now, last);
+	
+	if (length < 0)
+	{
+		return -1;
+	}
+	size_t header_length = ws_encode_header(header, WS_OP_TXT, false, length);
+	*start = (uint8_t*)payload - header_length;
+	memcpy(*start, header, header_length);
+	return header_length + length;
+}
 
-	for (;;)
+/* Never blocks on a client. One whose lock is taken or whose send buffer is
+   full misses this delta and gets the full status next time. A frame that
+   went out in part can't be finished without blocking, that client is cut
+   off, its own task sees the connection fail and cleans up. */
+static void ws_status_send(wsSlot *slot, const uint8_t *delta, int deltaLength, const uint8_t *full, int fullLength)
+{
+	const uint8_t *frame = slot->stale ? full : delta;
+	int length = slot->stale ? fullLength : deltaLength;
+	
+	// No change this time, only the clients behind get anything
+	if (length == 0)
 	{
-		ret_r = recv(accept_sock, data, WS_HEADER_LENGTH, 0);
+		return;
+	}
+	if (length < 0)
+	{
+		slot->stale = true;
+		return;
+	}
+	
+	int sent = send(slot->sock, frame, length, MSG_DONTWAIT);
+	if (sent == length)
+	{
+		slot->stale = false;
+	}
+	else if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+	{
+		slot->stale = true;
+	}
+	else
+	{
+		ESP_LOGW(TAG, "Status to socket %d failed (%d of %d bytes), dropping the client", slot->sock, sent, length);
+		shutdown(slot->sock, SHUT_RDWR);
+	}
+}
 
-		if (ret_r < 0) 
+/* A client needs the full status */
+static bool ws_status_behind()
+{
+	for (int i = 0; i < WS_CLIENT_NUM; i++)
+	{
+		if ((slots[i].sock >= 0) && slots[i].stale)
 		{
-			ESP_LOGE(TAG, "recv failed: errno %d", errno);
-			break;
+			return true;
 		}
+	}
+	return false;
+}
+
+/* Status broadcaster: waits for actuator changes, lets the period's changes
+   coalesce, then encodes one delta frame and sends the same bytes to every client.
+   While a client is behind it also wakes every period to send it the full status. */
+static void ws_status_task(void *argument)
+{
+	static uint8_t deltaBuf[WS_HEADER_LENGTH + WS_EXT16_LENGTH + WS_STATUS_LENGTH];
+	static uint8_t fullBuf[WS_HEADER_LENGTH + WS_EXT16_LENGTH + WS_STATUS_LENGTH];
+	uint8_t *delta = NULL, *full = NULL;
+	servoStatus now;
+	
+	for (;;)
+	{
+		TickType_t wait = ws_status_behind() ? pdMS_TO_TICKS(WS_STATUS_PERIOD_MS) : portMAX_DELAY;
 		
-		// Connection closed
-		else if(ret_r == 0) 
+		if (xEventGroupWaitBits(servoEventGroup, SERVO_EVENT_ALL, pdFALSE, pdFALSE, wait) & SERVO_EVENT_ALL)
 		{
-			ESP_LOGI(TAG, "Connection closed");
-			close(accept_sock);
-			vTaskDelete(NULL);
-			break;
+			vTaskDelay(pdMS_TO_TICKS(WS_STATUS_PERIOD_MS));
 		}
 		
-		// Data received
-		if (ret_r > 0) 
-		{	
-			frame_full.frame_header = *(WS_frame_header_t*)&data;	
-			ESP_LOGI(TAG, "Websocket opcode = %d", frame_full.frame_header.opcode);
-			
-			if (frame_full.frame_header.payload_code <= 125)
-			{				
-				frame_full.payload_length = frame_full.frame_header.payload_code;
-			}
-			else if (frame_full.frame_header.payload_code == 126)
-			{
-				if (recv(accept_sock, data, 2, 0) <= 0)
-				{					
-					ESP_LOGW(TAG, "Failed to receive 2 bytes length");
-				}
-				frame_full.payload_length = ((uint32_t)(data[0] << 8) | (data[1]));	
-			}
-			else if (frame_full.frame_header.payload_code == 127)
+		EventBits_t events = xEventGroupClearBits(servoEventGroup, SERVO_EVENT_ALL) & SERVO_EVENT_ALL;
+		int deltaLength = 0;
+		int fullLength = -1;
+		
+		if (events != 0)
+		{
+			servo_get_status(&now);
+			deltaLength = ws_status_frame(deltaBuf, &delta, events, &now, &statusLast);
+			if (deltaLength < 0)
 			{
-				if (recv(accept_sock, data, 8, 0) <= 0)
-				{					
-					ESP_LOGW(TAG, "Failed to receive 8 bytes length");
-				}
-				frame_full.payload_length = (((uint64_t)data[0] << 56) & 0xFF) |
-											(((uint64_t)data[1] << 48) & 0xFF) |
-											(((uint64_t)data[2] << 40) & 0xFF) |
-											(((uint64_t)data[3] << 32) & 0xFF) |
-											(((uint64_t)data[4] << 24) & 0xFF) |
-											(((uint64_t)data[5] << 16) & 0xFF) |
-											(((uint64_t)data[6] << 8) & 0xFF) |
-											((uint64_t)data[7] & 0xFF);
+				ESP_LOGW(TAG, "Status message truncated");
 			}
-			else
+			// Before any client sees the delta, a full status read from here on
+			// is not older than it
+			taskENTER_CRITICAL();
+			statusLast = now;
+			statusGeneration++;
+			taskEXIT_CRITICAL();
+		}
+		
+		// The full status only if a client fell behind
+		if (ws_status_behind())
+		{
+			fullLength = ws_status_frame(fullBuf, &full, events, &statusLast, NULL);
+		}
+		
+		for (int i = 0; i < WS_CLIENT_NUM; i++)
+		{
+			// Taken while the client's own task writes, it catches up next time.
+			// Marked without the lock, at worst a new client gets one full status more.
+			if (xSemaphoreTake(slots[i].lock, 0) != pdTRUE)
 			{
-				ESP_LOGW(TAG,
-					"Wrong payload_length");	
+				slots[i].stale = slots[i].stale || (deltaLength != 0);
+				continue;
 			}
-			/* We only accept the incoming packet length that is smaller than the max_len (or it will overflow the buffer!) */
-//			if (frame->len > max_len) {
-//				ESP_LOGW(TAG, "WS Message too long");
-// 			}
-			
-			ESP_LOGI(TAG,
-				"Payload length %d",
-				(uint32_t)frame_full.payload_length);
-			
-			if ((frame_full.payload_length != 0))
+			if (slots[i].sock >= 0)
 			{
-				if (frame_full.frame_header.mask)
-				{
-					ret_r = recv(accept_sock, frame_full.mask_key, WS_MASK_LENGTH, 0);
-					if (ret_r)
-					{			
-						ESP_LOGI(TAG,
-							"Mask keys %d, %d, %d, %d",
-							frame_full.mask_key[0],
-							frame_full.mask_key[1],
-							frame_full.mask_key[2],
-							frame_full.mask_key[3]);
-					
-						frame_full.payload = heap_caps_malloc(frame_full.payload_length, MALLOC_CAP_8BIT);
-						ret_r = recv(accept_sock, frame_full.payload, frame_full.payload_length, 0);
-						if (ret_r)
-						{						
-							for (int i = 0; i < frame_full.payload_length; i++)
-							{
-								frame_full.payload[i] = frame_full.payload[i] ^ frame_full.mask_key[i % 4];
-							}
-						}
-					}
-				}
-				else
-				{
-					ret_r = recv(accept_sock, frame_full.payload, frame_full.payload_length, 0);
-				}				
+				ws_status_send(&slots[i], delta, deltaLength, full, fullLength);
 			}
+			xSemaphoreGive(slots[i].lock);
+		}
+	}
+}
+
+/* Swap a compressed message payload for its inflated form, false if it has to be dropped */
+static bool ws_inflate_payload(const wsClient *client, WS_frame_full_t *frame)
+{
+	if (!client->deflate ||
+		((frame->frame_header.opcode != WS_OP_TXT) && (frame->frame_header.opcode != WS_OP_BIN)))
+	{
+		ESP_LOGW(TAG, "Unexpected compressed frame");
+		return false;
+	}
+	
+	// One spare byte, text frames get a null terminator
+	char *inflated = heap_caps_malloc(WS_INFLATE_LENGTH + 1, MALLOC_CAP_8BIT);
+	if (inflated == NULL)
+	{
+		ESP_LOGW(TAG, "No memory to inflate a message");
+		return false;
+	}
+	
+	int length = deflate_inflate((uint8_t*)frame->payload, frame->payload_length, (uint8_t*)inflated, WS_INFLATE_LENGTH);
+	if (length < 0)
+	{
+		ESP_LOGW(TAG, "Invalid or too long compressed message");
+		heap_caps_free(inflated);
+		return false;
+	}
+	
+	heap_caps_free(frame->payload);
+	frame->payload = inflated;
+	frame->payload_length = length;
+	return true;
+}
+
+/* Bound blocking recv() and send() on sock, 0 waits forever */
+static void ws_socket_timeouts(int sock, uint32_t recvMs, uint32_t sendMs)
+{
+	struct timeval timeout;
+	
+	timeout.tv_sec = recvMs / 1000;
+	timeout.tv_usec = (recvMs % 1000) * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	timeout.tv_sec = sendMs / 1000;
+	timeout.tv_usec = (sendMs % 1000) * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/* TCP may split a frame anywhere, keep reading until all of it is in */
+static bool ws_recv_all(int sock, void *data, size_t length)
+{
+	uint8_t *pos = data;
+	
+	while (length > 0)
+	{
+		int ret = recv(sock, pos, length, 0);
+		if (ret < 0)
+		{
+			ESP_LOGE(TAG, "recv failed: errno %d", errno);
+			return false;
+		}
+		if (ret == 0)
+		{
+			return false;
+		}
+		pos += ret;
+		length -= ret;
+	}
+	return true;
+}
+
+static void  client_connection(void *argument)
+{
+	uint8_t header[WS_HEADER_MAX_LENGTH];
+	size_t header_length;
+	int accept_sock;
+	bool open = true;
+
+	WS_frame_full_t frame_full;
+	wsClient client = *(wsClient*)argument;
+	free(argument);
+	accept_sock = client.sock;
+	command_client_init(&client.command);
+	// Starting point for the status deltas
+	send_ws_telemetry_status(accept_sock);
+
+	while (open)
+	{
+		if (!ws_recv_all(accept_sock, header, WS_HEADER_LENGTH))
+		{
+			ESP_LOGI(TAG, "Connection closed");
+			break;
+		}
+		
+		header_length = ws_header_length(header);
+		if (!ws_recv_all(accept_sock, &header[WS_HEADER_LENGTH], header_length - WS_HEADER_LENGTH))
+		{
+			ESP_LOGI(TAG, "Connection closed");
+			break;
+		}
+		
+		if (!ws_parse_header(header, header_length, &frame_full))
+		{
+			ESP_LOGW(TAG, "Malformed, unmasked or too long frame");
+			break;
+		}
+		ESP_LOGI(TAG,
+			"Websocket opcode = %d, payload length %d",
+			frame_full.frame_header.opcode,
+			(uint32_t)frame_full.payload_length);
+		
+		// One spare byte, text frames get a null terminator
+		frame_full.payload = heap_caps_malloc(frame_full.payload_length + 1, MALLOC_CAP_8BIT);
+		if (frame_full.payload == NULL)
+		{
+			ESP_LOGW(TAG, "No memory for a %d byte frame", (uint32_t)frame_full.payload_length);
+			break;
+		}
+		
+		if (!ws_recv_all(accept_sock, frame_full.payload, frame_full.payload_length))
+		{
+			ESP_LOGI(TAG, "Connection closed");
+			heap_caps_free(frame_full.payload);
+			break;
+		}
+		ws_unmask(frame_full.payload, frame_full.payload_length, frame_full.mask_key);
+
+		if ((frame_full.frame_header.reserved & WS_RSV1) && !ws_inflate_payload(&client, &frame_full))
+		{
+			heap_caps_free(frame_full.payload);
+			continue;
+		}
+
+		switch (frame_full.frame_header.opcode) 
+		{
+		case WS_OP_TXT:
+			read_ws_text(&client, frame_full.payload, frame_full.payload_length);
+			break;
+		case WS_OP_BIN:	
+			read_ws_binary(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
+			break;
+		case WS_OP_CON:
+			//TODO processing of multi continuation frame
+			break;
+		case WS_OP_PIN:
+			read_ws_ping(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
+			break;
+		case WS_OP_PON:
+			read_ws_pong(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
+			break;
+		case WS_OP_CLS:
+			read_ws_close(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
+			ESP_LOGI(TAG, "Websocket closed by client");
+			open = false;
+			break;
+		default: break;
+		}
+		heap_caps_free(frame_full.payload);
+	}
+	
+	command_client_close(&client.command);
+	ws_slot_unregister(accept_sock);
+	close(accept_sock);
+	xSemaphoreGive(connectionTokens);
+	vTaskDelete(NULL);
+}
+#ifdef CONFIG_WS_PERMESSAGE_DEFLATE
+/* True if the handshake request offers permessage-deflate. Our parameters are
+   fixed, no context takeover either way, so the offer's parameters don't matter. */
+static bool ws_offers_deflate(const char *request)
+{
+	static const char name[] = "permessage-deflate";
+	char value[WS_EXTENSIONS_LENGTH];
+	const char *offer = value;
+	
+	if (!http_header_value(request, "Sec-WebSocket-Extensions", value, sizeof(value)))
+	{
+		return false;
+	}
+	
+	// Offers are separated by commas, each is its name then ";" and parameters
+	while (*offer != '\0')
+	{
+		offer += strspn(offer, " \t,");
+		size_t length = strcspn(offer, " \t;,");
+		
+		if ((length == sizeof(name) - 1) && (strncasecmp(offer, name, length) == 0))
+		{
+			return true;
+		}
+		offer += strcspn(offer, ",");
+	}
+	return false;
+}
+#endif
+
+/* Web app request, at its own stack size, the connection's token goes with it */
+static void http_connection(void *argument)
+{
+	wsRequest *request = argument;
+	
+	http_static_serve(request->sock, request->head);
+	close(request->sock);
+	free(request);
+	xSemaphoreGive(connectionTokens);
+	vTaskDelete(NULL);
+}
 
-			switch (frame_full.frame_header.opcode) 
+/* Upgrade to a WebSocket, returns the client state for its task, NULL if refused */
+static wsClient *ws_handshake(int sock, const char *request)
+{
+	char accept_key[WS_ACCEPT_LENGTH];
+	char response[WS_RESPONSE_LENGTH];
+	bool deflate = false;
+	
+	if (!ws_handshake_accept(request, accept_key, sizeof(accept_key)))
+	{
+		ESP_LOGW(TAG, "Malformed Sec-WebSocket-Key");
+		return NULL;
+	}
+#ifdef CONFIG_WS_PERMESSAGE_DEFLATE
+	deflate = ws_offers_deflate(request);
+#endif
+	
+	// The client task owns this from here on
+	wsClient *client = malloc(sizeof(wsClient));
+	if (client == NULL)
+	{
+		return NULL;
+	}
+	if (ws_slot_find(-1) == NULL)
+	{
+		ESP_LOGW(TAG, "Too many clients");
+		free(client);
+		return NULL;
+	}
+	client->sock = sock;
+	client->deflate = deflate;
+	
+	int length = snprintf(response, sizeof(response),
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"%s\r\n",
+		accept_key,
+		deflate ? WS_DEFLATE_RESPONSE : "");
+	// Frames may be far apart, writes to the client stay bounded
+	ws_socket_timeouts(sock, 0, WS_SEND_TIMEOUT_MS);
+	if ((length >= sizeof(response)) || (write(sock, response, length) != length))
+	{
+		free(client);
+		return NULL;
+	}
+	// Status broadcasts only after the handshake response
+	if (!ws_slot_register(sock))
+	{
+		ESP_LOGW(TAG, "Too many clients");
+		free(client);
+		return NULL;
+	}
+	return client;
+}
+
+/* Reads the request of a new connection. A WebSocket upgrade stays in this task
+   as the client's, anything else is a request for the web app. */
+static void ws_connection(void *argument)
+{
+	wsRequest *request = argument;
+	int sock = request->sock;
+	int ret = recv(sock, request->head, sizeof(request->head) - 1, 0);
+	
+	if (ret > 0)
+	{
+		request->head[ret] = '\0';
+		if ((ret >= 5) && (strncmp(request->head, "GET /", 5) == 0) && (strstr(request->head, WS_sec_WS_keys) != NULL))
+		{
+			ESP_LOGI(TAG, "Received WebSocket handshake request");
+			wsClient *client = ws_handshake(sock, request->head);
+			
+			free(request);
+			if (client != NULL)
 			{
-			case WS_OP_TXT:
-				read_ws_text(accept_sock, frame_full.payload, frame_full.payload_length);
-				break;
-			case WS_OP_BIN:	
-				read_ws_binary(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
-				break;
-			case WS_OP_CON:
-				//TODO processing of multi continuation frame
-				break;
-			case WS_OP_PIN:
-				read_ws_ping(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
-				break;
-			case WS_OP_PON:
-				read_ws_pong(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
-				break;
-			case WS_OP_CLS:
-				read_ws_close(accept_sock, (uint8_t*)frame_full.payload, frame_full.payload_length);
-				heap_caps_free(frame_full.payload);
-				ESP_LOGI(TAG, "Websocket closed by client");
-				close(accept_sock);
-				vTaskDelete(NULL);
-				break;
-			default: break;
+				// Never returns, the client task cleans up after itself
+				ESP_LOGI(TAG, "New client with connID = %d", sock);
+				client_connection(client);
 			}
-			heap_caps_free(frame_full.payload);
 		}
+		else if (xTaskCreate(http_connection, "http_static", TASK_STACK_HTTP_STATIC, request,
+			TASK_PRIORITY_NETWORK, NULL) == pdPASS)
+		{
+			vTaskDelete(NULL);
+		}
+		else
+		{
+			free(request);
+		}
+	}
+	else
+	{
+		// The client hung up or stayed silent
+		free(request);
 	}
+	close(sock);
+	xSemaphoreGive(connectionTokens);
+	vTaskDelete(NULL);
 }
+
 //---------------------------------------------------------------
+/* Listener, accept only: a slow or stalled peer holds up its own connection
+   task, never the next accept, a controller reconnecting after a safe stop
+   gets through. */
 static void tcp_thread(void *arg)
 {
-	int sock, accept_sock, ret;
+	int sock, accept_sock;
 	struct sockaddr_in address, remotehost;
 	socklen_t sockaddrsize;
-	int buflen = 1024;
-	char buf[1024] = { };
-	char *istr;
-	size_t len;
+	wsRequest *request;
+	
+	// Only the TCP/IP stack is needed to listen, WiFi may still be starting
+	boot_wait(BOOT_PHASE_NETIF_READY, portMAX_DELAY);
+	
 	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0)
 	{
 		address.sin_family = AF_INET;
@@ -296,74 +1155,49 @@ static void tcp_thread(void *arg)
 		{
 			listen(sock, 5);
 			ESP_LOGI(TAG, "WebSocket Server listening on port %d", WS_PORT);
+			boot_mark(BOOT_PHASE_SERVER_READY);
 			for (;;)
 			{
-				accept_sock = accept(sock, (struct sockaddr *)&remotehost, (socklen_t *)&sockaddrsize);
-				if (accept_sock >= 0)
+				sockaddrsize = sizeof(remotehost);
+				accept_sock = accept(sock, (struct sockaddr *)&remotehost, &sockaddrsize);
+				if (accept_sock < 0)
 				{
-					ESP_LOGI(TAG, "New connection accepted");
-
-					ret = recv(accept_sock, buf, buflen, 0);
-
-					if (ret > 0)
+					continue;
+				}
+				ESP_LOGI(TAG,
+					"New connection accepted, IP: %u.%u.%u.%u:%u",
+					(uint8_t)remotehost.sin_addr.s_addr,
+					(uint8_t)(remotehost.sin_addr.s_addr >> 8),
+					(uint8_t)(remotehost.sin_addr.s_addr >> 16),
+					(uint8_t)(remotehost.sin_addr.s_addr >> 24),
+					ntohs(remotehost.sin_port));
+				
+				// Connection tasks end within the socket timeouts, one frees up soon
+				if (xSemaphoreTake(connectionTokens, pdMS_TO_TICKS(WS_REQUEST_TIMEOUT_MS)) != pdTRUE)
+				{
+					ESP_LOGW(TAG, "Too many connections");
+					close(accept_sock);
+					continue;
+				}
+				// A silent or stalled peer only ever holds up its own task
+				ws_socket_timeouts(accept_sock, WS_REQUEST_TIMEOUT_MS, WS_SEND_TIMEOUT_MS);
+				
+				request = malloc(sizeof(wsRequest));
+				if (request != NULL)
+				{
+					request->sock = accept_sock;
+					if (xTaskCreate(ws_connection, "ws_connection", TASK_STACK_WS_CLIENT, request,
+						TASK_PRIORITY_NETWORK, NULL) == pdPASS)
 					{
-						if ((ret >= 5) && (strncmp(buf, "GET /", 5) == 0))
-						{
-							ESP_LOGI(TAG, "Received WebSocket handshake request");
-							istr = strstr(buf, "Sec-WebSocket-Key:");
-							istr[43] = 0;
-							strcpy(str_buf, "HTTP/1.1 101 Switching Protocols\r\n");
-							strcat(str_buf, "Upgrade: websocket\r\n");
-							strcat(str_buf, "Connection: Upgrade\r\n");
-							strcat(str_buf, "Sec-WebSocket-Accept: ");
-							sprintf(str_key, "%s%s", istr + 19, guid_str);
-							mbedtls_sha1((unsigned char *)str_key, 60, hash);
-							mbedtls_base64_encode((unsigned char *)str_buf2, 100, &len, hash, 20);
-							str_buf2[len] = 0;
-							strcat(str_buf, (char*)str_buf2);
-							strcat(str_buf, "\r\n\r\n");
-								
-							write(accept_sock, (const unsigned char*)(str_buf), strlen(str_buf));
-								
-							BaseType_t task_code = xTaskCreate(client_connection, 
-								"client_connection", 
-								DEFAULT_THREAD_STACKSIZE * 2,
-								(void*)&accept_sock,
-								TASK_NORMAL_PRIORITY, 
-								NULL);		
-							
-							/*xTaskCreate(sending_thread, 
-								"sending_thread", 
-								2048, 
-								(void*)&accept_sock, 
-								5, 
-								NULL);*/
-							
-							if (task_code == pdPASS)
-							{
-								ESP_LOGI(TAG,
-									"New client thread created with connID = %d, IP: %u.%u.%u.%u:%u", 
-									accept_sock,
-									(uint8_t)remotehost.sin_addr.s_addr, 
-									(uint8_t)(remotehost.sin_addr.s_addr >> 8), 
-									(uint8_t)(remotehost.sin_addr.s_addr >> 16),
-									(uint8_t)(remotehost.sin_addr.s_addr >> 24), 
-									(uint16_t)remotehost.sin_port);
-							}
-						}
+						continue;
 					}
-					else
-					{
-						close(accept_sock);
-						break;
-					}					
-				}				
+					free(request);
+				}
+				ESP_LOGW(TAG, "No memory for a new connection");
+				close(accept_sock);
+				xSemaphoreGive(connectionTokens);
 			}
-			close(sock);
-			vTaskDelete(NULL);
 		}
-		close(sock);
-		vTaskDelete(NULL);
 	}
 	close(sock);
 	vTaskDelete(NULL);
@@ -372,7 +1206,7 @@ static void tcp_thread(void *arg)
 static void sending_thread(void *argument)
 {	
 	int accept_sock = *(int*)argument;
-	err_t ret_w = 0;
+	int ret_w = 0;
 	cJSON *messageSend = cJSON_CreateObject();
 	cJSON_AddNumberToObject(messageSend, "PWM_Speed_1", 1234);
 	char* stringSend = NULL;
@@ -381,7 +1215,7 @@ static void sending_thread(void *argument)
 		stringSend = cJSON_PrintUnformatted(messageSend);
 		ESP_LOGI(TAG, "Server sending JSON length %d", strlen(stringSend));
 		ret_w = websocket_write(accept_sock, WS_OP_TXT, stringSend, strlen(stringSend));
-		if (ret_w == ESP_FAIL)
+		if (ret_w < 0)
 		{		
 			ESP_LOGI(TAG, "Sending thread terminated");
 			close(accept_sock);
@@ -394,5 +1228,15 @@ static void sending_thread(void *argument)
 
 void websocket_server_init()
 {
-	xTaskCreate(tcp_thread, "websocket_server", 4096, NULL, 5, NULL);
+	for (int i = 0; i < WS_CLIENT_NUM; i++)
+	{
+		slots[i].sock = -1;
+		slots[i].lock = xSemaphoreCreateMutex();
+	}
+	connectionTokens = xSemaphoreCreateCounting(WS_CONNECTION_NUM, WS_CONNECTION_NUM);
+	// Servo is up, the first clients start from its current status
+	servo_get_status(&statusLast);
+	
+	xTaskCreate(tcp_thread, "websocket_server", TASK_STACK_WS_SERVER, NULL, TASK_PRIORITY_NETWORK, NULL);
+	xTaskCreate(ws_status_task, "ws_status", TASK_STACK_WS_STATUS, NULL, TASK_PRIORITY_NETWORK, NULL);
 }
\ No newline at end of file
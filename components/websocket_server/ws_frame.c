@@ -0,0 +1,127 @@
+/* WebSocket frame and handshake parsing
+
+   Pure functions of their input, kept apart from the server so the host
+   harness in host/ builds them without the SDK.
+*/
+
+#include <string.h>
+
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+
+#include "websocket_server.h"
+
+#define WS_CLIENT_KEY_L		24		/**< \brief Length of the Client Key*/
+#define SHA1_RES_L			20		/**< \brief SHA1 result*/
+
+const char WS_sec_WS_keys[] = "Sec-WebSocket-Key:";
+const char WS_sec_conKey[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+size_t ws_header_length(const uint8_t *data)
+{
+	size_t length = WS_HEADER_LENGTH;
+	uint8_t payload_code = data[1] & 0x7F;
+	
+	if (payload_code == WS_EXT16_CODE)
+	{
+		length += WS_EXT16_LENGTH;
+	}
+	else if (payload_code == WS_EXT64_CODE)
+	{
+		length += WS_EXT64_LENGTH;
+	}
+	
+	if (data[1] & 0x80)
+	{
+		length += WS_MASK_LENGTH;
+	}
+	return length;
+}
+
+bool ws_parse_header(const uint8_t *data, size_t length, WS_frame_full_t *frame)
+{
+	size_t pos = WS_HEADER_LENGTH;
+	
+	if ((length < WS_HEADER_LENGTH) || (length != ws_header_length(data)))
+	{
+		return false;
+	}
+	
+	memset(frame, 0, sizeof(*frame));
+	frame->frame_header.FIN = (data[0] & 0x80) != 0;
+	frame->frame_header.reserved = (data[0] >> 4) & 0x07;
+	frame->frame_header.opcode = data[0] & 0x0F;
+	frame->frame_header.mask = (data[1] & 0x80) != 0;
+	frame->frame_header.payload_code = data[1] & 0x7F;
+	
+	if (frame->frame_header.payload_code == WS_EXT16_CODE)
+	{
+		frame->payload_length = ((uint64_t)data[pos] << 8) | data[pos + 1];
+		pos += WS_EXT16_LENGTH;
+	}
+	else if (frame->frame_header.payload_code == WS_EXT64_CODE)
+	{
+		for (int i = 0; i < WS_EXT64_LENGTH; i++)
+		{
+			frame->payload_length = (frame->payload_length << 8) | data[pos + i];
+		}
+		pos += WS_EXT64_LENGTH;
+	}
+	else
+	{
+		frame->payload_length = frame->frame_header.payload_code;
+	}
+	
+	// A client has to mask every frame it sends
+	if (!frame->frame_header.mask)
+	{
+		return false;
+	}
+	memcpy(frame->mask_key, &data[pos], WS_MASK_LENGTH);
+	
+	// Control frames are short and never fragmented
+	if ((frame->frame_header.opcode & 0x08) &&
+		(!frame->frame_header.FIN || (frame->payload_length > WS_STD_LEN)))
+	{
+		return false;
+	}
+	return frame->payload_length <= WS_PAYLOAD_MAX;
+}
+
+void ws_unmask(char *payload, size_t length, const char *mask_key)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		payload[i] ^= mask_key[i % WS_MASK_LENGTH];
+	}
+}
+
+bool ws_handshake_accept(const char *request, char *accept, size_t size)
+{
+	char key[WS_CLIENT_KEY_L + sizeof(WS_sec_conKey) - 1];
+	unsigned char sha1[SHA1_RES_L];
+	size_t length;
+	const char *start = strstr(request, WS_sec_WS_keys);
+	
+	if (start == NULL)
+	{
+		return false;
+	}
+	
+	start += strlen(WS_sec_WS_keys);
+	while ((*start == ' ') || (*start == '\t'))
+	{
+		start++;
+	}
+	
+	// 16 random bytes in base64, always 24 characters
+	if (strcspn(start, " \t\r\n") != WS_CLIENT_KEY_L)
+	{
+		return false;
+	}
+	
+	memcpy(key, start, WS_CLIENT_KEY_L);
+	memcpy(key + WS_CLIENT_KEY_L, WS_sec_conKey, sizeof(WS_sec_conKey) - 1);
+	mbedtls_sha1((unsigned char*)key, sizeof(key), sha1);
+	return mbedtls_base64_encode((unsigned char*)accept, size, &length, sha1, SHA1_RES_L) == 0;
+}
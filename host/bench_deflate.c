@@ -0,0 +1,279 @@
+/* permessage-deflate cost and gain per message
+
+   Builds the messages the robot sends over the WebSocket, the bulk ones
+   (task report, capture download chunk) and smaller ones below
+   WS_DEFLATE_MIN_LENGTH, and for each prints the bytes on air with and
+   without deflate and the CPU time to compress it and to inflate it again.
+   Bytes on air count the server's frame header and IPv4 and TCP headers
+   per segment, not the Wi-Fi framing. CPU times are host nanoseconds, they
+   compare messages with each other, the robot is a lot slower.
+
+   Every message is checked against zlib both ways first: our output through
+   zlib's inflate, and a client's zlib output, flushed and with its tail
+   stripped, through deflate_inflate().
+     bench_deflate [-runs=N] [-mss=bytes]
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "deflate.h"
+
+#define BENCH_MESSAGE_MAX		1536	/* WS_REPORT_LENGTH, the largest message sent */
+#define BENCH_CAPTURE_CHUNK		1024	/* WS_RECORD_CHUNK */
+#define BENCH_DEFLATE_MIN		256		/* WS_DEFLATE_MIN_LENGTH */
+#define BENCH_IP_TCP_HEADER		40		/* IPv4 and TCP without options, per segment */
+#define BENCH_MSS				1460	/* lwIP TCP_MSS of the SDK */
+
+typedef struct benchMessage_t
+{
+	const char *name;
+	uint8_t data[BENCH_MESSAGE_MAX];
+	size_t length;
+} benchMessage;
+
+static const char *const taskName[] = { "servo_control", "udp_server", "tcp_server", "websocket_server",
+	"ws_status", "group", "sysmon", "power", "recorder_flush", "tiT", "esp_event_loop", "ppT", "pmT",
+	"rtT", "IDLE", "Tmr Svc" };
+
+static size_t message_report(uint8_t *buf)
+{
+	char *text = (char *)buf;
+	int len = snprintf(text, BENCH_MESSAGE_MAX, "{\"tasks\":[");
+
+	for (size_t i = 0; i < sizeof(taskName) / sizeof(taskName[0]); i++)
+	{
+		len += snprintf(text + len, BENCH_MESSAGE_MAX - len,
+			"%s{\"name\":\"%s\",\"prio\":%u,\"stack_free\":%u,\"cpu\":%d}",
+			(i == 0) ? "" : ",", taskName[i], (unsigned)(14 - i % 10), (unsigned)(412 + i * 52), (int)(i * 7 % 23));
+	}
+	len += snprintf(text + len, BENCH_MESSAGE_MAX - len,
+		"],\"queues\":[{\"name\":\"servo\",\"used\":0,\"size\":16},{\"name\":\"status\",\"used\":1,\"size\":8}],"
+		"\"heap\":31264,\"heap_min\":27408}");
+	assert(len < BENCH_MESSAGE_MAX);
+	return len;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/* Records as the recorder writes them: a command every 20 ms, a PWM commit
+   of six channels every 5 ms with the wheels ramping */
+static size_t message_capture(uint8_t *buf)
+{
+	uint32_t time = 0x1234000;
+	size_t length = 0;
+
+	for (int step = 0; ; step++, time += 5000)
+	{
+		size_t record = ((step % 4) == 0) ? 19 : 18;
+
+		if (length + record > BENCH_CAPTURE_CHUNK)
+		{
+			break;
+		}
+		uint8_t *p = &buf[length];
+		if ((step % 4) == 0)
+		{
+			p[0] = 1;
+			p[1] = 13;
+			put_u32(&p[2], time);
+			p[6] = 0;
+			put_u32(&p[7], 30000 + (step % 3) * 17);
+			p[11] = 0x03;
+			p[12] = 0;
+			p[13] = 60;
+			p[14] = 0;
+			p[15] = (step * 3) % 90;
+			p[16] = 50;
+			p[17] = 40 + step % 5;
+			p[18] = 55;
+		}
+		else
+		{
+			p[0] = 2;
+			p[1] = 12;
+			put_u32(&p[2], time + 112);
+			for (int channel = 0; channel < 6; channel++)
+			{
+				uint16_t duty = (channel < 3) ? 1000 + step * 2 + channel * 40 : 1500 - channel * 3;
+				p[6 + channel * 2] = duty >> 8;
+				p[7 + channel * 2] = duty;
+			}
+		}
+		length += record;
+	}
+	return length;
+}
+
+static size_t message_boot(uint8_t *buf)
+{
+	return sprintf((char *)buf, "{\"boot\":{\"power_on\":0,\"nvs_ready\":41,\"storage_ready\":212,"
+		"\"wifi_started\":388,\"ap_started\":402,\"servers_up\":415,\"first_client\":5873,\"first_command\":6120}}");
+}
+
+static size_t message_status(uint8_t *buf)
+{
+	return sprintf((char *)buf, "{\"status\":{\"events\":[\"armed\"],\"BPM\":60,\"spin\":[312,-156,-156],"
+		"\"position\":[50,42],\"queue\":1}}");
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Frame from the server, unmasked */
+static size_t frame_length(size_t payload)
+{
+	return payload + ((payload < 126) ? 2 : 4);
+}
+
+static size_t on_air(size_t frame, size_t mss)
+{
+	return frame + ((frame + mss - 1) / mss) * BENCH_IP_TCP_HEADER;
+}
+
+/* Our compressor through zlib, and a zlib client's message through our inflater */
+static void check_zlib(const benchMessage *message)
+{
+	uint8_t compressed[BENCH_MESSAGE_MAX * 2];
+	uint8_t inflated[BENCH_MESSAGE_MAX];
+	z_stream stream;
+
+	size_t length = deflate_compress(message->data, message->length, compressed, sizeof(compressed));
+	assert(length > 0);
+	memset(&stream, 0, sizeof(stream));
+	assert(inflateInit2(&stream, -DEFLATE_WINDOW_BITS) == Z_OK);
+	stream.next_in = compressed;
+	stream.avail_in = length;
+	stream.next_out = inflated;
+	stream.avail_out = sizeof(inflated);
+	assert(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+	assert(stream.total_out == message->length);
+	assert(memcmp(inflated, message->data, message->length) == 0);
+	inflateEnd(&stream);
+
+	for (int windowBits = 9; windowBits <= 15; windowBits += 6)
+	{
+		memset(&stream, 0, sizeof(stream));
+		assert(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+		stream.next_in = (uint8_t *)message->data;
+		stream.avail_in = message->length;
+		stream.next_out = compressed;
+		stream.avail_out = sizeof(compressed);
+		assert(deflate(&stream, Z_SYNC_FLUSH) == Z_OK);
+		length = stream.total_out;
+		deflateEnd(&stream);
+		assert((length >= 4) && (memcmp(&compressed[length - 4], "\x00\x00\xff\xff", 4) == 0));
+
+		int inflatedLength = deflate_inflate(compressed, length - 4, inflated, sizeof(inflated));
+		assert(inflatedLength == (int)message->length);
+		assert(memcmp(inflated, message->data, message->length) == 0);
+	}
+}
+
+/* Size zlib's default level gets to with the same window, for reference */
+static size_t zlib_length(const benchMessage *message)
+{
+	uint8_t compressed[BENCH_MESSAGE_MAX * 2];
+	z_stream stream;
+
+	memset(&stream, 0, sizeof(stream));
+	assert(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -DEFLATE_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	stream.next_in = (uint8_t *)message->data;
+	stream.avail_in = message->length;
+	stream.next_out = compressed;
+	stream.avail_out = sizeof(compressed);
+	assert(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+	size_t length = stream.total_out;
+	deflateEnd(&stream);
+	return length;
+}
+
+int main(int argc, char **argv)
+{
+	static benchMessage messages[] = { { "report" }, { "capture" }, { "boot" }, { "status" } };
+	size_t (*const build[])(uint8_t *) = { message_report, message_capture, message_boot, message_status };
+	const int count = sizeof(messages) / sizeof(messages[0]);
+	size_t mss = BENCH_MSS;
+	long runs = 20000;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-runs=", 6) == 0)
+		{
+			runs = atol(&argv[i][6]);
+		}
+		else if (strncmp(argv[i], "-mss=", 5) == 0)
+		{
+			mss = atol(&argv[i][5]);
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-runs=N] [-mss=bytes]\n", argv[0]);
+			return 2;
+		}
+	}
+	if ((runs < 1) || (mss < 1))
+	{
+		return 2;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		messages[i].length = build[i](messages[i].data);
+		check_zlib(&messages[i]);
+	}
+
+	printf("bytes on air with a %zu byte MSS, host ns per message, %ld runs\n", mss, runs);
+	printf("%-8s %6s %7s | %6s %7s %6s | %8s %8s | %5s | %s\n", "message", "raw", "on air",
+		"defl", "on air", "saved", "compress", "inflate", "zlib", "sent");
+
+	for (int i = 0; i < count; i++)
+	{
+		const benchMessage *message = &messages[i];
+		uint8_t compressed[BENCH_MESSAGE_MAX * 2];
+		uint8_t inflated[BENCH_MESSAGE_MAX];
+		size_t length = 0;
+		int inflatedLength = 0;
+
+		int64_t start = now_ns();
+		for (long run = 0; run < runs; run++)
+		{
+			length = deflate_compress(message->data, message->length, compressed, sizeof(compressed));
+		}
+		int64_t compressNs = (now_ns() - start) / runs;
+
+		start = now_ns();
+		for (long run = 0; run < runs; run++)
+		{
+			inflatedLength = deflate_inflate(compressed, length, inflated, sizeof(inflated));
+		}
+		int64_t inflateNs = (now_ns() - start) / runs;
+		assert(inflatedLength == (int)message->length);
+
+		size_t rawAir = on_air(frame_length(message->length), mss);
+		size_t deflatedAir = on_air(frame_length(length), mss);
+
+		// What websocket_write_bulk() does with it
+		const char *sent = (message->length < BENCH_DEFLATE_MIN) ? "raw, short" :
+			((length < message->length) ? "deflated" : "raw, no gain");
+		printf("%-8s %6zu %7zu | %6zu %7zu %5.0f%% | %8lld %8lld | %5zu | %s\n", message->name,
+			message->length, rawAir, length, deflatedAir, 100.0 * ((double)rawAir - deflatedAir) / rawAir,
+			(long long)compressNs, (long long)inflateNs, zlib_length(message), sent);
+	}
+	return 0;
+}
@@ -0,0 +1,312 @@
+/* Wheel calibration fit and run control
+
+   Fits hand-made sweeps with calibration_fit(): identical wheels keep the
+   linear table, a faster wheel is slowed to the slowest one's top speed, a
+   dip in a reading is noise and does not make duties fall, and a wheel that
+   never moved fails the fit. Random sweeps check that fitted duties rise
+   and stay within the swept range.
+
+   A run with the sensor clear then checks the control rules: it is refused
+   to a client not in control, it stops feeding the watchdog and restores the
+   previous table once its client disconnects, and an immediate restart is
+   refused.
+     calibration_test [-runs=N]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "calibration.c"
+#include "host_robot.h"
+
+#define TEST_STOP_MS			1000	/* run gone after its client disconnected */
+
+static servoCalibration table;
+static int failures;
+
+#define TEST_CHECK(condition, ...) \
+	do { \
+		if (!(condition)) \
+		{ \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			failures++; \
+		} \
+	} while (0)
+
+/* Servo stand-ins: armed and never tripped, the table only kept */
+void servo_get_status(servoStatus *status)
+{
+	memset(status, 0, sizeof(*status));
+	status->armed = true;
+}
+
+static void table_linear(servoCalibration *linear)
+{
+	static const uint16_t minDuty[] = {
+#define SERVO_WHEEL_MIN(name, pin, reversePin, angle, min, max) min,
+		SERVO_WHEELS(SERVO_WHEEL_MIN)
+	};
+	static const uint16_t maxDuty[] = {
+#define SERVO_WHEEL_MAX(name, pin, reversePin, angle, min, max) max,
+		SERVO_WHEELS(SERVO_WHEEL_MAX)
+	};
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		for (int point = 0; point < SERVO_CALIB_POINTS; point++)
+		{
+			linear->duty[wheel][point] = minDuty[wheel] + (maxDuty[wheel] - minDuty[wheel]) * point / (SERVO_CALIB_POINTS - 1);
+		}
+	}
+}
+
+bool servo_set_calibration(const servoCalibration *calibration)
+{
+	taskENTER_CRITICAL();
+	if (calibration == NULL)
+	{
+		table_linear(&table);
+	}
+	else
+	{
+		table = *calibration;
+	}
+	taskEXIT_CRITICAL();
+	return true;
+}
+
+void servo_get_calibration(servoCalibration *calibration)
+{
+	taskENTER_CRITICAL();
+	*calibration = table;
+	taskEXIT_CRITICAL();
+}
+
+/* Light barrier with nothing in front of it */
+esp_err_t adc_read(uint16_t *data)
+{
+	*data = CONFIG_CALIB_ADC_THRESHOLD * 2;
+	return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle)
+{
+	return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *value, size_t *length)
+{
+	return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length)
+{
+	return ESP_FAIL;
+}
+
+esp_err_t nvs_commit(nvs_handle handle)
+{
+	return ESP_FAIL;
+}
+
+void nvs_close(nvs_handle handle)
+{
+}
+
+/* Exit speed of a wheel growing by step per point */
+static void sweep_linear(uint32_t curve[SERVO_CALIB_POINTS], uint32_t step)
+{
+	for (int point = 0; point < SERVO_CALIB_POINTS; point++)
+	{
+		curve[point] = point * step;
+	}
+}
+
+static void check_identical(const servoCalibration *linear)
+{
+	uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];
+	servoCalibration fitted;
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		sweep_linear(measured[wheel], 1000);
+	}
+	TEST_CHECK(calibration_fit(measured, linear, &fitted) == 8000, "identical wheels, top speed");
+	TEST_CHECK(memcmp(&fitted, linear, sizeof(fitted)) == 0, "identical wheels keep the linear table");
+}
+
+/* Wheel 0 twice as fast as the others, it reaches their top speed at half duty */
+static void check_faster(const servoCalibration *linear)
+{
+	uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];
+	servoCalibration fitted;
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		sweep_linear(measured[wheel], (wheel == 0) ? 2000 : 1000);
+	}
+	TEST_CHECK(calibration_fit(measured, linear, &fitted) == 8000, "faster wheel, top speed is the slower ones'");
+
+	for (int point = 0; point < SERVO_CALIB_POINTS; point++)
+	{
+		const uint16_t *duty = linear->duty[0];
+		uint16_t expected = (point % 2 == 0) ? duty[point / 2] : (duty[point / 2] + duty[point / 2 + 1]) / 2;
+
+		TEST_CHECK(fitted.duty[0][point] == expected, "faster wheel point %d: duty %u, expected %u",
+			point, fitted.duty[0][point], expected);
+		for (int wheel = 1; wheel < SERVO_WHEEL_NUM; wheel++)
+		{
+			TEST_CHECK(fitted.duty[wheel][point] == linear->duty[wheel][point], "slower wheel %d point %d changed", wheel, point);
+		}
+	}
+}
+
+/* A reading below the one before is raised to it, the fitted duties don't fall */
+static void check_dip(const servoCalibration *linear)
+{
+	uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];
+	servoCalibration fitted;
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		sweep_linear(measured[wheel], 1000);
+	}
+	measured[1][4] = 2500;
+	TEST_CHECK(calibration_fit(measured, linear, &fitted) == 8000, "dip, top speed");
+	TEST_CHECK(measured[1][4] == 3000, "dip raised to %u", measured[1][4]);
+	for (int point = 1; point < SERVO_CALIB_POINTS; point++)
+	{
+		TEST_CHECK(fitted.duty[1][point] >= fitted.duty[1][point - 1], "dip, duty falls at point %d", point);
+	}
+}
+
+static void check_still(const servoCalibration *linear)
+{
+	uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];
+	servoCalibration fitted;
+
+	for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+	{
+		sweep_linear(measured[wheel], (wheel == SERVO_WHEEL_NUM - 1) ? 0 : 1000);
+	}
+	TEST_CHECK(calibration_fit(measured, linear, &fitted) == 0, "a wheel that never moved fails the fit");
+}
+
+/* Noisy sweeps: duties rise, start at rest and stay within the swept duties */
+static void check_random(const servoCalibration *linear, long runs)
+{
+	uint32_t measured[SERVO_WHEEL_NUM][SERVO_CALIB_POINTS];
+	servoCalibration fitted;
+
+	srand(1);
+	for (long run = 0; run < runs; run++)
+	{
+		for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+		{
+			measured[wheel][0] = 0;
+			for (int point = 1; point < SERVO_CALIB_POINTS; point++)
+			{
+				measured[wheel][point] = (uint32_t)(point * (200 + rand() % 4000) + rand() % 3000);
+			}
+		}
+
+		uint32_t top = calibration_fit(measured, linear, &fitted);
+		TEST_CHECK(top != 0, "run %ld, no top speed", run);
+
+		for (int wheel = 0; wheel < SERVO_WHEEL_NUM; wheel++)
+		{
+			const uint16_t *duty = fitted.duty[wheel];
+
+			TEST_CHECK(duty[0] == linear->duty[wheel][0], "run %ld wheel %d, not at rest at point 0", run, wheel);
+			TEST_CHECK(duty[SERVO_CALIB_POINTS - 1] <= linear->duty[wheel][SERVO_CALIB_POINTS - 1],
+				"run %ld wheel %d, duty past full speed", run, wheel);
+			for (int point = 1; point < SERVO_CALIB_POINTS; point++)
+			{
+				TEST_CHECK(duty[point] >= duty[point - 1], "run %ld wheel %d, duty falls at point %d", run, wheel, point);
+			}
+		}
+	}
+}
+
+static calibrationState run_state(void)
+{
+	calibrationProgress state;
+
+	calibration_get_progress(&state);
+	return state.state;
+}
+
+static void check_control(const servoCalibration *linear)
+{
+	commandClient owner, other;
+	command cmd = { .fields = COMMAND_FIELD_BPM };
+	servoCalibration previous, restored;
+
+	command_client_init(&owner);
+	command_client_init(&other);
+	memcpy(&previous, linear, sizeof(previous));
+	previous.duty[0][1]++;
+	servo_set_calibration(&previous);
+
+	TEST_CHECK(!calibration_start(&owner), "started for a client not in control");
+	TEST_CHECK(command_handle(&other, &cmd) && command_is_controller(&other), "command not accepted");
+	TEST_CHECK(!calibration_start(&owner), "started for a client another one took control from");
+
+	TEST_CHECK(command_handle(&owner, &cmd) && command_is_controller(&owner), "command not accepted");
+	TEST_CHECK(calibration_start(&owner), "not started for the client in control");
+	TEST_CHECK(!calibration_start(&owner), "started twice");
+	usleep(CALIB_ALIVE_PERIOD_MS * 3 * 1000);
+	TEST_CHECK(run_state() == CALIB_RUNNING, "run ended before its client disconnected");
+
+	command_client_close(&owner);
+	int waited = 0;
+	while ((run_state() == CALIB_RUNNING) && (waited < TEST_STOP_MS))
+	{
+		usleep(10000);
+		waited += 10;
+	}
+	TEST_CHECK(run_state() == CALIB_FAILED, "run still going %d ms after its client disconnected", waited);
+
+	uint32_t alive = hostServoLog.alive;
+	usleep(CALIB_ALIVE_PERIOD_MS * 3 * 1000);
+	TEST_CHECK(hostServoLog.alive == alive, "watchdog still fed after the run ended");
+	servo_get_calibration(&restored);
+	TEST_CHECK(memcmp(&restored, &previous, sizeof(restored)) == 0, "previous table not restored");
+
+	TEST_CHECK(command_handle(&owner, &cmd), "command not accepted");
+	TEST_CHECK(!calibration_start(&owner), "restarted right after the last run ended");
+}
+
+int main(int argc, char **argv)
+{
+	servoCalibration linear;
+	long runs = 100000;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-runs=", 6) == 0)
+		{
+			runs = atol(&argv[i][6]);
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [-runs=N]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	table_linear(&linear);
+	check_identical(&linear);
+	check_faster(&linear);
+	check_dip(&linear);
+	check_still(&linear);
+	check_random(&linear, runs);
+	check_control(&linear);
+
+	printf("calibration: %ld random sweeps fitted, %d failures\n", runs, failures);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,416 @@
+/* Fuzz harness for the network-facing parsers
+
+   The first input byte picks the target, the rest is what a client sends:
+   0 WebSocket frame (header, then masked payload), 1 handshake request,
+   2 JSON command including the clock sync exchange, 3 binary command.
+   Besides the sanitizers each target checks properties of its output.
+
+   Built with -fsanitize=fuzzer this is a libFuzzer target. Otherwise the
+   main() below runs inputs from files or directories, can mutate them for
+   a fixed number of runs and can measure throughput against floors:
+     fuzz_parsers [-runs=N] [-seed=S] [-bench] [-min=MBps,MBps,MBps,MBps] corpus...
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "command.h"
+#include "clock_sync.h"
+#include "websocket_server.h"
+#include "host_robot.h"
+
+#define FUZZ_TARGET_NUM		4
+#define FUZZ_INPUT_MAX		(WS_HEADER_MAX_LENGTH + WS_PAYLOAD_MAX)
+
+static const char *const targetName[FUZZ_TARGET_NUM] = { "frame", "handshake", "command", "binary" };
+
+/* Same steps as client_connection(): header, then the payload it announces */
+static void fuzz_frame(const uint8_t *data, size_t size)
+{
+	WS_frame_full_t frame;
+
+	if (size < WS_HEADER_LENGTH)
+	{
+		return;
+	}
+
+	size_t header = ws_header_length(data);
+	assert(header <= WS_HEADER_MAX_LENGTH);
+	if ((size < header) || !ws_parse_header(data, header, &frame))
+	{
+		return;
+	}
+
+	// Accepted frames are masked, bounded and control frames short and final
+	assert(frame.frame_header.mask);
+	assert(frame.payload_length <= WS_PAYLOAD_MAX);
+	assert(!(frame.frame_header.opcode & 0x08) ||
+		(frame.frame_header.FIN && (frame.payload_length <= WS_STD_LEN)));
+
+	size_t length = frame.payload_length;
+	if (size - header < length)
+	{
+		return;
+	}
+
+	char *payload = malloc(length + 1);
+	char *copy = malloc(length + 1);
+	memcpy(payload, &data[header], length);
+	memcpy(copy, payload, length);
+	payload[length] = 0;
+
+	// Masking twice is the identity
+	ws_unmask(payload, length, frame.mask_key);
+	ws_unmask(payload, length, frame.mask_key);
+	assert(memcmp(payload, copy, length) == 0);
+
+	free(copy);
+	free(payload);
+}
+
+static void fuzz_handshake(const uint8_t *data, size_t size)
+{
+	char accept[WS_ACCEPT_LENGTH];
+	char *request = malloc(size + 1);
+
+	memcpy(request, data, size);
+	request[size] = 0;
+
+	if (ws_handshake_accept(request, accept, sizeof(accept)))
+	{
+		assert(strlen(accept) == WS_ACCEPT_LENGTH - 1);
+	}
+	// No room for the terminator is an error, never an overrun
+	assert(!ws_handshake_accept(request, accept, WS_ACCEPT_LENGTH - 1));
+	free(request);
+}
+
+static void fuzz_command_check(const command *cmd)
+{
+	assert(cmd->BPM <= UINT16_MAX);
+	if (cmd->fields & COMMAND_FIELD_SPIN)
+	{
+		assert(isfinite(cmd->spin.angle) && (fabsf(cmd->spin.angle) < 360.0f));
+		assert((cmd->spin.distance >= 0.0f) && (cmd->spin.distance <= 100.0f));
+	}
+}
+
+/* A JSON message as read_ws_text() handles it: sync exchange, then the command */
+static void fuzz_command(const uint8_t *data, size_t size)
+{
+	command cmds[COMMAND_BATCH_LENGTH];
+	commandClient client;
+	int64_t c0, r1, c3;
+	char *text = malloc(size + 1);
+
+	memcpy(text, data, size);
+	text[size] = 0;
+	cJSON *root = cJSON_Parse(text);
+	free(text);
+	if (root == NULL)
+	{
+		return;
+	}
+
+	host_servo_reset();
+	command_client_init(&client);
+
+	cJSON *synced = cJSON_GetObjectItem(root, "synced");
+	if ((synced != NULL) &&
+		command_json_time(synced, "c0", &c0) &&
+		command_json_time(synced, "r1", &r1) &&
+		command_json_time(synced, "c3", &c3))
+	{
+		// Enough exchanges to map "at" times, all from the fuzzed values
+		for (int i = 0; i < 4; i++)
+		{
+			clock_sync_sample(&client.sync, c0 + i, r1 + i, c3 + i);
+		}
+	}
+
+	if (command_parse_json(root, &cmds[0]))
+	{
+		fuzz_command_check(&cmds[0]);
+	}
+
+	int count = command_parse_batch(root, 0, cmds, COMMAND_BATCH_LENGTH);
+	assert(count <= COMMAND_BATCH_LENGTH);
+	for (int i = 0; i < count; i++)
+	{
+		fuzz_command_check(&cmds[i]);
+		assert((cmds[i].at >= 0) && (cmds[i].at <= 60000000));
+	}
+
+	command_handle_json(&client, root);
+	command_client_close(&client);
+	cJSON_Delete(root);
+}
+
+static void fuzz_binary(const uint8_t *data, size_t size)
+{
+	uint8_t encoded[COMMAND_BINARY_LENGTH];
+	command cmd, decoded;
+
+	if (!command_parse_binary(data, size, &cmd))
+	{
+		return;
+	}
+	assert(cmd.BPM <= UINT16_MAX);
+	assert((cmd.spin.distance >= 0.0f) && (cmd.spin.distance <= 100.0f));
+
+	// What the recorder stores decodes back to the same command
+	command_encode_binary(&cmd, encoded);
+	assert(command_parse_binary(encoded, sizeof(encoded), &decoded));
+	assert((decoded.fields == cmd.fields) && (decoded.BPM == cmd.BPM) &&
+		(decoded.spin.angle == cmd.spin.angle) && (decoded.spin.distance == cmd.spin.distance));
+
+	host_servo_reset();
+	command_apply(&cmd);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if ((size < 1) || (size > FUZZ_INPUT_MAX))
+	{
+		return 0;
+	}
+
+	switch (data[0] % FUZZ_TARGET_NUM)
+	{
+	case 0:
+		fuzz_frame(data + 1, size - 1);
+		break;
+	case 1:
+		fuzz_handshake(data + 1, size - 1);
+		break;
+	case 2:
+		fuzz_command(data + 1, size - 1);
+		break;
+	default:
+		fuzz_binary(data + 1, size - 1);
+		break;
+	}
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define FUZZ_CORPUS_MAX		256
+#define FUZZ_BENCH_NS		200000000LL	/* timed per target */
+
+typedef struct fuzzInput_t
+{
+	uint8_t *data;
+	size_t size;
+} fuzzInput;
+
+static fuzzInput corpus[FUZZ_CORPUS_MAX];
+static int corpusCount;
+
+static void corpus_add_file(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *data = malloc(FUZZ_INPUT_MAX);
+
+	if ((file == NULL) || (corpusCount == FUZZ_CORPUS_MAX))
+	{
+		fprintf(stderr, "Skipping %s\n", path);
+		free(data);
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+		return;
+	}
+	corpus[corpusCount].data = data;
+	corpus[corpusCount].size = fread(data, 1, FUZZ_INPUT_MAX, file);
+	corpusCount++;
+	fclose(file);
+}
+
+static void corpus_add(const char *path)
+{
+	struct stat info;
+	struct dirent *entry;
+	char name[1024];
+
+	if ((stat(path, &info) != 0) || !S_ISDIR(info.st_mode))
+	{
+		corpus_add_file(path);
+		return;
+	}
+
+	DIR *dir = opendir(path);
+	while ((dir != NULL) && ((entry = readdir(dir)) != NULL))
+	{
+		if (entry->d_name[0] != '.')
+		{
+			snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+			corpus_add(name);
+		}
+	}
+	if (dir != NULL)
+	{
+		closedir(dir);
+	}
+}
+
+/* Small structural edits keep most mutants close enough to valid to go deep */
+static size_t mutate(uint8_t *data, size_t size)
+{
+	int edits = 1 + rand() % 8;
+
+	for (int i = 0; i < edits; i++)
+	{
+		size_t at = 1 + ((size > 1) ? (size_t)rand() % (size - 1) : 0);
+
+		switch (rand() % 5)
+		{
+		case 0:
+			if (at < size)
+			{
+				data[at] ^= 1 << (rand() % 8);
+			}
+			break;
+		case 1:
+			if (at < size)
+			{
+				data[at] = (uint8_t)rand();
+			}
+			break;
+		case 2:
+			if (size < FUZZ_INPUT_MAX)
+			{
+				memmove(&data[at + 1], &data[at], size - at);
+				data[at] = "0123456789e-.{}[]\":,"[rand() % 20];
+				size++;
+			}
+			break;
+		case 3:
+			if (at < size)
+			{
+				memmove(&data[at], &data[at + 1], size - at - 1);
+				size--;
+			}
+			break;
+		default:
+			size = at;
+			break;
+		}
+	}
+	return size;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* MB/s per target over its corpus entries, below a floor is a regression */
+static int bench(const double *floor)
+{
+	int failed = 0;
+
+	for (int target = 0; target < FUZZ_TARGET_NUM; target++)
+	{
+		uint64_t bytes = 0;
+		int64_t start = now_ns();
+		int64_t elapsed = 0;
+
+		do
+		{
+			for (int i = 0; i < corpusCount; i++)
+			{
+				if ((corpus[i].size > 0) && ((corpus[i].data[0] % FUZZ_TARGET_NUM) == target))
+				{
+					LLVMFuzzerTestOneInput(corpus[i].data, corpus[i].size);
+					bytes += corpus[i].size;
+				}
+			}
+			elapsed = now_ns() - start;
+		} while ((bytes > 0) && (elapsed < FUZZ_BENCH_NS));
+
+		double rate = (elapsed > 0) ? (double)bytes * 1000.0 / (double)elapsed : 0.0;
+		bool slow = (bytes > 0) && (rate < floor[target]);
+		printf("%-10s %10.1f MB/s  floor %.1f%s\n", targetName[target], rate, floor[target], slow ? "  REGRESSION" : "");
+		failed |= slow;
+	}
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	double floor[FUZZ_TARGET_NUM] = { 0 };
+	long runs = 0;
+	unsigned seed = 1;
+	bool benchmark = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-runs=", 6) == 0)
+		{
+			runs = atol(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "-seed=", 6) == 0)
+		{
+			seed = (unsigned)atol(argv[i] + 6);
+		}
+		else if (strcmp(argv[i], "-bench") == 0)
+		{
+			benchmark = true;
+		}
+		else if (strncmp(argv[i], "-min=", 5) == 0)
+		{
+			sscanf(argv[i] + 5, "%lf,%lf,%lf,%lf", &floor[0], &floor[1], &floor[2], &floor[3]);
+		}
+		else
+		{
+			corpus_add(argv[i]);
+		}
+	}
+
+	if (corpusCount == 0)
+	{
+		fprintf(stderr, "No inputs\n");
+		return 2;
+	}
+
+	// RFC 6455 section 1.3 example, the properties alone would pass a wrong key
+	char accept[WS_ACCEPT_LENGTH];
+	assert(ws_handshake_accept("GET / HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n", accept, sizeof(accept)));
+	assert(strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") == 0);
+
+	for (int i = 0; i < corpusCount; i++)
+	{
+		LLVMFuzzerTestOneInput(corpus[i].data, corpus[i].size);
+	}
+	printf("%d inputs ok\n", corpusCount);
+
+	srand(seed);
+	uint8_t *mutant = malloc(FUZZ_INPUT_MAX);
+	for (long run = 0; run < runs; run++)
+	{
+		const fuzzInput *input = &corpus[rand() % corpusCount];
+
+		memcpy(mutant, input->data, input->size);
+		LLVMFuzzerTestOneInput(mutant, mutate(mutant, input->size));
+	}
+	free(mutant);
+	if (runs > 0)
+	{
+		printf("%ld mutated runs ok, seed %u\n", runs, seed);
+	}
+
+	return benchmark ? bench(floor) : 0;
+}
+#endif
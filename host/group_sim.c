@@ -0,0 +1,412 @@
+/* Group channel with N simulated robots
+
+   Every robot is a process running the firmware's group datagram handling
+   on a socket of its own on the loopback interface, with its own robot id
+   and a clock hours apart from the others. The coach sends each datagram
+   to all of them, standing in for the multicast group, and checks:
+   discovery, commands refused before sync, clock sync over unicast, "to"
+   masks addressing a subset, malformed masks addressing nobody, repeated
+   sequence numbers dropped, a second coach locked out and the coach back
+   after a silence still in control.
+     group_sim [-n robots]
+*/
+
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "group.c"
+
+#define SIM_ROBOT_MAX			32
+#define SIM_ROBOT_CLOCK_US		3700000000LL	/* robot n's clock runs n times this ahead of the coach */
+#define SIM_ROBOT_IDLE_MS		10000			/* robots exit once the coach is gone this long */
+#define SIM_REPLY_WINDOW_MS		300				/* replies expected within, silence checked this long */
+#define SIM_SYNC_EXCHANGES		4
+#define SIM_LEAD_MS				50
+#define SIM_LATENCY_MAX_MS		25.0			/* loopback, plus the sync error and a sanitized build */
+
+typedef struct simRobot_t
+{
+	pid_t pid;
+	struct sockaddr_in addr;
+} simRobot;
+
+static simRobot robots[SIM_ROBOT_MAX];
+static int robotCount = 4;
+static int failures;
+
+#define SIM_CHECK(condition, ...) \
+	do { \
+		if (!(condition)) \
+		{ \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			failures++; \
+		} \
+	} while (0)
+
+/* Robot process: bind, tell the coach the port, handle datagrams */
+static void robot_run(int id, int ready)
+{
+	struct sockaddr_in addr, sourceAddr;
+	socklen_t addrLen = sizeof(addr);
+	struct timeval timeout = { .tv_sec = SIM_ROBOT_IDLE_MS / 1000 };
+	uint8_t rx_buffer[GROUP_PACKET_LENGTH];
+
+	host_robot_id = id;
+	host_time_offset = id * SIM_ROBOT_CLOCK_US;
+
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((sock < 0) || (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+		(getsockname(sock, (struct sockaddr *)&addr, &addrLen) != 0))
+	{
+		perror("robot socket");
+		exit(1);
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (write(ready, &addr.sin_port, sizeof(addr.sin_port)) != sizeof(addr.sin_port))
+	{
+		exit(1);
+	}
+	close(ready);
+
+	for (;;)
+	{
+		addrLen = sizeof(sourceAddr);
+		int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&sourceAddr, &addrLen);
+		int64_t received = esp_timer_get_time();
+
+		if (len < 0)
+		{
+			exit(0);
+		}
+		group_datagram(sock, &sourceAddr, rx_buffer, len, received);
+	}
+}
+
+static bool robots_start(void)
+{
+	for (int i = 0; i < robotCount; i++)
+	{
+		int ready[2];
+		uint16_t port;
+
+		if (pipe(ready) != 0)
+		{
+			return false;
+		}
+		fflush(stdout);
+		robots[i].pid = fork();
+		if (robots[i].pid == 0)
+		{
+			close(ready[0]);
+			robot_run(i + 1, ready[1]);
+		}
+		close(ready[1]);
+		if ((robots[i].pid < 0) || (read(ready[0], &port, sizeof(port)) != sizeof(port)))
+		{
+			close(ready[0]);
+			return false;
+		}
+		close(ready[0]);
+
+		memset(&robots[i].addr, 0, sizeof(robots[i].addr));
+		robots[i].addr.sin_family = AF_INET;
+		robots[i].addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		robots[i].addr.sin_port = port;
+	}
+	return true;
+}
+
+static void robots_stop(void)
+{
+	for (int i = 0; i < robotCount; i++)
+	{
+		if (robots[i].pid > 0)
+		{
+			kill(robots[i].pid, SIGTERM);
+			waitpid(robots[i].pid, NULL, 0);
+		}
+	}
+}
+
+static int coach_socket(void)
+{
+	struct sockaddr_in addr;
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((sock < 0) || (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0))
+	{
+		perror("coach socket");
+		exit(1);
+	}
+	return sock;
+}
+
+/* Coach clock in milliseconds, the host clock without a robot's offset */
+static double coach_ms(void)
+{
+	return esp_timer_get_time() / 1000.0;
+}
+
+/* Sequence number and JSON to one robot, or to all of them for robot 0 */
+static void coach_send(int sock, int robot, uint32_t seq, const char *json)
+{
+	uint8_t packet[GROUP_PACKET_LENGTH];
+	size_t length = strlen(json);
+
+	packet[0] = seq >> 24;
+	packet[1] = seq >> 16;
+	packet[2] = seq >> 8;
+	packet[3] = seq;
+	memcpy(&packet[GROUP_SEQ_LENGTH], json, length);
+
+	for (int i = 0; i < robotCount; i++)
+	{
+		if ((robot == 0) || (robot == i + 1))
+		{
+			sendto(sock, packet, GROUP_SEQ_LENGTH + length, 0, (struct sockaddr *)&robots[i].addr, sizeof(robots[i].addr));
+		}
+	}
+}
+
+/* Next reply, NULL if none came within timeoutMs */
+static cJSON *coach_receive(int sock, int timeoutMs)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	char buf[GROUP_PACKET_LENGTH];
+
+	if (poll(&pfd, 1, timeoutMs) <= 0)
+	{
+		return NULL;
+	}
+	int len = recv(sock, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+	{
+		return NULL;
+	}
+	buf[len] = 0;
+	return cJSON_Parse(buf);
+}
+
+/* Replies within the window by robot id, returns how many robots answered */
+static int coach_collect(int sock, cJSON *reply[SIM_ROBOT_MAX + 1])
+{
+	int64_t end = esp_timer_get_time() + SIM_REPLY_WINDOW_MS * 1000;
+	int count = 0;
+	cJSON *root;
+
+	memset(reply, 0, (SIM_ROBOT_MAX + 1) * sizeof(cJSON *));
+	while ((root = coach_receive(sock, (int)((end - esp_timer_get_time()) / 1000))) != NULL)
+	{
+		double robot;
+
+		if (!command_json_number(root, "robot", &robot) || (robot < 1) || (robot > robotCount) ||
+			(reply[(int)robot] != NULL))
+		{
+			SIM_CHECK(false, "unexpected reply %s", cJSON_PrintUnformatted(root));
+			cJSON_Delete(root);
+			continue;
+		}
+		reply[(int)robot] = root;
+		count++;
+	}
+	return count;
+}
+
+static void coach_release(cJSON *reply[SIM_ROBOT_MAX + 1])
+{
+	for (int i = 0; i <= SIM_ROBOT_MAX; i++)
+	{
+		cJSON_Delete(reply[i]);
+	}
+}
+
+static double reply_number(const cJSON *reply, const char *name)
+{
+	double value;
+
+	return ((reply != NULL) && command_json_number(reply, name, &value)) ? value : NAN;
+}
+
+static void check_discover(int sock, uint32_t seq, bool synced)
+{
+	cJSON *reply[SIM_ROBOT_MAX + 1];
+
+	coach_send(sock, 0, seq, "{\"discover\":1}");
+	SIM_CHECK(coach_collect(sock, reply) == robotCount, "not every robot answered the discovery");
+	for (int id = 1; id <= robotCount; id++)
+	{
+		SIM_CHECK(reply_number(reply[id], "seq") == seq, "robot %d: discovery seq", id);
+		SIM_CHECK(reply_number(reply[id], "synced") == synced, "robot %d: synced should be %d", id, synced);
+	}
+	coach_release(reply);
+}
+
+/* NTP-style exchanges with one robot, unicast like a real coach does */
+static void sync_robot(int sock, int id, uint32_t *seq)
+{
+	char json[128];
+
+	for (int exchange = 0; exchange < SIM_SYNC_EXCHANGES; exchange++)
+	{
+		snprintf(json, sizeof(json), "{\"sync\":%.3f}", coach_ms());
+		coach_send(sock, id, ++*seq, json);
+		cJSON *root = coach_receive(sock, SIM_REPLY_WINDOW_MS);
+		double c3 = coach_ms();
+		cJSON *sync = cJSON_GetObjectItem(root, "sync");
+
+		SIM_CHECK(sync != NULL, "robot %d: no sync reply", id);
+		if (sync != NULL)
+		{
+			snprintf(json, sizeof(json), "{\"synced\":{\"c0\":%.3f,\"r1\":%.3f,\"c3\":%.3f}}",
+				reply_number(sync, "c0"), reply_number(sync, "r1"), c3);
+			coach_send(sock, id, ++*seq, json);
+		}
+		cJSON_Delete(root);
+	}
+}
+
+/* A command to mask (all robots if negative), checks who acknowledged */
+static void check_command(int sock, uint32_t seq, int64_t mask, bool synced)
+{
+	cJSON *reply[SIM_ROBOT_MAX + 1];
+	char json[160];
+	double now = coach_ms();
+
+	if (mask < 0)
+	{
+		snprintf(json, sizeof(json), "{\"sent\":%.3f,\"at\":%.3f,\"BPM\":30}", now, now + SIM_LEAD_MS);
+	}
+	else
+	{
+		snprintf(json, sizeof(json), "{\"to\":%lld,\"sent\":%.3f,\"at\":%.3f,\"BPM\":30}",
+			(long long)mask, now, now + SIM_LEAD_MS);
+	}
+	coach_send(sock, 0, seq, json);
+	coach_collect(sock, reply);
+
+	for (int id = 1; id <= robotCount; id++)
+	{
+		bool addressed = (mask < 0) || (mask & ((int64_t)1 << (id - 1)));
+		double latency = reply_number(reply[id], "latency");
+		double lead = reply_number(reply[id], "lead");
+
+		SIM_CHECK((reply[id] != NULL) == addressed, "robot %d: %s to %s", id,
+			addressed ? "no ack" : "acknowledged a command", json);
+		if (!addressed || (reply[id] == NULL))
+		{
+			continue;
+		}
+		SIM_CHECK(reply_number(reply[id], "ack") == seq, "robot %d: ack seq", id);
+		SIM_CHECK(reply_number(reply[id], "ok") == synced, "robot %d: ok should be %d", id, synced);
+		if (synced)
+		{
+			SIM_CHECK(fabs(latency) < SIM_LATENCY_MAX_MS, "robot %d: latency %.3f ms", id, latency);
+			SIM_CHECK(fabs(lead + latency - SIM_LEAD_MS) < SIM_LATENCY_MAX_MS, "robot %d: lead %.3f ms", id, lead);
+		}
+		else
+		{
+			SIM_CHECK(isnan(latency) && isnan(lead), "robot %d: latency without a clock sync", id);
+		}
+	}
+	coach_release(reply);
+}
+
+/* Datagrams no robot may act on */
+static void check_silent(int sock, uint32_t seq, const char *json)
+{
+	cJSON *reply[SIM_ROBOT_MAX + 1];
+
+	coach_send(sock, 0, seq, json);
+	SIM_CHECK(coach_collect(sock, reply) == 0, "robots answered %s", json);
+	coach_release(reply);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const malformed[] = { "-1", "4294967296", "1e300", "\"3\"", "null", "[1]" };
+	uint32_t seq = 0xFFFFFFF0;		// wraps during the run
+	char json[96];
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc))
+		{
+			robotCount = atoi(argv[++i]);
+		}
+	}
+	if ((robotCount < 1) || (robotCount > SIM_ROBOT_MAX))
+	{
+		fprintf(stderr, "usage: %s [-n 1..%d]\n", argv[0], SIM_ROBOT_MAX);
+		return 2;
+	}
+	if (!robots_start())
+	{
+		perror("starting robots");
+		robots_stop();
+		return 1;
+	}
+
+	int sock = coach_socket();
+
+	check_discover(sock, ++seq, false);
+	check_command(sock, ++seq, -1, false);
+
+	for (int id = 1; id <= robotCount; id++)
+	{
+		sync_robot(sock, id, &seq);
+	}
+	check_discover(sock, ++seq, true);
+
+	int64_t odd = 0;
+	for (int id = 1; id <= robotCount; id += 2)
+	{
+		odd |= (int64_t)1 << (id - 1);
+	}
+	check_command(sock, ++seq, odd, true);
+	check_command(sock, ++seq, (int64_t)1 << (robotCount - 1), true);
+	check_command(sock, ++seq, 0, true);
+	check_command(sock, ++seq, -1, true);
+
+	for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+	{
+		snprintf(json, sizeof(json), "{\"to\":%s,\"BPM\":30}", malformed[i]);
+		check_silent(sock, ++seq, json);
+	}
+
+	// Repeated and older sequence numbers are late duplicates
+	check_silent(sock, seq, "{\"BPM\":30}");
+	check_silent(sock, seq - 1, "{\"BPM\":30}");
+
+	// Another sender on the same host finds the robots, but neither drives
+	// them nor is told it is synced while the coach is active
+	int other = coach_socket();
+	check_discover(other, 1, false);
+	check_silent(other, 2, "{\"BPM\":30}");
+	check_command(sock, ++seq, -1, true);
+	close(other);
+
+	// The coach back after a silence, restarted with a new sequence, keeps
+	// control and its clock sync
+	usleep((GROUP_COACH_TIMEOUT_MS + SIM_REPLY_WINDOW_MS) * 1000);
+	seq = 1;
+	check_discover(sock, ++seq, true);
+	check_command(sock, ++seq, -1, true);
+
+	close(sock);
+	robots_stop();
+	printf("%d robots, %s\n", robotCount, (failures == 0) ? "group checks ok" : "group checks FAILED");
+	return (failures == 0) ? 0 : 1;
+}
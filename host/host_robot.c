@@ -0,0 +1,76 @@
+/* Stand-ins for the robot side of the host-built sources
+
+   The servo path only logs what it is handed, weak so that a tool running
+   servo_core.c like replay.c brings its own. The mixer is the robot's, it
+   first checks the contract the command parsers guarantee: any value that
+   reaches it has to be finite and in range.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Servo.h"
+#include "servo_core.h"
+#include "boot.h"
+#include "power.h"
+#include "recorder.h"
+#include "host_robot.h"
+
+hostServo hostServoLog;
+int host_robot_id = 1;
+
+void host_servo_reset(void)
+{
+	memset(&hostServoLog, 0, sizeof(hostServoLog));
+}
+
+__attribute__((weak)) bool servo_schedule(const servoSetpoint *setpoint, uint8_t count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		hostServoLog.setpoint[hostServoLog.count % HOST_SETPOINT_NUM] = setpoint[i];
+		hostServoLog.count++;
+	}
+	return true;
+}
+
+void servo_spin_mix(const joystick *spin, int16_t speed[SERVO_WHEEL_NUM])
+{
+	if (!isfinite(spin->angle) || !isfinite(spin->distance) ||
+		(spin->distance < 0) || (spin->distance > 100))
+	{
+		abort();
+	}
+
+	servo_core_mix(spin, speed);
+}
+
+void servo_alive()
+{
+	hostServoLog.alive++;
+}
+
+__attribute__((weak)) void servo_safe_stop(servoTrip reason)
+{
+	hostServoLog.trips++;
+	hostServoLog.lastTrip = reason;
+}
+
+void boot_mark(bootPhase phase)
+{
+}
+
+bool boot_wait(bootPhase phase, TickType_t timeout)
+{
+	return true;
+}
+
+void power_wake()
+{
+}
+
+/* Weak, a host tool linking the real recorder gets that one */
+__attribute__((weak)) void recorder_write(recordType type, const uint8_t *payload, uint8_t length)
+{
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Servo.h"
+
+/* What the command path handed to the servo path, newest last */
+#define HOST_SETPOINT_NUM	64
+
+typedef struct hostServo_t
+{
+	servoSetpoint setpoint[HOST_SETPOINT_NUM];
+	uint32_t count;				/* setpoints scheduled so far, the array wraps */
+	uint32_t alive;				/* servo_alive() calls */
+	uint32_t trips;
+	servoTrip lastTrip;
+} hostServo;
+
+extern hostServo hostServoLog;
+
+void host_servo_reset(void);
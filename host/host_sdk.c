@@ -0,0 +1,115 @@
+/* Host implementation of the SDK calls the host-built firmware sources make
+
+   Enough of FreeRTOS, the timer and logging to run command parsing, clock
+   sync and the group channel in a host process. Tasks are threads, critical
+   sections one recursive lock.
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+int host_log_level;
+int64_t host_time_offset;
+bool host_time_frozen;
+
+static pthread_mutex_t critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+__attribute__((constructor)) static void host_sdk_init(void)
+{
+	const char *level = getenv("HOST_LOG");
+
+	host_log_level = (level != NULL) ? atoi(level) : 0;
+}
+
+void host_critical_enter(void)
+{
+	pthread_mutex_lock(&critical);
+}
+
+void host_critical_exit(void)
+{
+	pthread_mutex_unlock(&critical);
+}
+
+int64_t esp_timer_get_time(void)
+{
+	struct timespec now;
+
+	if (host_time_frozen)
+	{
+		return host_time_offset;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 + host_time_offset;
+}
+
+typedef struct hostTask_t
+{
+	TaskFunction_t function;
+	void *argument;
+} hostTask;
+
+static void *host_task_run(void *argument)
+{
+	hostTask task = *(hostTask *)argument;
+
+	free(argument);
+	task.function(task.argument);
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *argument, UBaseType_t priority, TaskHandle_t *handle)
+{
+	hostTask *task = malloc(sizeof(*task));
+	pthread_t thread;
+
+	if (task == NULL)
+	{
+		return pdFAIL;
+	}
+	task->function = function;
+	task->argument = argument;
+	if (pthread_create(&thread, NULL, host_task_run, task) != 0)
+	{
+		free(task);
+		return pdFAIL;
+	}
+	pthread_detach(thread);
+	if (handle != NULL)
+	{
+		*handle = (TaskHandle_t)thread;
+	}
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	if (task == NULL)
+	{
+		pthread_exit(NULL);
+	}
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	usleep((useconds_t)ticks * portTICK_PERIOD_MS * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(esp_timer_get_time() / (portTICK_PERIOD_MS * 1000));
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	return (code == ESP_OK) ? "ESP_OK" : "ESP_FAIL";
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* Declaration only, the host tool reading the sensor supplies it */
+esp_err_t adc_read(uint16_t *data);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK					0
+#define ESP_FAIL				-1
+#define ESP_ERR_NO_MEM			0x101
+#define ESP_ERR_INVALID_SIZE	0x104
+#define ESP_ERR_NVS_NOT_FOUND	0x1102
+
+const char *esp_err_to_name(esp_err_t code);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdio.h>
+
+/* Quiet unless HOST_LOG=1 (errors) .. 5 (verbose) is set, the fuzzer calls
+   into logging paths millions of times */
+extern int host_log_level;
+
+#define HOST_LOG(level, letter, tag, format, ...) \
+	do { if (host_log_level >= (level)) fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__); } while (0)
+
+#define ESP_LOGE(tag, format, ...)	HOST_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)	HOST_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)	HOST_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)	HOST_LOG(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)	HOST_LOG(5, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Monotonic microseconds plus host_time_offset, so simulated robots in
+   one host each get a clock of their own */
+extern int64_t host_time_offset;
+/* Stops the clock at host_time_offset, a replay steps it to recorded times */
+extern bool host_time_frozen;
+
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,29 @@
+#pragma once
+
+/* Host stand-in for the part of the FreeRTOS API the host-built sources use,
+   implemented on pthreads in host_sdk.c. The tick is 1 ms as on the robot. */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE					1
+#define pdFALSE					0
+#define pdPASS					1
+#define pdFAIL					0
+#define portMAX_DELAY			0xffffffffu
+#define configTICK_RATE_HZ		1000
+#define configMAX_PRIORITIES	15
+#define portTICK_PERIOD_MS		(1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)		((TickType_t)(ms) / portTICK_PERIOD_MS)
+
+/* One process-wide recursive lock, the robot masks interrupts instead */
+void host_critical_enter(void);
+void host_critical_exit(void);
+#define taskENTER_CRITICAL()	host_critical_enter()
+#define taskEXIT_CRITICAL()		host_critical_exit()
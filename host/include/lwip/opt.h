@@ -0,0 +1,3 @@
+#pragma once
+
+#define DEFAULT_THREAD_STACKSIZE	3072
@@ -0,0 +1,8 @@
+#pragma once
+
+/* lwIP follows the BSD socket API, the host's own sockets stand in */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
@@ -0,0 +1,17 @@
+#pragma once
+
+/* Host builds use the firmware defaults of the options the host parts read */
+
+#define CONFIG_GROUP_ADDRESS "239.255.42.1"
+#define CONFIG_GROUP_PORT 8082
+/* Robots simulated in one host each set their id at run time */
+extern int host_robot_id;
+#define CONFIG_GROUP_ROBOT_ID host_robot_id
+
+#define CONFIG_RECORDER_ENABLE 1
+#define CONFIG_RECORDER_BUFFER_SIZE 8192
+
+#define CONFIG_CALIB_ADC_THRESHOLD 512
+#define CONFIG_CALIB_BALL_DIAMETER_MM 40
+#define CONFIG_CALIB_BALLS_PER_POINT 3
+#define CONFIG_CALIB_BPM 20
@@ -0,0 +1,739 @@
+/* Session capture replay
+
+   Decodes a capture downloaded from a robot ({"record":"download"}, or
+   session.bin from SPIFFS), prints the timing of its commands and PWM
+   commits and feeds the commands through the host command path again on a
+   clock stepped to the recorded times. Behind the command path runs the
+   robot's servo_core.c, its mixer, schedule, coalescing and feeder ramp, with
+   every deadline met on time. Each replayed PWM commit is looked up among
+   the robot's: how much later the same duties went out is the robot's own
+   lag, duties it never put out were coalesced away or mixed differently.
+   Everything comes out the same on every run, so a lag report can be
+   reproduced and profiled without the robot.
+
+   Heartbeats are not recorded, the replay keeps the watchdog fed and applies
+   the capture's safe stops at their times instead. It starts with the ESCs
+   armed, the linear calibration and the outputs in their safe state.
+     replay [-v] capture...
+     replay -selftest    records a scripted session through the recorder,
+                         reads it back in small chunks and replays that
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "command.h"
+#include "recorder.h"
+#include "servo_core.h"
+
+#define REPLAY_READ_CHUNK		100		/* self test reads back less than a WebSocket chunk */
+#define REPLAY_MATCH_US			1000000	/* how long after a replayed commit the robot's is looked for */
+#define REPLAY_ALIVE_TIME		(INT64_MAX / 2)	/* watchdog fed for good */
+#define SELFTEST_COMMANDS_MS	3000	/* the self test's client sends for this long */
+#define SELFTEST_MS				4500	/* then the wheels are at rest again */
+
+typedef struct replayRecord_t
+{
+	recordType type;
+	uint8_t length;
+	int64_t time;				/* unwrapped microseconds */
+	const uint8_t *payload;
+} replayRecord;
+
+typedef struct replaySeries_t
+{
+	int64_t *value;
+	size_t count;
+	size_t size;
+	bool failed;				/* values lost, out of memory */
+} replaySeries;
+
+/* PWM commit of the replayed servo path, duties in channel order */
+typedef struct replayCommit_t
+{
+	int64_t time;
+	uint32_t duty[PWM_CHANNEL_NUM];
+} replayCommit;
+
+/* What a capture and its replay came to */
+typedef struct replayResult_t
+{
+	size_t records;
+	size_t truncated;			/* bytes of an incomplete last record */
+	uint32_t status[RECORD_DROPPED + 1];
+	uint32_t pwm;
+	uint32_t marks;
+	uint32_t trips;
+	uint32_t malformed;			/* command payloads that do not decode */
+	uint32_t replayed;			/* commands the replay handed to the servo path */
+	uint32_t mismatch;			/* accepted/rejected differing from the capture */
+	uint32_t commits;			/* PWM commits of the replayed servo path */
+	uint32_t unmatched;			/* replayed commits the robot did not put out within REPLAY_MATCH_US */
+	int64_t lagMax;				/* longest the robot took for a replayed commit, microseconds */
+	bool outOfMemory;
+} replayResult;
+
+static const char *const statusName[] = { "accepted", "rejected", "dropped" };
+static bool verbose;
+
+/* Servo path of the replay, stepped by replay_servo_run() */
+static servoCore core;
+static replayCommit *commits;
+static size_t commitCount;
+static size_t commitSize;
+static bool commitFailed;
+
+/* Array with room for needed elements, doubled as often as it takes. NULL
+   if memory ran out, the array and its size are then left as they were. */
+static void *array_reserve(void *array, size_t *size, size_t needed, size_t element)
+{
+	size_t grown = (*size == 0) ? 256 : *size;
+	void *larger;
+
+	if ((array != NULL) && (needed <= *size))
+	{
+		return array;
+	}
+	while (grown < needed)
+	{
+		grown *= 2;
+	}
+	larger = realloc(array, grown * element);
+	if (larger == NULL)
+	{
+		fprintf(stderr, "replay: out of memory for %zu bytes\n", grown * element);
+		return NULL;
+	}
+	*size = grown;
+	return larger;
+}
+
+static void series_add(replaySeries *series, int64_t value)
+{
+	int64_t *values = array_reserve(series->value, &series->size, series->count + 1, sizeof(int64_t));
+
+	if (values == NULL)
+	{
+		series->failed = true;
+		return;
+	}
+	series->value = values;
+	series->value[series->count++] = value;
+}
+
+static int series_compare(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Milliseconds: count, min, median, 99th percentile, max */
+static void series_print(const char *name, replaySeries *series)
+{
+	size_t n = series->count;
+
+	if (n == 0)
+	{
+		printf("  %-28s none\n", name);
+		return;
+	}
+	qsort(series->value, n, sizeof(int64_t), series_compare);
+	printf("  %-28s n %-6zu min %8.3f  med %8.3f  p99 %8.3f  max %8.3f ms\n", name, n,
+		series->value[0] / 1000.0, series->value[n / 2] / 1000.0,
+		series->value[(n * 99) / 100] / 1000.0, series->value[n - 1] / 1000.0);
+}
+
+static void series_free(replaySeries *series)
+{
+	free(series->value);
+	memset(series, 0, sizeof(*series));
+}
+
+static int32_t read_s32(const uint8_t *data)
+{
+	return (int32_t)(((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3]);
+}
+
+/* Records of a capture in order. Times are the low 32 bits of the robot
+   clock, records are in time order so every step forward is taken modulo
+   2^32. The bytes of a cut off last record go to truncated. Returns false
+   if memory ran out. */
+static bool replay_decode(const uint8_t *data, size_t size, replayRecord **out, size_t *number, size_t *truncated)
+{
+	replayRecord *records = NULL;
+	size_t capacity = 0;
+	size_t count = 0;
+	size_t position = 0;
+	int64_t time = 0;
+
+	while (position + RECORD_HEADER_LENGTH <= size)
+	{
+		const uint8_t *header = &data[position];
+		uint32_t stamp = (uint32_t)read_s32(&header[2]);
+
+		if (position + RECORD_HEADER_LENGTH + header[1] > size)
+		{
+			break;
+		}
+
+		replayRecord *larger = array_reserve(records, &capacity, count + 1, sizeof(replayRecord));
+
+		if (larger == NULL)
+		{
+			free(records);
+			return false;
+		}
+		records = larger;
+		time = (count == 0) ? stamp : time + (uint32_t)(stamp - (uint32_t)time);
+		records[count].type = header[0];
+		records[count].length = header[1];
+		records[count].time = time;
+		records[count].payload = &header[RECORD_HEADER_LENGTH];
+		count++;
+		position += RECORD_HEADER_LENGTH + header[1];
+	}
+
+	*truncated = size - position;
+	*out = records;
+	*number = count;
+	return true;
+}
+
+static void replay_print_record(const replayRecord *record, int64_t start)
+{
+	double at = (record->time - start) / 1000.0;
+
+	switch (record->type)
+	{
+	case RECORD_COMMAND:
+		if (record->length == 5 + COMMAND_BINARY_LENGTH)
+		{
+			const uint8_t *p = record->payload;
+			printf("%10.3f command %-8s ahead %8.3f ms fields %02x BPM %u spin %d/%u pos %u/%u\n", at,
+				(p[0] <= RECORD_DROPPED) ? statusName[p[0]] : "?", read_s32(&p[1]) / 1000.0,
+				p[5], (p[6] << 8) | p[7], (int16_t)((p[8] << 8) | p[9]), p[10], p[11], p[12]);
+			return;
+		}
+		break;
+	case RECORD_PWM_COMMIT:
+		printf("%10.3f pwm    ", at);
+		for (int i = 0; i + 1 < record->length; i += 2)
+		{
+			printf(" %5u", (record->payload[i] << 8) | record->payload[i + 1]);
+		}
+		printf("\n");
+		return;
+	case RECORD_MARK:
+		printf("%10.3f mark\n", at);
+		return;
+	case RECORD_TRIP:
+		if (record->length == 1)
+		{
+			printf("%10.3f trip    reason %u\n", at, record->payload[0]);
+			return;
+		}
+		break;
+	}
+	printf("%10.3f type %u, %u bytes\n", at, record->type, record->length);
+}
+
+/* The robot's servo path on the clock the replay steps: safe outputs, ESCs
+   armed and nothing pending, as a capture finds a robot already up */
+static void replay_servo_init(void)
+{
+	servo_core_init(&core, esp_timer_get_time());
+	core.escArmed = true;
+	commitCount = 0;
+	commitFailed = false;
+}
+
+/* servo_commit() of the robot, the duties to the recorder and to commits */
+static void replay_servo_commit(int64_t now)
+{
+	uint8_t payload[PWM_CHANNEL_NUM * 2];
+	replayCommit *larger = array_reserve(commits, &commitSize, commitCount + 1, sizeof(replayCommit));
+
+	for (int channel = 0; channel < PWM_CHANNEL_NUM; channel++)
+	{
+		payload[channel * 2] = core.duty[channel] >> 8;
+		payload[channel * 2 + 1] = core.duty[channel];
+	}
+	recorder_write(RECORD_PWM_COMMIT, payload, sizeof(payload));
+
+	if (larger == NULL)
+	{
+		commitFailed = true;
+		return;
+	}
+	commits = larger;
+	commits[commitCount].time = now;
+	memcpy(commits[commitCount].duty, core.duty, sizeof(core.duty));
+	commitCount++;
+}
+
+/* The control task up to until, every deadline on the way stepped at its own
+   time. One already past is stepped at once, as the robot's wait returns at
+   once. Setpoints handled at the same time as the clock stands are left for
+   the next run, so commands arriving together are taken together. */
+static void replay_servo_run(int64_t until)
+{
+	int64_t deadline;
+	bool precise;
+	bool commit;
+
+	while ((deadline = servo_core_deadline(&core, REPLAY_ALIVE_TIME, &precise)) <= until)
+	{
+		host_time_offset = (deadline > host_time_offset) ? deadline : host_time_offset;
+		servo_core_step(&core, host_time_offset, REPLAY_ALIVE_TIME, &commit);
+		if (commit)
+		{
+			replay_servo_commit(host_time_offset);
+		}
+	}
+	host_time_offset = until;
+}
+
+/* servo_schedule() of the robot. The queue to the control task is left out,
+   on the stepped clock the control task takes it before the clock moves on. */
+bool servo_schedule(const servoSetpoint *setpoint, uint8_t count)
+{
+	servoEvent event;
+
+	if (servo_core_immediate(&core, setpoint, count, esp_timer_get_time()))
+	{
+		return true;
+	}
+	if (count > SERVO_CONTROL_QUEUE_LENGTH)
+	{
+		return false;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		servo_core_event(&core, &setpoint[i], &event);
+		servo_core_insert(&core, &event);
+	}
+	return true;
+}
+
+/* A safe stop from the capture, or the self test's client going silent */
+void servo_safe_stop(servoTrip reason)
+{
+	uint8_t payload = reason;
+
+	if (!core.tripped)
+	{
+		servo_core_trip(&core, reason, esp_timer_get_time());
+		recorder_write(RECORD_TRIP, &payload, sizeof(payload));
+	}
+}
+
+static bool replay_commit_equal(const replayRecord *record, const replayCommit *commit)
+{
+	if (record->length != PWM_CHANNEL_NUM * 2)
+	{
+		return false;
+	}
+	for (int channel = 0; channel < PWM_CHANNEL_NUM; channel++)
+	{
+		if (((record->payload[channel * 2] << 8) | record->payload[channel * 2 + 1]) != (uint16_t)commit->duty[channel])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Each replayed commit against the first commit of the robot from its time
+   on that carries the same duties */
+static void replay_compare(const replayRecord *records, size_t count, replaySeries *lag, replayResult *result)
+{
+	size_t first = 0;
+
+	for (size_t i = 0; i < commitCount; i++)
+	{
+		const replayCommit *commit = &commits[i];
+		bool found = false;
+
+		while ((first < count) && (records[first].time < commit->time))
+		{
+			first++;
+		}
+		for (size_t next = first; !found && (next < count) && (records[next].time <= commit->time + REPLAY_MATCH_US); next++)
+		{
+			if ((records[next].type == RECORD_PWM_COMMIT) && replay_commit_equal(&records[next], commit))
+			{
+				int64_t late = records[next].time - commit->time;
+
+				series_add(lag, late);
+				result->lagMax = (late > result->lagMax) ? late : result->lagMax;
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			result->unmatched++;
+		}
+	}
+	result->commits = commitCount;
+}
+
+/* Timing of the capture, then its commands through command_handle() again.
+   The capture does not say which client sent a command, the replay runs
+   them all through one rate limiter. A recording restart resets it. */
+static void replay_run(const replayRecord *records, size_t count, replayResult *result)
+{
+	replaySeries commandGap = {0}, ahead = {0}, pwmGap = {0}, actuation = {0}, lag = {0};
+	int64_t lastCommand = 0, lastPwm = 0;
+	commandClient client;
+
+	host_time_frozen = true;
+	host_time_offset = (count > 0) ? records[0].time : 0;
+	command_client_init(&client);
+	replay_servo_init();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const replayRecord *record = &records[i];
+
+		if (verbose)
+		{
+			replay_print_record(record, records[0].time);
+		}
+		if (record->time > host_time_offset)
+		{
+			replay_servo_run(record->time);
+		}
+
+		switch (record->type)
+		{
+		case RECORD_COMMAND:
+		{
+			const uint8_t *p = record->payload;
+			command cmd;
+
+			if ((record->length != 5 + COMMAND_BINARY_LENGTH) || (p[0] > RECORD_DROPPED) ||
+				!command_parse_binary(&p[5], COMMAND_BINARY_LENGTH, &cmd))
+			{
+				result->malformed++;
+				break;
+			}
+			result->status[p[0]]++;
+			cmd.at = record->time + read_s32(&p[1]);
+
+			if (lastCommand != 0)
+			{
+				series_add(&commandGap, record->time - lastCommand);
+			}
+			lastCommand = record->time;
+			series_add(&ahead, cmd.at - record->time);
+
+			// Due when it was handled or at its "at" time, whichever is later,
+			// the first commit from then on is when it could reach the outputs
+			if (p[0] == RECORD_ACCEPTED)
+			{
+				int64_t due = (cmd.at > record->time) ? cmd.at : record->time;
+
+				for (size_t next = i + 1; next < count; next++)
+				{
+					if ((records[next].type == RECORD_PWM_COMMIT) && (records[next].time >= due))
+					{
+						series_add(&actuation, records[next].time - due);
+						break;
+					}
+				}
+			}
+
+			bool accepted = command_handle(&client, &cmd);
+
+			// The replayed queue to the control task never fills, a drop replays as accepted
+			if ((p[0] != RECORD_DROPPED) && (accepted != (p[0] == RECORD_ACCEPTED)))
+			{
+				result->mismatch++;
+			}
+			if (accepted)
+			{
+				result->replayed++;
+			}
+			break;
+		}
+		case RECORD_PWM_COMMIT:
+			// A capture of another channel map can't be compared
+			if (record->length != PWM_CHANNEL_NUM * 2)
+			{
+				result->malformed++;
+				break;
+			}
+			result->pwm++;
+			if (lastPwm != 0)
+			{
+				series_add(&pwmGap, record->time - lastPwm);
+			}
+			lastPwm = record->time;
+			break;
+		case RECORD_MARK:
+			result->marks++;
+			command_client_init(&client);
+			lastCommand = 0;
+			lastPwm = 0;
+			break;
+		case RECORD_TRIP:
+			if ((record->length != 1) || (record->payload[0] == SERVO_TRIP_NONE) || (record->payload[0] >= SERVO_TRIP_NUM))
+			{
+				result->malformed++;
+				break;
+			}
+			result->trips++;
+			printf("  safe stop at %.3f ms, reason %u\n", (record->time - records[0].time) / 1000.0, record->payload[0]);
+			servo_safe_stop(record->payload[0]);
+			break;
+		default:
+			break;
+		}
+	}
+
+	host_time_frozen = false;
+	result->records = count;
+	replay_compare(records, count, &lag, result);
+	result->outOfMemory = commandGap.failed || ahead.failed || pwmGap.failed || actuation.failed || lag.failed || commitFailed;
+
+	printf("  %zu records over %.3f ms, %u marks, %u trips\n", count,
+		(count > 0) ? (records[count - 1].time - records[0].time) / 1000.0 : 0.0, result->marks, result->trips);
+	printf("  commands: %u accepted, %u rejected, %u dropped, %u malformed\n",
+		result->status[RECORD_ACCEPTED], result->status[RECORD_REJECTED],
+		result->status[RECORD_DROPPED], result->malformed);
+	series_print("command interval", &commandGap);
+	series_print("\"at\" ahead of arrival", &ahead);
+	series_print("PWM commit interval", &pwmGap);
+	series_print("command due to next commit", &actuation);
+	printf("  replay: %u commands to the servo path, %u differ from the capture\n",
+		result->replayed, result->mismatch);
+	printf("  replay: %u PWM commits, %u not put out by the robot within %d ms\n",
+		result->commits, result->unmatched, REPLAY_MATCH_US / 1000);
+	series_print("replayed commit to robot's", &lag);
+	if (result->outOfMemory)
+	{
+		printf("  out of memory, the figures above are incomplete\n");
+	}
+
+	series_free(&commandGap);
+	series_free(&ahead);
+	series_free(&pwmGap);
+	series_free(&actuation);
+	series_free(&lag);
+}
+
+static bool replay_buffer(const uint8_t *data, size_t size, replayResult *result)
+{
+	replayRecord *records;
+	size_t count;
+
+	if (!replay_decode(data, size, &records, &count, &result->truncated))
+	{
+		return false;
+	}
+	if (result->truncated != 0)
+	{
+		printf("  last %zu bytes are a cut off record\n", result->truncated);
+	}
+	replay_run(records, count, result);
+	free(records);
+	return (result->malformed == 0) && !result->outOfMemory;
+}
+
+static bool replay_file(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *data = NULL;
+	size_t capacity = 0;
+	size_t size = 0;
+	size_t length;
+	uint8_t chunk[4096];
+	replayResult result;
+
+	if (file == NULL)
+	{
+		perror(path);
+		return false;
+	}
+	while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0)
+	{
+		uint8_t *larger = array_reserve(data, &capacity, size + length, 1);
+
+		if (larger == NULL)
+		{
+			free(data);
+			fclose(file);
+			return false;
+		}
+		data = larger;
+		memcpy(&data[size], chunk, length);
+		size += length;
+	}
+	fclose(file);
+
+	printf("%s:\n", path);
+	memset(&result, 0, sizeof(result));
+	bool ok = replay_buffer(data, size, &result);
+	free(data);
+	return ok;
+}
+
+/* Everything a cursor can read now, in chunks the size of buf. Returns
+   false if memory ran out. */
+static bool selftest_drain(recordCursor *cursor, uint8_t **capture, size_t *size, size_t *capacity, size_t chunk)
+{
+	uint8_t buf[256];
+	size_t length;
+
+	assert(chunk <= sizeof(buf));
+	while ((length = recorder_read(cursor, buf, chunk)) > 0)
+	{
+		uint8_t *larger = array_reserve(*capture, capacity, *size + length, 1);
+
+		assert(length <= chunk);
+		if (larger == NULL)
+		{
+			return false;
+		}
+		*capture = larger;
+		memcpy(&(*capture)[*size], buf, length);
+		*size += length;
+	}
+	return true;
+}
+
+/* A scripted session on a stepped clock that wraps its low 32 bits halfway,
+   recorded through the replay's own servo path: a command every 20 ms
+   scheduled 30 ms ahead, a burst past the rate limit at 1 s, then the client
+   goes silent and the robot stops safely. Replaying it has to give the same
+   commits at the same times. One reader keeps up like the WebSocket
+   download, one starts late and is lapped. */
+static int selftest(void)
+{
+	const int64_t start = ((int64_t)1 << 32) - 1000000;
+	uint32_t expected[RECORD_DROPPED + 1] = {0};
+	uint8_t *capture = NULL, *lapped = NULL;
+	size_t size = 0, capacity = 0, lappedSize = 0, lappedCapacity = 0;
+	recordCursor reader, late;
+	commandClient client;
+	replayResult result;
+	bool ok = true;
+
+	host_time_frozen = true;
+	host_time_offset = start;
+	recorder_clear();
+	recorder_cursor_init(&reader);
+	recorder_cursor_init(&late);
+	command_client_init(&client);
+	replay_servo_init();
+
+	for (int64_t ms = 0; ms < SELFTEST_MS; ms += 5)
+	{
+		replay_servo_run(start + ms * 1000);
+
+		if (((ms % 20) == 0) && (ms < SELFTEST_COMMANDS_MS))
+		{
+			command cmd;
+
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.at = host_time_offset + 30000;
+			cmd.fields = COMMAND_FIELD_SPIN | COMMAND_FIELD_BPM;
+			cmd.spin.angle = ms % 360;
+			cmd.spin.distance = 50;
+			cmd.BPM = 60;
+			expected[command_handle(&client, &cmd) ? RECORD_ACCEPTED : RECORD_REJECTED]++;
+		}
+		if (ms == 1000)
+		{
+			for (int i = 0; i < COMMAND_BURST + 8; i++)
+			{
+				command cmd;
+
+				memset(&cmd, 0, sizeof(cmd));
+				cmd.at = host_time_offset;
+				cmd.fields = COMMAND_FIELD_POSITION;
+				cmd.position.x = i;
+				expected[command_handle(&client, &cmd) ? RECORD_ACCEPTED : RECORD_REJECTED]++;
+			}
+		}
+		if (ms == SELFTEST_COMMANDS_MS)
+		{
+			servo_safe_stop(SERVO_TRIP_TIMEOUT);
+		}
+
+		if ((ms % 100) == 0)
+		{
+			ok = selftest_drain(&reader, &capture, &size, &capacity, REPLAY_READ_CHUNK) && ok;
+		}
+	}
+	ok = selftest_drain(&reader, &capture, &size, &capacity, REPLAY_READ_CHUNK) && ok;
+	host_time_frozen = false;
+	// Feeder ramped down and wheels spun down before the session ended
+	assert(servo_core_at_rest(&core));
+
+	// A record never splits across reads, so a reader lapped by the writers
+	// lands on a record boundary and still decodes
+	ok = selftest_drain(&late, &lapped, &lappedSize, &lappedCapacity, REPLAY_READ_CHUNK) && ok;
+	if (!ok)
+	{
+		free(lapped);
+		free(capture);
+		return 1;
+	}
+	assert(reader.lost == 0);
+	assert(late.lost > 0);
+	assert(late.lost + lappedSize == size);
+	assert(memcmp(lapped, &capture[late.lost], lappedSize) == 0);
+
+	size_t recorded = commitCount;
+
+	printf("self test, %zu bytes recorded:\n", size);
+	memset(&result, 0, sizeof(result));
+	assert(replay_buffer(capture, size, &result));
+	assert(result.truncated == 0);
+	assert(result.marks == 1);
+	assert(result.trips == 1);
+	assert(result.pwm == recorded);
+	assert(result.commits == recorded);
+	assert(result.unmatched == 0);
+	assert(result.lagMax == 0);
+	assert(result.status[RECORD_ACCEPTED] == expected[RECORD_ACCEPTED]);
+	assert(result.status[RECORD_REJECTED] == expected[RECORD_REJECTED]);
+	assert(expected[RECORD_REJECTED] > 0);
+	assert(result.replayed == expected[RECORD_ACCEPTED]);
+	assert(result.mismatch == 0);
+
+	printf("self test ok\n");
+	free(lapped);
+	free(capture);
+	free(commits);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	bool ok = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-selftest") == 0)
+		{
+			return selftest();
+		}
+		else if (strcmp(argv[i], "-v") == 0)
+		{
+			verbose = true;
+		}
+		else
+		{
+			ok = replay_file(argv[i]) && ok;
+		}
+	}
+	free(commits);
+	return ok ? 0 : 1;
+}
@@ -6,7 +6,15 @@
 #include "SoftAP.h"
 #include "tcp_server.h"
 #include "websocket_server.h"
+#include "udp_server.h"
 #include "Servo.h"
+#include "boot.h"
+#include "sysmon.h"
+#include "recorder.h"
+#include "storage.h"
+#include "group.h"
+#include "power.h"
+#include "calibration.h"
 
 const char *TAG = "TTC_Robo";
 
@@ -14,7 +22,23 @@ void app_main()
 {
 	ESP_LOGI(TAG, "Hello from %s!", TAG);
 	
-	wifi_init();
+	boot_init();
+	sysmon_init();
+	recorder_init();
+	
+	// Actuators reach their safe state before any network task can command them
 	servo_init();
+	// NVS/WiFi, storage and the server come up in parallel, see bootEventGroup
+	wifi_init();
+	power_init();
+	calibration_init();
+	storage_init();
 	websocket_server_init();
+	tcp_server_init();
+#ifdef CONFIG_UDP_CONTROL_ENABLE
+	udp_server_init();
+#endif
+#ifdef CONFIG_GROUP_ENABLE
+	group_init();
+#endif
 }
\ No newline at end of file